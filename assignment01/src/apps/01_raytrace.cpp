@@ -1,399 +1,193 @@
-#include "scene.h"
-#include <iostream>
-
-// intersection record
-struct intersection3f {
-    bool        hit;        // whether it hits something
-    float       ray_t;      // ray parameter for the hit
-    vec3f       pos;        // hit position
-    vec3f       norm;       // hit normal
-    Material*   mat;        // hit material
-
-    // constructor (defaults to no intersection)
-    intersection3f() : hit(false) { }
-};
-
-#define ray3f_epsilon 0.0005f
-#define ray3f_rayinf 1000000.0f
-
-// 3D Ray
-struct ray3f {
-    vec3f e;        // origin
-    vec3f d;        // direction
-    float tmin;     // min t value
-    float tmax;     // max t value
-
-    // Default constructor
-    ray3f() : e(zero3f), d(z3f), tmin(ray3f_epsilon), tmax(ray3f_rayinf) { }
-
-    // Element-wise constructor
-    ray3f(const vec3f& e, const vec3f& d) :
-    e(e), d(d), tmin(ray3f_epsilon), tmax(ray3f_rayinf) { }
-
-    // Element-wise constructor
-    ray3f(const vec3f& e, const vec3f& d, float tmin, float tmax) :
-    e(e), d(d), tmin(tmin), tmax(tmax) { }
-
-    // Eval ray at a specific t
-    vec3f eval(float t) const { return e + d * t; }
-
-    // Create a ray from a segment
-    static ray3f make_segment(const vec3f& a, const vec3f& b) { return ray3f(a,normalize(b-a),ray3f_epsilon,dist(a,b)-2*ray3f_epsilon); }
-};
-
-// transform a ray by a frame
-inline ray3f transform_ray(const frame3f& f, const ray3f& v) {
-    return ray3f(transform_point(f,v.e), transform_vector(f,v.d), v.tmin, v.tmax);
-}
-// transform a ray by a frame inverse
-inline ray3f transform_ray_inverse(const frame3f& f, const ray3f& v) {
-    return ray3f(transform_point_inverse(f,v.e),transform_vector_inverse(f,v.d),v.tmin,v.tmax);
-}
-
-
-// intersects the scene and return the first intrerseciton
-intersection3f intersect(Scene* scene, ray3f ray) {
-
-
-    // create a default intersection record to be returned
-    auto intersection = intersection3f();
-    intersection.ray_t = ray3f_rayinf;
-
-
-    for(Surface *object : scene->surfaces){
-
-        // un transform ray into the object's frame
-        ray3f nRay = transform_ray_inverse(object->frame, ray);
-
-
-        if(object->isquad){
-
-            // check to see if on surface
-            // make sure the projection of the normal to the direction is not 0
-            if( dot(z3f, nRay.d) != 0){
-
-                // find t
-                // equation given: ((C-p) dot n) / d dot n
-                // C = zero because center is at the origin
-                // normal is the z vector of the frame
-                float t = (dot(-nRay.e, z3f)/dot(z3f, nRay.d));
-
-                // find point where t intersects the plane
-                vec3f xRay = nRay.eval(t);
-
-                // check to see if point is in the radius (bound the box)
-                if ( abs(xRay.x) < object->radius && abs(xRay.y) < object->radius){
-
-                    // check to see if t is in the range
-                    if ( t > ray.tmin && t < ray.tmax){
-
-                        // check to see if it is the closest thing
-                        if ( t < intersection.ray_t || !intersection.hit){
-
-                            // update intersection
-                            intersection.pos = ray.eval(t);
-                            intersection.hit = true;
-                            intersection.ray_t = t;
-                            intersection.mat = object->mat;
-                            intersection.norm = object->frame.z;
-                        }
-
-                    }
-                }
-            }
-        }
-
-        // else if it is a cylinder
-
-        else if (object->iscyl){
-            // find intersection
-
-            float a = nRay.d.x * nRay.d.x + (nRay.d.z * nRay.d.z);
-            float b = 2 * (nRay.d.x * nRay.e.x) + 2 * (nRay.d.z * nRay.e.z);
-            float c = ((nRay.e.x * nRay.e.x) - (object->radius * object->radius)) + ((nRay.e.z * nRay.e.z) - (object->radius * object->radius));
-
-
-
-            // calc determinant
-            float det = (b * b) - (4 * a * c);
-
-            // intersection only if the det is non negative ( det = 0 is a tangent )
-            if ( det >= 0 ){
-
-                // find t if there is an intersection
-                float t = ((-1 * b) - sqrt(det))/(2*a);
-                float t1 = ((-1 *b) + sqrt(det)/(2*a));
-
-
-                // find the y values for the intersections
-                float y = nRay.e.y + t * nRay.d.y;
-                float y1 = nRay.e.y + t1 * nRay.d.y;
-
-                // check to see if t is in the range
-                if ( t > nRay.tmin && t < nRay.tmax){
-
-                    // check to see if t is within bound of sphere
-                    // find point where t intersects the plane
-                    vec3f xRay = nRay.eval(t);
-
-                    // check to see if point is in the radius (bound the box)
-                    if ( abs(xRay.x) < object->radius && abs(xRay.y) < object->radius){
-
-                    // check to see if it is the closest thing
-                    if ( t < intersection.ray_t || !intersection.hit){
-
-                        // update intersection
-                        intersection.pos = ray.eval(t);
-                        intersection.hit = true;
-                        intersection.ray_t = t;
-                        intersection.mat = object->mat;
-                        intersection.norm = (ray.eval(t) - object->frame.o)/object->radius;
-                    }
-                   }
-                }
-            }
-        }
-
-
-        // else  if it is a sphere
-        else{
-
-           // make circle variables
-           // use the det function given in lecture slides 4
-           float a = dot(nRay.d, nRay.d);
-           float b = 2 * dot(nRay.d, nRay.e);
-           float c = dot(nRay.e, nRay.e) - (object->radius * object->radius);
-
-           // calc determinant
-           float det = (b * b) - (4 * a * c);
-
-           // intersection only if the det is non negative ( det = 0 is a tangent )
-           if ( det >= 0 ){
-
-               // find t if there is an intersection
-               float t = ((-1 * b) - sqrt(det))/(2*a);
-
-               // check to see if t is in the range
-               if ( t > nRay.tmin && t < nRay.tmax){
-
-                   // check to see if it is the closest thing
-                   if ( t < intersection.ray_t || !intersection.hit){
-
-                       // update intersection
-                       intersection.pos = ray.eval(t);
-                       intersection.hit = true;
-                       intersection.ray_t = t;
-                       intersection.mat = object->mat;
-                       intersection.norm = (ray.eval(t) - object->frame.o)/object->radius;
-                   }
-
-               }
-           }
-
-        }
-
-    // record closest intersection
-    }
-
-    return intersection;
+#include "raytrace.h"
+#include "parallel.h"
+#include "writer.h"
+#include "trace.h"
+#include <chrono>
+#include <fstream>
+#include <mutex>
+
+// filename of a frame of an image sequence: the image filename with _<frame>.png in place
+// of its extension (if any)
+string frame_filename(const string& image_filename, int frame) {
+    auto dot = image_filename.find_last_of("."), slash = image_filename.find_last_of("/\\");
+    auto has_extension = dot != string::npos and (slash == string::npos or dot > slash);
+    auto basename = (has_extension) ? image_filename.substr(0,dot) : image_filename;
+    return tostring("%s_%04d.png", basename.c_str(), frame);
 }
 
-
-
-// compute the color corresponding to a ray by raytracing
-vec3f raytrace_ray(Scene* scene, ray3f ray) {
-
-    // create a vector to hold the color
-    vec3f color = zero3f;
-    // get the closes shape to this point
-    intersection3f shape = intersect(scene, ray);
-
-    // if we didn't intersect anything
-    if (!shape.hit){
-        // return background
-        return scene->background;
-    }
-
-
-    else{
-    // accumulate color starting with ambient
-        // ambient color = ka * Ia
-        color = shape.mat->kd * scene->ambient;
-        for( Light *light : scene->lights){
-            // get the riemann sum of the lights
-
-            // compute light response
-            vec3f I = light->intensity/(lengthSqr(light->frame.o - shape.pos));
-
-            // compute light direction
-            vec3f ld = normalize(light->frame.o - shape.pos);
-
-            // get h
-            // h = norm of light direction and direction from ray
-            vec3f vd = normalize(ray.e - shape.pos);
-            vec3f h = normalize(ld + vd);
-
-
-            // compute the material response (brdf*cos)
-            // Sum of Ld + Ls
-            vec3f brdf = shape.mat->kd + shape.mat->ks* pow(max(0.0, dot(shape.norm, h)), shape.mat->n);
-            vec3f mat_res = I * brdf * max(0.0, dot(shape.norm, ld));
-
-            // check for shadows and accumulate if needed
-            // create a shadow ray using position of the intersection point and the lighting direction
-            // ray must be bounded = account for epsilon value, and teh max value located light.
-            ray3f shadowRay = ray3f(shape.pos, ld, ray3f_epsilon, ray3f_rayinf);
-            intersection3f shadowShape = intersect(scene, shadowRay);
-
-            // accumulate color only when there isn't shadow (aka leave shadows black)
-            if (!shadowShape.hit){
-                // add material response
-                color += mat_res;
-            }
-
-          }
-
-        // calc lm
-        if( shape.mat->kr != zero3f ){
-            // create the reflection ray
-            // r = 2(n dot vd)*n-vd
-            // n = shape.norm
-            vec3f vd = normalize(ray.e - shape.pos);
-            vec3f refl = (2 * dot(shape.norm, vd)) * shape.norm - vd;
-            ray3f reflRay = ray3f(shape.pos, refl, ray3f_epsilon, ray3f_rayinf);
-
-            // accumulate the reflected light (recursive call) scaled by the material reflection
-            color += shape.mat->kr * raytrace_ray(scene, reflRay);
-        }
-
-    }
-    return color;
-}
-
-
-
-// raytrace an image
-image3f raytrace(Scene* scene) {
-
-
-    // allocate an image of the proper size
-    auto image = image3f(scene->image_width, scene->image_height);
-
-
-    // if no anti-aliasing
-    // condition !(image_samples > 1)
-    if(!(scene->image_samples > 1)){
-
-
-        // for every pixel
-        for( int pRow = 0; pRow < scene->image_height; pRow++){
-            for( int pCol = 0; pCol < scene->image_width; pCol++){
-
-
-                // compute ray-camera parameters (u,v) for the pixel
-
-                float u = (pRow + .5)/scene->image_width;
-                float v = (pCol + .5)/scene->image_height;
-
-                // compute camera ray
-                vec3f x = ((u - .5) * scene->camera->width)*x3f;
-                vec3f y = ((v-.5)*scene->camera->height)*y3f;
-                vec3f z = scene->camera->dist * z3f;
-
-                auto camRay = (x + y - z);
-                ray3f normRay = ray3f(zero3f, normalize(camRay));
-
-                // transform ray into the coordinates of the camera frame
-                ray3f newRay = transform_ray(scene->camera->frame, normRay);
-
-                // get a color for the pixel
-                auto color = raytrace_ray(scene, newRay);
-                image.at(pRow, pCol) = color;
-
-            }
-        }
-    }
-    else{
-//        // for each pixel
-        for( int pRow = 0; pRow < scene->image_height; pRow++){
-            for( int pCol = 0; pCol < scene->image_width; pCol++){
-
-//               // init accumulated color
-                  vec3f color = zero3f;
-                  for( float ii = 0; ii < scene->image_samples; ii++ ){
-                      for(float jj = 0; jj < scene->image_samples; jj++){
-                          // compute ray-camera parameters (u,v) for the pixel and the sample
-                          float u = (pRow + (ii + 0.5)/scene->image_samples)/scene->image_width;
-                          float v = (pCol + (jj + 0.5)/scene->image_samples)/scene->image_height;
-
-                          // compute camera ray
-
-                          vec3f x = ((u - .5) * scene->camera->width)*x3f;
-                          vec3f y = ((v-.5)*scene->camera->height)*y3f;
-                          vec3f z = scene->camera->dist * z3f;
-
-                          auto camRay = (x + y - z);
-                          ray3f normRay = ray3f(zero3f, normalize(camRay));
-
-                         // transform ray into the coordinates of the camera frame
-                         ray3f newRay = transform_ray(scene->camera->frame, normRay);
-
-                         // get a color for the pixel
-                         color += raytrace_ray(scene, newRay);
-
-                      }
-                  }
-
-//                // scale by the number of samples
-                  image.at(pRow, pCol) = color/(scene->image_samples*scene->image_samples);
-            }
-          }
-       }
-    return image;
-}
-
-
-
-
-
-
-
-
 // runs the raytrace over all tests and saves the corresponding images
 int main(int argc, char** argv) {
     auto args = parse_cmdline(argc, argv,
         { "01_raytrace", "raytrace a scene",
-            {  {"resolution",     "r", "image resolution", typeid(int),    true,  jsonvalue()}  },
+            {  {"resolution",     "r", "image resolution", typeid(int),    true,  jsonvalue()},
+               {"rebuild",        "",  "rebuild the bvh of an animation when its sah cost grows by this factor", typeid(float), true, jsonvalue(1.5)},
+               {"threads",        "t", "number of threads (0 for all cores)", typeid(int), true, jsonvalue(0)},
+               {"turntable",      "",  "render a turntable sequence with this number of frames", typeid(int), true, jsonvalue(0)},
+               {"rotate_phi",     "",  "turntable rotation per frame (defaults to a full turn)", typeid(float), true, jsonvalue()},
+               {"dolly",          "",  "turntable dolly per frame", typeid(float), true, jsonvalue(0.0)},
+               {"pan_x",          "",  "turntable horizontal pan per frame", typeid(float), true, jsonvalue(0.0)},
+               {"pan_y",          "",  "turntable vertical pan per frame", typeid(float), true, jsonvalue(0.0)},
+               {"accelerator",    "",  "acceleration structure: bvh, bvh2, bvhq, lbvh, grid, none (defaults to the scene's)", typeid(string), true, jsonvalue("")},
+               {"lbvh_refine",    "",  "lbvh top levels refined by sah treelet restructuring (defaults to the scene's)", typeid(int), true, jsonvalue(-1)},
+               {"oversized_fraction", "", "surfaces larger than this fraction of the scene extent are tested outside the accelerator (defaults to the scene's)", typeid(float), true, jsonvalue(-1.0)},
+               {"accel_cache",    "",  "directory caching the built accelerators by scene geometry (not for animations)", typeid(string), true, jsonvalue("")},
+               {"out_of_core",    "",  "render with the surfaces paged from this cluster file, in stream mode (written from the scene if missing)", typeid(string), true, jsonvalue("")},
+               {"ooc_budget",     "",  "memory budget of the out-of-core pages in MB", typeid(float), true, jsonvalue(256.0)},
+               {"stream",         "",  "trace rays in sorted per-tile batches, bounce by bounce", typeid(bool), true, jsonvalue(false)},
+               {"cull_tiles",     "",  "test camera rays only against the surfaces projected onto their tile", typeid(bool), true, jsonvalue(false)},
+               {"sampler",        "",  "pixel sample pattern: regular, stratified, sobol, halton, bluenoise", typeid(string), true, jsonvalue("")},
+               {"spp",            "",  "samples per pixel with the sampler (any count)", typeid(int), true, jsonvalue(0)},
+               {"filter",         "",  "reconstruction filter: none, box, gaussian, mitchell, blackmanharris", typeid(string), true, jsonvalue("")},
+               {"filter_radius",  "",  "reconstruction filter radius in pixels (0 for the filter default)", typeid(float), true, jsonvalue(0.0)},
+               {"denoise",        "",  "denoise the images with an edge-aware a-trous filter", typeid(bool), true, jsonvalue(false)},
+               {"denoise_iterations", "", "denoiser a-trous passes", typeid(int), true, jsonvalue(5)},
+               {"huge_pages",     "",  "allocate the scene objects on huge pages", typeid(bool), true, jsonvalue(false)},
+               {"stats",          "",  "print ray and primitive test counters", typeid(bool), true, jsonvalue(false)},
+               {"stats_json",     "",  "write ray and primitive test counters to a json file", typeid(string), true, jsonvalue("")},
+               {"trace",          "",  "write a chrome trace_event json file of the run phases", typeid(string), true, jsonvalue("")}  },
             {  {"scene_filename", "",  "scene filename",   typeid(string), false, jsonvalue("scene.json")},
                {"image_filename", "",  "image filename",   typeid(string), true,  jsonvalue("")}  }
         });
 
+    // the startup phase spans from the process start to here
+    if(args.object_element("trace").as_string() != "") {
+        trace_enable();
+        trace_thread_name("main");
+        trace_record("startup", "app", 0, trace_now());
+    }
+
     // generate/load scene either by creating a test scene or loading from json file
+    arena_set_huge_pages(args.object_element("huge_pages").as_bool());
     string scene_filename = args.object_element("scene_filename").as_string();
+    // out-of-core scenes are loaded without their surfaces once their cluster file is written,
+    // and loaded whole to rewrite it when missing or written from another version of the scene
+    auto ooc_filename = args.object_element("out_of_core").as_string();
+    auto ooc_hash = (ooc_filename != "") ? ooc_scene_hash(scene_filename) : 0;
+    auto ooc_written = ooc_filename != "" and ooc_file_matches(ooc_filename, ooc_hash);
     Scene *scene = nullptr;
     if(scene_filename.length() > 9 and scene_filename.substr(0,9) == "testscene") {
         int scene_type = atoi(scene_filename.substr(9).c_str());
         scene = create_test_scene(scene_type);
         scene_filename = scene_filename + ".json";
     } else {
-        scene = load_json_scene(scene_filename);
+        scene = load_scene(scene_filename, not ooc_written);
     }
     error_if_not(scene, "scene is nullptr");
+    if(ooc_filename != "") {
+        error_if_not(not scene->animation_frames, "out-of-core scenes cannot be animated\n");
+        if(not ooc_written) {
+            if(std::ifstream(ooc_filename.c_str()).good()) message("%s was not written from this scene\n", ooc_filename.c_str());
+            message("writing out-of-core clusters to %s...\n", ooc_filename.c_str());
+            save_out_of_core(ooc_filename, scene, ooc_hash);
+        }
+        scene->surfaces.clear();
+        scene->ooc = load_out_of_core(ooc_filename, scene, (size_t)(args.object_element("ooc_budget").as_float() * (1 << 20)));
+    }
 
     auto image_filename = (args.object_element("image_filename").as_string() != "") ?
         args.object_element("image_filename").as_string() :
-        scene_filename.substr(0,scene_filename.size()-5)+".png";
+        scene_filename.substr(0,scene_filename.find_last_of("."))+".png";
 
     if(not args.object_element("resolution").is_null()) {
         scene->image_height = args.object_element("resolution").as_int();
         scene->image_width = scene->camera->width * scene->image_height / scene->camera->height;
     }
 
-    message("rendering %s...\n", scene_filename.c_str());
-    auto image = raytrace(scene);
+    if(args.object_element("stream").as_bool()) scene->stream_rays = true;
+    if(args.object_element("cull_tiles").as_bool()) scene->cull_tiles = true;
+    if(args.object_element("accelerator").as_string() != "") scene->accelerator = args.object_element("accelerator").as_string();
+    if(args.object_element("lbvh_refine").as_int() >= 0) scene->lbvh_refine = args.object_element("lbvh_refine").as_int();
+    if(args.object_element("oversized_fraction").as_float() >= 0) scene->oversized_fraction = args.object_element("oversized_fraction").as_float();
+    if(args.object_element("sampler").as_string() != "") scene->sampler = args.object_element("sampler").as_string();
+    if(args.object_element("spp").as_int() > 0) scene->pixel_samples = args.object_element("spp").as_int();
+    if(args.object_element("filter").as_string() != "") scene->filter = args.object_element("filter").as_string();
+    if(args.object_element("filter_radius").as_float() > 0) scene->filter_radius = args.object_element("filter_radius").as_float();
+
+    auto accel_cache = args.object_element("accel_cache").as_string();
+
+    parallel_set_nthreads(args.object_element("threads").as_int());
+
+    // raytrace an image, denoising it guided by the first hit features if requested
+    auto denoise = args.object_element("denoise").as_bool();
+    auto denoise_params = DenoiseParams();
+    denoise_params.iterations = args.object_element("denoise_iterations").as_int();
+    // rays/sec is measured over the wall time with renders in flight only (counted once for
+    // frames rendered concurrently), leaving out the accelerator builds and the image output
+    std::mutex render_mutex;
+    auto renders = 0;
+    auto render_start = std::chrono::steady_clock::now();
+    auto render_time = 0.0;
+    auto render = [&](Camera* camera, image3f& image) {
+        {
+            std::lock_guard<std::mutex> lock(render_mutex);
+            if(renders++ == 0) render_start = std::chrono::steady_clock::now();
+        }
+        if(not denoise) raytrace(scene, camera, image);
+        else {
+            auto aux = DenoiseAux(image.width(), image.height());
+            raytrace(scene, camera, image, &aux);
+            TRACE_SCOPE("denoise", "render");
+            denoise_inplace(image, aux, denoise_params);
+        }
+        std::lock_guard<std::mutex> lock(render_mutex);
+        if(--renders == 0) render_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - render_start).count();
+    };
+
+    // images are encoded by writer threads while the next frames render
+    ImageWriter writer(2, 4);
+
+    if(args.object_element("turntable").as_int() > 0) {
+        // orbit the camera around the static scene; the accelerator is built once and
+        // shared by all frames, which are traced concurrently (one per thread)
+        auto nframes = args.object_element("turntable").as_int();
+        auto rotate_phi = (args.object_element("rotate_phi").is_null()) ? 2*pif/nframes :
+            args.object_element("rotate_phi").as_float();
+        auto dolly = args.object_element("dolly").as_float();
+        auto pan_x = args.object_element("pan_x").as_float();
+        auto pan_y = args.object_element("pan_y").as_float();
+        build_accelerator(scene, accel_cache);
+        auto cameras = vector<Camera>(nframes, *scene->camera);
+        for(auto frame : range(1,nframes)) {
+            cameras[frame] = cameras[frame-1];
+            set_view_turntable(&cameras[frame], rotate_phi, 0, dolly, pan_x, pan_y);
+        }
+        message("rendering %s turntable (%d frames)...\n", scene_filename.c_str(), nframes);
+        parallel_for(nframes, [&](int frame){
+            auto image = writer.acquire(scene->image_width, scene->image_height);
+            render(&cameras[frame], image);
+            TRACE_SCOPE("queue_image", "io", frame);
+            writer.write(frame_filename(image_filename, frame), std::move(image), true);
+        });
+    } else if(scene->animation_frames > 0) {
+        // render the animation refitting the bvh to the moved surfaces, and
+        // rebuilding it only when the refitted tree degrades too much; grids are
+        // cheap enough to rebuild every frame
+        auto rebuild = args.object_element("rebuild").as_float();
+        auto built_cost = 0.0f;
+        for(auto frame : range(scene->animation_frames)) {
+            animate_accelerator(scene, frame, rebuild, built_cost);
+            message("rendering %s frame %d...\n", scene_filename.c_str(), frame);
+            auto image = writer.acquire(scene->image_width, scene->image_height);
+            render(scene->camera, image);
+            TRACE_SCOPE("queue_image", "io", frame);
+            writer.write(frame_filename(image_filename, frame), std::move(image), true);
+        }
+    } else {
+        build_accelerator(scene, accel_cache);
+
+        message("rendering %s...\n", scene_filename.c_str());
+        auto image = image3f(scene->image_width, scene->image_height);
+        render(scene->camera, image);
+
+        message("writing to png...\n");
+        writer.write(image_filename, std::move(image), true);
+    }
+    writer.flush();
 
-    message("writing to png...\n");
-    write_png(image_filename, image, true);
+    if(args.object_element("trace").as_string() != "") write_trace_json(args.object_element("trace").as_string());
+    if(args.object_element("stats").as_bool()) print_stats(stats_total(), render_time);
+    if(args.object_element("stats_json").as_string() != "")
+        write_stats_json(args.object_element("stats_json").as_string(), stats_total(), render_time);
 
     delete scene;
     message("done\n");
@@ -0,0 +1,178 @@
+#include "raytrace.h"
+#include <chrono>
+#include <random>
+
+// vector math backend this binary was compiled with
+#ifdef VMATH_SIMD
+const char* bench_backend = "simd";
+#else
+const char* bench_backend = "scalar";
+#endif
+
+// ray paired with the surface it is tested against
+struct bench_pair {
+    int         sid;    // surface index
+    ray3f       ray;    // ray in world space
+};
+
+// random numbers for the generated sets
+struct bench_rng {
+    std::mt19937                            gen;
+    std::uniform_real_distribution<float>   dist;
+
+    bench_rng(int seed) : gen(seed), dist(0,1) { }
+    // uniform in [min,max)
+    float next(float min = 0, float max = 1) { return min + (max-min) * dist(gen); }
+    // uniform direction
+    vec3f next_dir() {
+        auto z = next(-1,1), phi = next(0,2*pif), r = sqrt(max(0.0f,1-z*z));
+        return vec3f(r*cos(phi), r*sin(phi), z);
+    }
+};
+
+// random surfaces of one type with random frames and radii; spheres are tested in
+// object space unless worldsphere
+vector<Surface*> bench_surfaces(int nsurfaces, bool isquad, bool iscyl, bool worldsphere, bench_rng& rng, Arena& arena) {
+    auto surfaces = vector<Surface*>();
+    for(auto n = 0; n < nsurfaces; n ++) {
+        auto surface = arena.make<Surface>();
+        auto o = vec3f(rng.next(-10,10), rng.next(-10,10), rng.next(-10,10));
+        surface->frame = lookat_frame(o, o + rng.next_dir(), rng.next_dir());
+        surface->radius = rng.next(0.5f,2);
+        surface->isquad = isquad;
+        surface->iscyl = iscyl;
+        update_surface(surface);
+        surface->worldsphere = worldsphere;
+        surfaces.push_back(surface);
+    }
+    return surfaces;
+}
+
+// rays towards the surfaces that hit their bounds with probability hit_ratio; the
+// targets are inside (or outside) the sphere of radius r, or the square of side 2r for
+// quads, so the measured hit ratio of the buggy cylinder test differs from hit_ratio
+vector<bench_pair> bench_pairs(const vector<Surface*>& surfaces, int npairs, float hit_ratio, bench_rng& rng) {
+    auto pairs = vector<bench_pair>();
+    for(auto i : range(npairs)) {
+        auto sid = i % (int)surfaces.size();
+        auto surface = surfaces[sid];
+        auto hit = rng.next() < hit_ratio;
+        auto r = surface->radius;
+        auto target = zero3f, d = zero3f;
+        if(surface->isquad) {
+            // local target on the quad plane, ray from a side at least 0.2 off grazing
+            auto u = rng.next(0,0.9f*r), v = rng.next(0,0.9f*r);
+            if(not hit) u = rng.next(1.1f*r, 3*r);
+            target = transform_point(surface->frame, vec3f((rng.next() < 0.5f) ? u : -u, (rng.next() < 0.5f) ? v : -v, 0));
+            do { d = rng.next_dir(); } while(fabs(dot(d, surface->frame.z)) < 0.2f);
+        } else {
+            // target at distance (0,0.8r) from the center, or (1.2r,2r) off the line of the ray
+            d = rng.next_dir();
+            auto side = normalize(cross(d, rng.next_dir()));
+            target = surface->frame.o + side * ((hit) ? rng.next(0,0.8f*r) : rng.next(1.2f*r,2*r));
+        }
+        pairs.push_back(bench_pair{sid, ray3f(target - d * 20, d)});
+    }
+    return pairs;
+}
+
+// stores values where the compiler cannot drop them (without serializing the loop
+// through an accumulator)
+static volatile float bench_sink[8];
+inline void bench_keep(float v) { bench_sink[0] = v; }
+inline void bench_keep(const ray3f& ray) {
+    bench_sink[0] = ray.e.x; bench_sink[1] = ray.e.y; bench_sink[2] = ray.e.z;
+    bench_sink[3] = ray.d.x; bench_sink[4] = ray.d.y; bench_sink[5] = ray.d.z;
+}
+
+// runs func(pair) over all pairs, repeating until ntests calls; returns the best ns per call over nruns
+template<typename F>
+double bench_time(const vector<bench_pair>& pairs, int ntests, int nruns, const F& func) {
+    auto best = 0.0;
+    for(auto run : range(nruns)) {
+        auto start = std::chrono::steady_clock::now();
+        for(auto n = 0; n < ntests; ) {
+            for(auto& pair : pairs) { func(pair); n ++; }
+        }
+        auto elapsed = std::chrono::duration<double,std::nano>(std::chrono::steady_clock::now() - start).count();
+        auto ntotal = ((ntests + (int)pairs.size() - 1) / (int)pairs.size()) * pairs.size();
+        auto ns = elapsed / ntotal;
+        if(not run or ns < best) best = ns;
+    }
+    return best;
+}
+
+// measures the intersection kernels of every primitive type at several hit ratios,
+// and the ray transformation done before every test
+int main(int argc, char** argv) {
+    auto args = parse_cmdline(argc, argv,
+        { "bench_intersect", "microbenchmark the ray-primitive intersection tests",
+            {  {"tests",          "n", "tests per measurement", typeid(int), true, jsonvalue(1<<22)},
+               {"runs",           "",  "runs per measurement (best is reported)", typeid(int), true, jsonvalue(3)},
+               {"surfaces",       "",  "surfaces in each set", typeid(int), true, jsonvalue(64)},
+               {"rays",           "",  "rays in each set", typeid(int), true, jsonvalue(4096)},
+               {"seed",           "",  "random seed", typeid(int), true, jsonvalue(7)}  },
+            {  }
+        });
+    auto ntests = args.object_element("tests").as_int();
+    auto nruns = args.object_element("runs").as_int();
+    auto nsurfaces = args.object_element("surfaces").as_int();
+    auto nrays = args.object_element("rays").as_int();
+    auto rng = bench_rng(args.object_element("seed").as_int());
+
+    struct bench_type { const char* name; bool isquad, iscyl, worldsphere; };
+    auto types = vector<bench_type>{ {"sphere", false, false, true}, {"sphere-obj", false, false, false},
+                                     {"quad", true, false, false}, {"cylinder", false, true, false} };
+    auto hit_ratios = vector<float>{ 0, 0.5f, 1 };
+
+    message("backend: %s, %d surfaces, %d rays, %d tests per measurement\n\n", bench_backend, nsurfaces, nrays, ntests);
+    message("%-10s %8s %8s %12s %12s %12s\n", "primitive", "target", "hit %", "ns/test", "xform ns", "kernel ns");
+    for(auto& type : types) {
+        Arena arena;
+        auto surfaces = bench_surfaces(nsurfaces, type.isquad, type.iscyl, type.worldsphere, rng, arena);
+        for(auto hit_ratio : hit_ratios) {
+            auto pairs = bench_pairs(surfaces, nrays, hit_ratio, rng);
+            auto hits = 0;
+            for(auto& pair : pairs) {
+                auto isec = intersection3f();
+                intersect_surface(surfaces[pair.sid], pair.ray, isec);
+                if(isec.hit) hits ++;
+            }
+            auto test_ns = bench_time(pairs, ntests, nruns, [&](const bench_pair& pair){
+                auto isec = intersection3f();
+                isec.ray_t = ray3f_rayinf;
+                intersect_surface(surfaces[pair.sid], pair.ray, isec);
+                bench_keep(isec.ray_t);
+            });
+            // world space spheres skip the transform
+            auto xform_ns = (type.worldsphere) ? 0.0 : bench_time(pairs, ntests, nruns, [&](const bench_pair& pair){
+                auto ray = transform_ray_inverse(surfaces[pair.sid]->frame, pair.ray);
+                bench_keep(ray);
+            });
+            message("%-10s %7.0f%% %7.1f%% %12.2f %12.2f %12.2f\n", type.name, hit_ratio*100,
+                    100.0f * hits / pairs.size(), test_ns, xform_ns, test_ns - xform_ns);
+        }
+    }
+
+    // transform overhead: inverse transform per test versus a precomputed inverse frame
+    Arena arena;
+    auto surfaces = bench_surfaces(nsurfaces, false, false, false, rng, arena);
+    auto pairs = bench_pairs(surfaces, nrays, 0.5f, rng);
+    auto inverses = vector<frame3f>();
+    for(auto surface : surfaces) inverses.push_back(inverse(surface->frame));
+    auto inverse_ns = bench_time(pairs, ntests, nruns, [&](const bench_pair& pair){
+        auto ray = transform_ray_inverse(surfaces[pair.sid]->frame, pair.ray);
+        bench_keep(ray);
+    });
+    auto forward_ns = bench_time(pairs, ntests, nruns, [&](const bench_pair& pair){
+        auto ray = transform_ray(inverses[pair.sid], pair.ray);
+        bench_keep(ray);
+    });
+    auto copy_ns = bench_time(pairs, ntests, nruns, [&](const bench_pair& pair){
+        bench_keep(pair.ray);
+    });
+    message("\n%-40s %12s\n", "ray transform", "ns/ray");
+    message("%-40s %12.2f\n", "transform_ray_inverse(frame)", inverse_ns);
+    message("%-40s %12.2f\n", "transform_ray(precomputed inverse)", forward_ns);
+    message("%-40s %12.2f\n", "copy only (loop overhead)", copy_ns);
+}
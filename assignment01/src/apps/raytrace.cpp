@@ -0,0 +1,635 @@
+#include "raytrace.h"
+#include "parallel.h"
+#include "trace.h"
+#include "sampler.h"
+#include "film.h"
+#include "cache.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+void build_accelerator(Scene* scene, const string& cache_dirname) {
+    // out-of-core geometry comes with its bvhs, built when its file was written
+    if(scene->ooc) { scene->accelerator_build_time = 0; return; }
+    auto start = std::chrono::steady_clock::now();
+    // surfaces spanning most of the scene (ground planes) would enlarge every node or cell
+    // they overlap, so they are kept out of the accelerator and tested by every ray
+    scene->oversized = (scene->accelerator != "none") ? oversized_surfaces(scene, scene->oversized_fraction) : vector<int>();
+    // hashed once, since the cache is saved under the same name on a miss
+    auto hash = (cache_dirname != "") ? accelerator_hash(scene) : 0;
+    if(cache_dirname != "" and load_accelerator_cache(scene, cache_dirname, hash)) {
+        scene->accelerator_build_time = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+        message("loaded %s from the cache in %s\n", scene->accelerator.c_str(), cache_dirname.c_str());
+        return;
+    }
+    delete scene->bvh; scene->bvh = nullptr;
+    delete scene->grid; scene->grid = nullptr;
+    if(scene->accelerator == "bvh") scene->bvh = build_bvh(scene);
+    else if(scene->accelerator == "bvh2") scene->bvh = build_bvh(scene, 2);
+    else if(scene->accelerator == "bvhq") scene->bvh = build_bvh(scene, 4, true);
+    else if(scene->accelerator == "lbvh") scene->bvh = build_lbvh(scene, 4, false, scene->lbvh_refine);
+    else if(scene->accelerator == "grid") scene->grid = build_grid(scene);
+    else error_if_not(scene->accelerator == "none", "unknown accelerator %s\n", scene->accelerator.c_str());
+    scene->accelerator_build_time = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+    if(cache_dirname != "") save_accelerator_cache(scene, cache_dirname, hash);
+}
+
+void animate_accelerator(Scene* scene, int frame, float rebuild, float& built_cost) {
+    animate_scene(scene, frame);
+    if(frame == 0 or not scene->bvh) {
+        build_accelerator(scene);
+        built_cost = (scene->bvh) ? bvh_sah_cost(scene->bvh) : 0.0f;
+        return;
+    }
+    refit_bvh(scene->bvh, scene);
+    auto cost = bvh_sah_cost(scene->bvh);
+    if(cost > built_cost * rebuild) {
+        message("rebuilding bvh (sah cost %f -> %f)...\n", built_cost, cost);
+        build_accelerator(scene);
+        built_cost = bvh_sah_cost(scene->bvh);
+    }
+}
+
+size_t accelerator_memory(Scene* scene) {
+    if(scene->ooc) return ooc_memory(scene->ooc);
+    if(scene->bvh) return bvh_memory(scene->bvh);
+    if(scene->grid) return grid_memory(scene->grid);
+    return 0;
+}
+
+// intersects the scene and return the first intrerseciton
+intersection3f intersect(Scene* scene, ray3f ray) {
+
+
+    // create a default intersection record to be returned
+    auto intersection = intersection3f();
+    intersection.ray_t = ray3f_rayinf;
+
+    // surfaces kept out of the accelerator, first, since their hits shorten the traversal
+    for(auto sid : scene->oversized) intersect_surface(scene->surfaces[sid], ray, intersection);
+
+    // visit only the surfaces whose bounds are hit if an acceleration structure is available
+    // (out-of-core renders trace their rays with intersect_batch, single rays page in here)
+    if(scene->ooc){
+        ooc_intersect(scene->ooc, ray, intersection.ray_t, [&](Surface* surface){
+            intersect_surface(surface, ray, intersection);
+        });
+    }
+    else if(scene->bvh){
+        bvh_intersect(scene->bvh, ray, intersection.ray_t, [&](int sid){
+            intersect_surface(scene->surfaces[sid], ray, intersection);
+        });
+    }
+    else if(scene->grid){
+        grid_intersect(scene->grid, ray, intersection.ray_t, [&](int sid){
+            intersect_surface(scene->surfaces[sid], ray, intersection);
+        });
+    }
+    else{
+        for(Surface *object : scene->surfaces){
+            intersect_surface(object, ray, intersection);
+        }
+    }
+
+    // record closest intersection
+    if(intersection.hit) intersection.mat = &scene->materials[intersection.material];
+    return intersection;
+}
+
+// intersects a camera ray with the surfaces projected onto its tile (see tile_candidates)
+intersection3f intersect(Scene* scene, ray3f ray, const vector<Surface*>& candidates) {
+    auto intersection = intersection3f();
+    intersection.ray_t = ray3f_rayinf;
+    for(auto surface : candidates) intersect_surface(surface, ray, intersection);
+    if(intersection.hit) intersection.mat = &scene->materials[intersection.material];
+    return intersection;
+}
+
+
+
+// compute the material response to a light at the intersection (before shadowing),
+// and the shadow ray towards the light
+vec3f light_response(Light* light, const ray3f& ray, const intersection3f& shape, ray3f& shadowRay) {
+
+    // compute light response
+    vec3f I = light->intensity/(lengthSqr(light->frame.o - shape.pos));
+
+    // compute light direction
+    vec3f ld = normalize(light->frame.o - shape.pos);
+
+    // get h
+    // h = norm of light direction and direction from ray
+    vec3f vd = normalize(ray.e - shape.pos);
+    vec3f h = normalize(ld + vd);
+
+
+    // compute the material response (brdf*cos)
+    // Sum of Ld + Ls
+    vec3f brdf = shape.mat->kd + shape.mat->ks* pow(max(0.0, dot(shape.norm, h)), shape.mat->n);
+    vec3f mat_res = I * brdf * max(0.0, dot(shape.norm, ld));
+
+    // create a shadow ray using position of the intersection point and the lighting direction
+    // ray must be bounded = account for epsilon value, and teh max value located light.
+    shadowRay = ray3f(shape.pos, ld, ray3f_epsilon, ray3f_rayinf);
+
+    return mat_res;
+}
+
+// compute the reflection ray at the intersection
+ray3f reflection_ray(const ray3f& ray, const intersection3f& shape) {
+    // r = 2(n dot vd)*n-vd
+    // n = shape.norm
+    vec3f vd = normalize(ray.e - shape.pos);
+    // normalized, since the cylinder normals are not unit length and the world space
+    // sphere test assumes unit directions
+    vec3f refl = normalize((2 * dot(shape.norm, vd)) * shape.norm - vd);
+    return ray3f(shape.pos, refl, ray3f_epsilon, ray3f_rayinf);
+}
+
+// compute the color corresponding to a ray by raytracing
+vec3f raytrace_ray(Scene* scene, ray3f ray, int depth, const vector<Surface*>* candidates) {
+
+    // create a vector to hold the color
+    vec3f color = zero3f;
+    // get the closes shape to this point
+    intersection3f shape = (candidates) ? intersect(scene, ray, *candidates) : intersect(scene, ray);
+
+    // if we didn't intersect anything
+    if (!shape.hit){
+        // return background
+        return scene->background;
+    }
+
+
+    else{
+    // accumulate color starting with ambient
+        // ambient color = ka * Ia
+        color = shape.mat->kd * scene->ambient;
+        for( Light *light : scene->lights){
+            // get the riemann sum of the lights
+
+            // compute light response
+            ray3f shadowRay;
+            vec3f mat_res = light_response(light, ray, shape, shadowRay);
+
+            // check for shadows and accumulate if needed
+            STATS_INC(shadow_rays);
+            intersection3f shadowShape = intersect(scene, shadowRay);
+
+            // accumulate color only when there isn't shadow (aka leave shadows black)
+            if (!shadowShape.hit){
+                // add material response
+                color += mat_res;
+            }
+
+          }
+
+        // calc lm
+        if( shape.mat->kr != zero3f ){
+            // create the reflection ray
+            ray3f reflRay = reflection_ray(ray, shape);
+            STATS_INC(reflection_rays);
+            STATS_MAX(max_depth, depth+1);
+
+            // accumulate the reflected light (recursive call) scaled by the material reflection
+            color += shape.mat->kr * raytrace_ray(scene, reflRay, depth+1);
+        }
+
+    }
+    return color;
+}
+
+
+// ray queued for stream tracing, with the pixel it contributes to
+struct stream_ray3f {
+    ray3f   ray;        // ray
+    vec3f   weight;     // contribution to the pixel (path throughput, or light response for shadow rays)
+    int     pixel;      // pixel index in the tile
+};
+
+// spreads the lower 10 bits of v so that they occupy every third bit
+inline uint32_t morton_spread(uint32_t v) {
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v <<  8)) & 0x0300f00f;
+    v = (v | (v <<  4)) & 0x030c30c3;
+    v = (v | (v <<  2)) & 0x09249249;
+    return v;
+}
+
+// sort rays so that rays with similar direction (same octant) and nearby
+// origins (morton order within bbox) are traced one after the other
+void stream_sort(vector<stream_ray3f>& rays, const range3f& bbox) {
+    auto keys = vector<pair<uint64_t,int>>(rays.size());
+    auto extent = max(size(bbox), one3f*ray3f_epsilon);
+    for(auto i : range(rays.size())) {
+        auto& ray = rays[i].ray;
+        auto q = clamp((ray.e - bbox.min) / extent, 0.0f, 1.0f) * 1023.0f;
+        uint64_t octant = (ray.d.x < 0) | ((ray.d.y < 0) << 1) | ((ray.d.z < 0) << 2);
+        uint64_t morton = morton_spread((uint32_t)q.x) | (morton_spread((uint32_t)q.y) << 1) | (morton_spread((uint32_t)q.z) << 2);
+        keys[i] = make_pair((octant << 30) | morton, i);
+    }
+    std::sort(keys.begin(), keys.end());
+    auto sorted = vector<stream_ray3f>();
+    sorted.reserve(rays.size());
+    for(auto& key : keys) sorted.push_back(rays[key.second]);
+    rays.swap(sorted);
+}
+
+// ray queued for an out-of-core cluster that is not in memory
+struct ooc_queued_ray {
+    int     cluster;    // cluster
+    float   t;          // ray entry distance into the cluster bounds
+    int     ray;        // ray index in the batch
+    bool operator<(const ooc_queued_ray& q) const { return (cluster != q.cluster) ? cluster < q.cluster : t < q.t; }
+};
+
+// intersects a batch of rays. out-of-core scenes first intersect the clusters in memory,
+// queueing the rays that reach the others; those clusters are then read nearest first,
+// once for all their queued rays, and skipped if the rays found closer hits meanwhile
+void intersect_batch(Scene* scene, const vector<stream_ray3f>& rays, vector<intersection3f>& hits) {
+    hits.resize(rays.size());
+    if(not scene->ooc) {
+        for(auto i : range(rays.size())) hits[i] = intersect(scene, rays[i].ray);
+        return;
+    }
+    auto ooc = scene->ooc;
+    auto queued = vector<ooc_queued_ray>();
+    for(auto i : range(rays.size())) {
+        auto& ray = rays[i].ray;
+        auto& hit = hits[i] = intersection3f();
+        hit.ray_t = ray3f_rayinf;
+        bvh_intersect(ooc->top, ray, hit.ray_t, [&](int cluster){
+            // counted here only, since queued rays look their cluster up again once read
+            STATS_INC(page_lookups);
+            auto page = ooc_page(ooc, cluster, false);
+            if(page) {
+                bvh_intersect(&page->bvh, ray, hit.ray_t, [&](int sid){ intersect_surface(&page->surfaces[sid], ray, hit); });
+                return;
+            }
+            auto& bbox = ooc->clusters[cluster].bbox;
+            auto t0 = (bbox.min - ray.e) / ray.d, t1 = (bbox.max - ray.e) / ray.d;
+            auto tn = min(t0,t1);
+            queued.push_back({cluster, max(ray.tmin, max(tn.x, max(tn.y, tn.z))), i});
+        });
+    }
+
+    // clusters in order of their nearest queued ray
+    std::sort(queued.begin(), queued.end());
+    auto groups = vector<pair<float,int>>();    // (nearest entry, first queued ray)
+    for(auto q : range(queued.size())) if(not q or queued[q].cluster != queued[q-1].cluster) groups.push_back({queued[q].t, q});
+    std::sort(groups.begin(), groups.end());
+    for(auto& group : groups) {
+        auto cluster = queued[group.second].cluster;
+        auto page = std::shared_ptr<OOCPage>();
+        for(auto q = group.second; q < (int)queued.size() and queued[q].cluster == cluster; q ++) {
+            auto& ray = rays[queued[q].ray].ray;
+            auto& hit = hits[queued[q].ray];
+            if(queued[q].t > hit.ray_t) continue;
+            if(not page) page = ooc_page(ooc, cluster);
+            bvh_intersect(&page->bvh, ray, hit.ray_t, [&](int sid){ intersect_surface(&page->surfaces[sid], ray, hit); });
+        }
+    }
+    for(auto& hit : hits) if(hit.hit) hit.mat = &scene->materials[hit.material];
+}
+
+// raytrace the pixels [x0,x1)x[y0,y1) in stream mode: each bounce collects the rays
+// of the whole tile, sorts them, traces them as a batch, and then shades the batch,
+// queueing the shadow and reflection rays for the next batches. with a film tile,
+// the color of every sample is accumulated separately and then splatted into the film.
+// with candidates, the camera rays are tested against them instead of the accelerator
+void raytrace_tile_stream(Scene* scene, Camera* camera, const range3f& bbox, const PixelSampler* sampler,
+                          vec2f* samples, const Filter* filter, FilmTile* film_tile,
+                          const vector<Surface*>* candidates, int x0, int x1, int y0, int y1, image3f& image) {
+    int tile_w = x1 - x0;
+    auto colors = vector<vec3f>(tile_w * (y1 - y0), zero3f);
+    auto sample_pos = vector<vec2f>();
+
+    // camera rays, with the samples of a pixel averaged through their weights
+    int ns = max(1, scene->image_samples);
+    auto weight = (film_tile) ? one3f : one3f / ((sampler) ? sampler->nsamples : ns*ns);
+    auto rays = vector<stream_ray3f>();
+    for( int pCol = y0; pCol < y1; pCol++){
+        for( int pRow = x0; pRow < x1; pRow++){
+            if(sampler) {
+                sampler->pixel_samples(pRow, pCol, samples);
+                for(auto s : range(sampler->nsamples)) {
+                    auto pos = vec2f(pRow + samples[s].x, pCol + samples[s].y);
+                    auto slot = (film_tile) ? (int)sample_pos.size() : (pCol-y0)*tile_w + (pRow-x0);
+                    if(film_tile) sample_pos.push_back(pos);
+                    rays.push_back({camera_ray(scene, camera, pos.x, pos.y), weight, slot});
+                    STATS_INC(camera_rays);
+                }
+                continue;
+            }
+            for( float ii = 0; ii < ns; ii++ ){
+                for(float jj = 0; jj < ns; jj++){
+                    auto ray = camera_ray(scene, camera, pRow + (ii + 0.5f)/ns, pCol + (jj + 0.5f)/ns);
+                    rays.push_back({ray, weight, (pCol-y0)*tile_w + (pRow-x0)});
+                    STATS_INC(camera_rays);
+                }
+            }
+        }
+    }
+
+    if(film_tile) colors.assign(sample_pos.size(), zero3f);
+
+    auto hits = vector<intersection3f>(), shadow_hits = vector<intersection3f>();
+    auto shadows = vector<stream_ray3f>();
+    auto next = vector<stream_ray3f>();
+    for(auto depth = 0; not rays.empty(); depth ++) {
+        // trace the batch
+        stream_sort(rays, bbox);
+        if(depth == 0 and candidates) {
+            hits.resize(rays.size());
+            for(auto i : range(rays.size())) hits[i] = intersect(scene, rays[i].ray, *candidates);
+        } else intersect_batch(scene, rays, hits);
+
+        // shade the batch
+        shadows.clear();
+        next.clear();
+        for(auto i : range(rays.size())) {
+            auto& ray = rays[i];
+            auto& shape = hits[i];
+            if(not shape.hit) { colors[ray.pixel] += ray.weight * scene->background; continue; }
+            colors[ray.pixel] += ray.weight * (shape.mat->kd * scene->ambient);
+            for(Light *light : scene->lights) {
+                ray3f shadowRay;
+                vec3f mat_res = light_response(light, ray.ray, shape, shadowRay);
+                shadows.push_back({shadowRay, ray.weight * mat_res, ray.pixel});
+            }
+            if(shape.mat->kr != zero3f) {
+                next.push_back({reflection_ray(ray.ray, shape), ray.weight * shape.mat->kr, ray.pixel});
+                STATS_INC(reflection_rays);
+                STATS_MAX(max_depth, depth+1);
+            }
+        }
+
+        // trace the shadow rays, accumulating the light response of the unoccluded ones
+        stream_sort(shadows, bbox);
+        intersect_batch(scene, shadows, shadow_hits);
+        for(auto i : range(shadows.size())) {
+            STATS_INC(shadow_rays);
+            if(not shadow_hits[i].hit) colors[shadows[i].pixel] += shadows[i].weight;
+        }
+
+        rays.swap(next);
+    }
+
+    if(film_tile) {
+        for(auto s : range(sample_pos.size())) film_tile->add_sample(*filter, sample_pos[s].x, sample_pos[s].y, colors[s]);
+        return;
+    }
+    for( int pCol = y0; pCol < y1; pCol++){
+        for( int pRow = x0; pRow < x1; pRow++){
+            image.at(pRow, pCol) = colors[(pCol-y0)*tile_w + (pRow-x0)];
+        }
+    }
+}
+
+
+
+#define raytrace_tile_size 16
+#define raytrace_cull_max 32    // longest tile candidate list tested instead of the accelerator
+
+// camera ray through the image point (x,y) in pixels
+ray3f camera_ray(Scene* scene, Camera* camera, float x, float y) {
+    float u = x / scene->image_width;
+    float v = y / scene->image_height;
+    vec3f dir = ((u - .5f) * camera->width)*x3f + ((v - .5f) * camera->height)*y3f - camera->dist * z3f;
+    return transform_ray(camera->frame, ray3f(zero3f, normalize(dir)));
+}
+
+// compute the color of pixel (pRow,pCol) as seen from camera, averaging the
+// nsamples sub-pixel offsets in samples
+vec3f raytrace_pixel(Scene* scene, Camera* camera, int pRow, int pCol, const vec2f* samples, int nsamples,
+                     const vector<Surface*>* candidates) {
+    vec3f color = zero3f;
+    for(auto s : range(nsamples)) {
+        STATS_INC(camera_rays);
+        color += raytrace_ray(scene, camera_ray(scene, camera, pRow + samples[s].x, pCol + samples[s].y), 0, candidates);
+    }
+    return color / nsamples;
+}
+
+// compute the color of pixel (pRow,pCol) as seen from camera
+vec3f raytrace_pixel(Scene* scene, Camera* camera, int pRow, int pCol, const vector<Surface*>* candidates) {
+
+    // if no anti-aliasing
+    // condition !(image_samples > 1)
+    if(!(scene->image_samples > 1)){
+
+        // camera ray through the pixel center
+        ray3f newRay = camera_ray(scene, camera, pRow + .5f, pCol + .5f);
+
+        // get a color for the pixel
+        STATS_INC(camera_rays);
+        return raytrace_ray(scene, newRay, 0, candidates);
+    }
+    else{
+        // init accumulated color
+        vec3f color = zero3f;
+        for( float ii = 0; ii < scene->image_samples; ii++ ){
+            for(float jj = 0; jj < scene->image_samples; jj++){
+                // camera ray through the sample
+                ray3f newRay = camera_ray(scene, camera, pRow + (ii + 0.5f)/scene->image_samples,
+                                          pCol + (jj + 0.5f)/scene->image_samples);
+
+                // get a color for the pixel
+                STATS_INC(camera_rays);
+                color += raytrace_ray(scene, newRay, 0, candidates);
+
+            }
+        }
+
+        // scale by the number of samples
+        return color/(scene->image_samples*scene->image_samples);
+    }
+}
+
+// capture the features of the first hit at the center of pixel (pRow,pCol) for the denoiser
+void raytrace_aux(Scene* scene, Camera* camera, int pRow, int pCol, DenoiseAux* aux, const vector<Surface*>* candidates) {
+    auto ray = camera_ray(scene, camera, pRow + 0.5f, pCol + 0.5f);
+    auto shape = (candidates) ? intersect(scene, ray, *candidates) : intersect(scene, ray);
+    aux->normal.at(pRow, pCol) = (shape.hit) ? shape.norm : zero3f;
+    aux->albedo.at(pRow, pCol) = (shape.hit) ? shape.mat->kd : one3f;
+    aux->depth[pCol * scene->image_width + pRow] = (shape.hit) ? shape.ray_t : ray3f_rayinf;
+}
+
+// capture the features as raytrace_aux for the pixels [x0,x1)x[y0,y1), tracing their rays
+// as one batch, so that the out-of-core pages they reach are read once for the tile
+void raytrace_aux_stream(Scene* scene, Camera* camera, int x0, int x1, int y0, int y1, DenoiseAux* aux) {
+    auto rays = vector<stream_ray3f>();
+    for( int pCol = y0; pCol < y1; pCol++){
+        for( int pRow = x0; pRow < x1; pRow++){
+            rays.push_back({camera_ray(scene, camera, pRow + 0.5f, pCol + 0.5f), one3f, pCol * scene->image_width + pRow});
+        }
+    }
+    auto hits = vector<intersection3f>();
+    intersect_batch(scene, rays, hits);
+    for(auto i : range(rays.size())) {
+        auto& shape = hits[i];
+        auto pRow = rays[i].pixel % scene->image_width, pCol = rays[i].pixel / scene->image_width;
+        aux->normal.at(pRow, pCol) = (shape.hit) ? shape.norm : zero3f;
+        aux->albedo.at(pRow, pCol) = (shape.hit) ? shape.mat->kd : one3f;
+        aux->depth[rays[i].pixel] = (shape.hit) ? shape.ray_t : ray3f_rayinf;
+    }
+}
+
+vector<vector<Surface*>> tile_candidates(Scene* scene, Camera* camera, int tile_size) {
+    TRACE_SCOPE("tile_candidates", "render");
+    int ntiles_x = (scene->image_width + tile_size - 1) / tile_size;
+    int ntiles_y = (scene->image_height + tile_size - 1) / tile_size;
+    auto nsurfaces = (int)scene->surfaces.size();
+    // tiles [x,z]x[y,w] overlapped by the projection of each surface bounds (empty if x > z):
+    // the box corners are projected as camera_ray maps pixels to directions, and padded for
+    // the sub-pixel sample offsets and round-off
+    auto rects = vector<vec4i>(nsurfaces);
+    parallel_for(nsurfaces, [&](int sid){
+        auto bbox = surface_bbox(scene->surfaces[sid]);
+        auto pmin = vec2f(ray3f_rayinf, ray3f_rayinf), pmax = -pmin;
+        auto infront = 0, behind = 0;
+        for(auto c : range(8)) {
+            auto corner = vec3f((c & 1) ? bbox.max.x : bbox.min.x, (c & 2) ? bbox.max.y : bbox.min.y, (c & 4) ? bbox.max.z : bbox.min.z);
+            auto p = transform_point_inverse(camera->frame, corner);
+            if(p.z >= 0) behind ++;
+            if(p.z > -ray3f_epsilon) continue;
+            infront ++;
+            auto x = (p.x / -p.z * camera->dist / camera->width + 0.5f) * scene->image_width;
+            auto y = (p.y / -p.z * camera->dist / camera->height + 0.5f) * scene->image_height;
+            pmin = vec2f(min(pmin.x, x), min(pmin.y, y));
+            pmax = vec2f(max(pmax.x, x), max(pmax.y, y));
+        }
+        // camera rays point to -z, so boxes behind the camera plane are never hit, while the
+        // projection of boxes crossing it is unbounded
+        if(behind == 8) { rects[sid] = vec4i(0, 0, -1, -1); return; }
+        if(infront < 8) { rects[sid] = vec4i(0, 0, ntiles_x-1, ntiles_y-1); return; }
+        // clamped before the conversion, since corners near the camera plane project far away
+        auto tile_of = [&](float v, int ntiles) { return (int)floor(clamp(v / tile_size, -1.0f, (float)ntiles)); };
+        rects[sid] = vec4i(max(tile_of(pmin.x - 0.5f, ntiles_x), 0), max(tile_of(pmin.y - 0.5f, ntiles_y), 0),
+                           min(tile_of(pmax.x + 0.5f, ntiles_x), ntiles_x-1), min(tile_of(pmax.y + 0.5f, ntiles_y), ntiles_y-1));
+    });
+    // surfaces are listed in scene order, so that ties resolve as without an accelerator
+    auto tiles = vector<vector<Surface*>>(ntiles_x * ntiles_y);
+    for(auto sid : range(nsurfaces)) {
+        auto& rect = rects[sid];
+        for(auto ty = rect.y; ty <= rect.w; ty ++)
+            for(auto tx = rect.x; tx <= rect.z; tx ++) tiles[ty * ntiles_x + tx].push_back(scene->surfaces[sid]);
+    }
+    return tiles;
+}
+
+// raytrace an image as seen from camera into image (already of the proper size)
+void raytrace(Scene* scene, Camera* camera, image3f& image, DenoiseAux* aux) {
+    TRACE_SCOPE("raytrace", "render");
+
+    error_if_not(image.width() == scene->image_width and image.height() == scene->image_height, "wrong image size");
+    if(aux and (aux->normal.width() != image.width() or aux->normal.height() != image.height())) *aux = DenoiseAux(image.width(), image.height());
+
+    // split the image in tiles that the worker threads pick up dynamically
+    int ntiles_x = (scene->image_width + raytrace_tile_size - 1) / raytrace_tile_size;
+    int ntiles_y = (scene->image_height + raytrace_tile_size - 1) / raytrace_tile_size;
+    // out-of-core scenes are always traced in stream mode, since rays traced one by one
+    // would read the pages they miss one by one too
+    auto stream = scene->stream_rays or scene->ooc;
+    // scene bounds used to sort the rays in stream mode
+    auto bbox = range3f();
+    if(stream) {
+        if(scene->ooc and not scene->ooc->top->nodes.empty()) bbox = scene->ooc->top->nodes[0].bbox;
+        else if(scene->bvh and not scene->bvh->nodes.empty()) bbox = scene->bvh->nodes[0].bbox;
+        else if(scene->grid) bbox = scene->grid->bbox;
+        else for(auto surface : scene->surfaces) bbox = runion(bbox, surface_bbox(surface));
+    }
+    // reconstruction filter, splatting samples into per-tile film buffers merged at the end,
+    // unless the samples of each pixel are averaged (box filter within the pixel)
+    auto use_film = scene->filter != "none";
+    auto filter = (use_film) ? make_filter(filter_type(scene->filter), scene->filter_radius) : Filter();
+    auto film_tiles = vector<FilmTile>((use_film) ? ntiles_x*ntiles_y : 0);
+    // sample pattern, unless the original regular grid of image_samples^2 samples is used
+    auto use_sampler = scene->sampler != "regular" or scene->pixel_samples > 0 or use_film;
+    auto sampler = PixelSampler();
+    if(use_sampler) sampler = make_pixel_sampler(sampler_type(scene->sampler), (scene->pixel_samples > 0) ?
+                                                 scene->pixel_samples : scene->image_samples*scene->image_samples);
+    // per-thread counters (padded so that threads do not share cache lines) and sample buffers
+    struct padded_stats { RayStats stats; char pad[64]; };
+    auto thread_stats = vector<padded_stats>(parallel_nthreads());
+    auto thread_samples = vector<vector<vec2f>>(parallel_nthreads(), vector<vec2f>(sampler.nsamples));
+    // surfaces projected onto each tile, tested by the camera rays of the tiles with short lists
+    auto candidates = (scene->cull_tiles and not scene->ooc) ? tile_candidates(scene, camera, raytrace_tile_size) :
+        vector<vector<Surface*>>();
+    parallel_for(ntiles_x*ntiles_y, [&](int tile){
+        TRACE_SCOPE("tile", "render", tile);
+        auto bound = _stats_thread;
+        stats_bind(&thread_stats[parallel_thread_id()].stats);
+        int tile_x = (tile % ntiles_x) * raytrace_tile_size;
+        int tile_y = (tile / ntiles_x) * raytrace_tile_size;
+        auto samples = thread_samples[parallel_thread_id()].data();
+        auto film_tile = (use_film) ? &film_tiles[tile] : nullptr;
+        auto tile_surfaces = (not candidates.empty() and candidates[tile].size() <= raytrace_cull_max) ? &candidates[tile] : nullptr;
+        if(use_film) *film_tile = FilmTile(filter, tile_x, min(tile_x + raytrace_tile_size, scene->image_width),
+                                           tile_y, min(tile_y + raytrace_tile_size, scene->image_height),
+                                           scene->image_width, scene->image_height);
+
+        if(stream) {
+            raytrace_tile_stream(scene, camera, bbox, (use_sampler) ? &sampler : nullptr, samples, &filter, film_tile,
+                                 tile_surfaces, tile_x, min(tile_x + raytrace_tile_size, scene->image_width),
+                                 tile_y, min(tile_y + raytrace_tile_size, scene->image_height), image);
+        } else if(use_film) {
+            for( int pCol = tile_y; pCol < min(tile_y + raytrace_tile_size, scene->image_height); pCol++){
+                for( int pRow = tile_x; pRow < min(tile_x + raytrace_tile_size, scene->image_width); pRow++){
+                    sampler.pixel_samples(pRow, pCol, samples);
+                    for(auto s : range(sampler.nsamples)) {
+                        auto x = pRow + samples[s].x, y = pCol + samples[s].y;
+                        STATS_INC(camera_rays);
+                        film_tile->add_sample(filter, x, y, raytrace_ray(scene, camera_ray(scene, camera, x, y), 0, tile_surfaces));
+                    }
+                }
+            }
+        } else if(use_sampler) {
+            for( int pCol = tile_y; pCol < min(tile_y + raytrace_tile_size, scene->image_height); pCol++){
+                for( int pRow = tile_x; pRow < min(tile_x + raytrace_tile_size, scene->image_width); pRow++){
+                    sampler.pixel_samples(pRow, pCol, samples);
+                    image.at(pRow, pCol) = raytrace_pixel(scene, camera, pRow, pCol, samples, sampler.nsamples, tile_surfaces);
+                }
+            }
+        } else {
+            // for every pixel in the tile
+            for( int pCol = tile_y; pCol < min(tile_y + raytrace_tile_size, scene->image_height); pCol++){
+                for( int pRow = tile_x; pRow < min(tile_x + raytrace_tile_size, scene->image_width); pRow++){
+                    image.at(pRow, pCol) = raytrace_pixel(scene, camera, pRow, pCol, tile_surfaces);
+                }
+            }
+        }
+
+        if(aux and scene->ooc) {
+            raytrace_aux_stream(scene, camera, tile_x, min(tile_x + raytrace_tile_size, scene->image_width),
+                                tile_y, min(tile_y + raytrace_tile_size, scene->image_height), aux);
+        } else if(aux) {
+            for( int pCol = tile_y; pCol < min(tile_y + raytrace_tile_size, scene->image_height); pCol++){
+                for( int pRow = tile_x; pRow < min(tile_x + raytrace_tile_size, scene->image_width); pRow++){
+                    raytrace_aux(scene, camera, pRow, pCol, aux, tile_surfaces);
+                }
+            }
+        }
+        stats_bind(bound);
+    });
+
+    if(use_film) merge_film_tiles(film_tiles, filter, ntiles_x, ntiles_y, raytrace_tile_size, image);
+
+    // merge the counters of the threads
+    auto stats = RayStats();
+    for(auto& ts : thread_stats) stats += ts.stats;
+    stats.primitives = (scene->ooc) ? scene->ooc->nsurfaces : scene->surfaces.size();
+    stats.oversized = scene->oversized.size();
+    stats.accel_bytes = accelerator_memory(scene);
+    stats.accel_build_usec = (uint64_t)(scene->accelerator_build_time * 1e6);
+    stats_accumulate(stats);
+}
+
+// raytrace an image
+image3f raytrace(Scene* scene) {
+    // allocate an image of the proper size
+    auto image = image3f(scene->image_width, scene->image_height);
+    raytrace(scene, scene->camera, image);
+    return image;
+}
@@ -0,0 +1,230 @@
+#ifndef _RAYTRACE_H_
+#define _RAYTRACE_H_
+
+#include "scene.h"
+#include "bvh.h"
+#include "grid.h"
+#include "outofcore.h"
+#include "stats.h"
+#include "denoise.h"
+
+// intersection record
+struct intersection3f {
+    bool        hit;        // whether it hits something
+    float       ray_t;      // ray parameter for the hit
+    vec3f       pos;        // hit position
+    vec3f       norm;       // hit normal
+    uint32_t    material;   // hit material id
+    Material*   mat;        // hit material (set by intersect)
+
+    // constructor (defaults to no intersection)
+    intersection3f() : hit(false) { }
+};
+
+// intersects a surface, updating intersection if the hit is the closest so far
+inline void intersect_surface(Surface* object, const ray3f& ray, intersection3f& intersection) {
+
+    // spheres with an orthonormal frame are intersected in world space, skipping the
+    // frame transform, with the geometric formulation for normalized ray directions
+    // (camera, shadow and reflection rays are all built normalized)
+    if(not object->isquad and not object->iscyl and object->worldsphere){
+       STATS_INC(sphere_tests);
+
+       // ray origin relative to the center; a = dot(d,d) = 1 and b is halved
+       vec3f oc = ray.e - object->frame.o;
+       float b = dot(oc, ray.d);
+       float c = dot(oc, oc) - object->radius2;
+
+       // origin outside and pointing away, or missing the sphere
+       if ( c > 0 && b > 0 ) return;
+       float det = b * b - c;
+       if ( det < 0 ) return;
+
+       // nearest root only, as in the object space test
+       float t = -b - sqrt(det);
+       if ( t > ray.tmin && t < ray.tmax && ( t < intersection.ray_t || !intersection.hit ) ){
+           intersection.pos = ray.eval(t);
+           intersection.hit = true;
+           STATS_INC(sphere_hits);
+           intersection.ray_t = t;
+           intersection.material = object->material;
+           intersection.norm = (intersection.pos - object->frame.o)/object->radius;
+       }
+       return;
+    }
+
+    // un transform ray into the object's frame
+    ray3f nRay = transform_ray_inverse(object->frame, ray);
+
+
+    if(object->isquad){
+        STATS_INC(quad_tests);
+
+        // check to see if on surface
+        // make sure the projection of the normal to the direction is not 0
+        if( dot(z3f, nRay.d) != 0){
+
+            // find t
+            // equation given: ((C-p) dot n) / d dot n
+            // C = zero because center is at the origin
+            // normal is the z vector of the frame
+            float t = (dot(-nRay.e, z3f)/dot(z3f, nRay.d));
+
+            // find point where t intersects the plane
+            vec3f xRay = nRay.eval(t);
+
+            // check to see if point is in the radius (bound the box)
+            if ( abs(xRay.x) < object->radius && abs(xRay.y) < object->radius){
+
+                // check to see if t is in the range
+                if ( t > ray.tmin && t < ray.tmax){
+
+                    // check to see if it is the closest thing
+                    if ( t < intersection.ray_t || !intersection.hit){
+
+                        // update intersection
+                        intersection.pos = ray.eval(t);
+                        intersection.hit = true;
+                        STATS_INC(quad_hits);
+                        intersection.ray_t = t;
+                        intersection.material = object->material;
+                        intersection.norm = object->frame.z;
+                    }
+
+                }
+            }
+        }
+    }
+
+    // else if it is a cylinder
+
+    else if (object->iscyl){
+        STATS_INC(cylinder_tests);
+        // find intersection
+
+        float a = nRay.d.x * nRay.d.x + (nRay.d.z * nRay.d.z);
+        float b = 2 * (nRay.d.x * nRay.e.x) + 2 * (nRay.d.z * nRay.e.z);
+        float c = ((nRay.e.x * nRay.e.x) - (object->radius * object->radius)) + ((nRay.e.z * nRay.e.z) - (object->radius * object->radius));
+
+
+
+        // calc determinant
+        float det = (b * b) - (4 * a * c);
+
+        // intersection only if the det is non negative ( det = 0 is a tangent )
+        if ( det >= 0 ){
+
+            // find t if there is an intersection
+            float t = ((-1 * b) - sqrt(det))/(2*a);
+
+            // check to see if t is in the range
+            if ( t > nRay.tmin && t < nRay.tmax){
+
+                // check to see if t is within bound of sphere
+                // find point where t intersects the plane
+                vec3f xRay = nRay.eval(t);
+
+                // check to see if point is in the radius (bound the box)
+                if ( abs(xRay.x) < object->radius && abs(xRay.y) < object->radius){
+
+                // check to see if it is the closest thing
+                if ( t < intersection.ray_t || !intersection.hit){
+
+                    // update intersection
+                    intersection.pos = ray.eval(t);
+                    intersection.hit = true;
+                    STATS_INC(cylinder_hits);
+                    intersection.ray_t = t;
+                    intersection.material = object->material;
+                    intersection.norm = (ray.eval(t) - object->frame.o)/object->radius;
+                }
+               }
+            }
+        }
+    }
+
+
+    // else  if it is a sphere (with a non-orthonormal frame)
+    else{
+       STATS_INC(sphere_tests);
+
+       // make circle variables
+       // use the det function given in lecture slides 4
+       float a = dot(nRay.d, nRay.d);
+       float b = 2 * dot(nRay.d, nRay.e);
+       float c = dot(nRay.e, nRay.e) - (object->radius * object->radius);
+
+       // calc determinant
+       float det = (b * b) - (4 * a * c);
+
+       // intersection only if the det is non negative ( det = 0 is a tangent )
+       if ( det >= 0 ){
+
+           // find t if there is an intersection
+           float t = ((-1 * b) - sqrt(det))/(2*a);
+
+           // check to see if t is in the range
+           if ( t > nRay.tmin && t < nRay.tmax){
+
+               // check to see if it is the closest thing
+               if ( t < intersection.ray_t || !intersection.hit){
+
+                   // update intersection
+                   intersection.pos = ray.eval(t);
+                   intersection.hit = true;
+                   STATS_INC(sphere_hits);
+                   intersection.ray_t = t;
+                   intersection.material = object->material;
+                   intersection.norm = (ray.eval(t) - object->frame.o)/object->radius;
+               }
+
+           }
+       }
+
+    }
+}
+
+// build the acceleration structure selected by scene->accelerator (bvh, bvh2, bvhq, lbvh, grid or none),
+// replacing the ones already built; with a cache directory, it is loaded from there if the
+// same geometry was built before, and saved there otherwise
+void build_accelerator(Scene* scene, const string& cache_dirname = "");
+
+// move the surfaces of an animation to frame and update the accelerator: bvhs are refitted,
+// and rebuilt only when their sah cost grows past rebuild times the cost after the last build
+// (kept in built_cost); grids are cheap enough to rebuild every frame
+void animate_accelerator(Scene* scene, int frame, float rebuild, float& built_cost);
+
+// bytes read by the traversal of the acceleration structure in use (0 for none)
+size_t accelerator_memory(Scene* scene);
+
+// intersects the scene and return the first intrerseciton
+intersection3f intersect(Scene* scene, ray3f ray);
+// intersects a camera ray with the surfaces projected onto its tile (see tile_candidates)
+intersection3f intersect(Scene* scene, ray3f ray, const vector<Surface*>& candidates);
+
+// compute the color corresponding to a ray by raytracing; camera rays (depth 0) are only
+// tested against candidates if given
+vec3f raytrace_ray(Scene* scene, ray3f ray, int depth = 0, const vector<Surface*>* candidates = nullptr);
+
+// compute the color of pixel (pRow,pCol) as seen from camera
+vec3f raytrace_pixel(Scene* scene, Camera* camera, int pRow, int pCol, const vector<Surface*>* candidates = nullptr);
+
+// camera ray through the image point (x,y) in pixels
+ray3f camera_ray(Scene* scene, Camera* camera, float x, float y);
+// compute the color of pixel (pRow,pCol) averaging the nsamples sub-pixel offsets in samples
+vec3f raytrace_pixel(Scene* scene, Camera* camera, int pRow, int pCol, const vec2f* samples, int nsamples,
+                     const vector<Surface*>* candidates = nullptr);
+
+// surfaces whose bounds project onto each tile_size x tile_size tile of the image seen from
+// camera (in row order), so that camera rays skip the accelerator; bounds crossing the camera
+// plane are listed in every tile
+vector<vector<Surface*>> tile_candidates(Scene* scene, Camera* camera, int tile_size);
+
+// raytrace an image as seen from camera into image (already of the proper size),
+// capturing the first hit features at the pixel centers into aux if not null
+void raytrace(Scene* scene, Camera* camera, image3f& image, DenoiseAux* aux = nullptr);
+
+// raytrace an image
+image3f raytrace(Scene* scene);
+
+#endif
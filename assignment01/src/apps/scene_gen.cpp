@@ -0,0 +1,121 @@
+#include "scene.h"
+#include <cmath>
+#include <random>
+
+// random numbers from std::mt19937, whose sequence is fixed by the standard, converted
+// to floats here so that scenes are the same on every platform for a given seed
+struct gen_rng {
+    std::mt19937    gen;
+
+    gen_rng(int seed) : gen(seed) { }
+    // uniform in [min,max)
+    float next(float min = 0, float max = 1) { return min + (max-min) * ((gen() >> 8) * (1.0f / 16777216.0f)); }
+    // uniform direction
+    vec3f next_dir() {
+        auto z = next(-1,1), phi = next(0,2*pif), r = sqrt(max(0.0f,1-z*z));
+        return vec3f(r*cos(phi), r*sin(phi), z);
+    }
+};
+
+// materials shared by the generated surfaces: ncolors diffuse colors, each with a
+// plain and a reflective version (at index + ncolors)
+vector<uint32_t> gen_materials(int ncolors, gen_rng& rng, MaterialTable& table) {
+    auto materials = vector<uint32_t>(2*ncolors);
+    for(auto i : range(ncolors)) {
+        auto kd = vec3f(rng.next(0.2f,1), rng.next(0.2f,1), rng.next(0.2f,1));
+        auto plain = Material();
+        plain.kd = kd;
+        plain.ks = one3f * 0.3f;
+        plain.n = 50;
+        materials[i] = table.intern(plain);
+        auto reflective = Material();
+        reflective.kd = kd * 0.5f;
+        reflective.ks = one3f * 0.5f;
+        reflective.n = 100;
+        reflective.kr = one3f * 0.5f;
+        materials[i+ncolors] = table.intern(reflective);
+    }
+    return materials;
+}
+
+// generates nsurfaces spheres, quads and cylinders (in the given fractions) on a grid
+// or in a random cloud with unit spacing, lit by nlights lights above the scene
+Scene* gen_scene(const jsonvalue& args) {
+    auto nsurfaces = args.object_element("count").as_int();
+    auto nlights = args.object_element("lights").as_int();
+    auto quads = args.object_element("quads").as_float();
+    auto cylinders = args.object_element("cylinders").as_float();
+    auto reflective = args.object_element("reflective").as_float();
+    auto grid = args.object_element("layout").as_string() == "grid";
+    error_if_not(grid or args.object_element("layout").as_string() == "cloud", "unknown layout %s\n",
+                 args.object_element("layout").as_string().c_str());
+    auto rng = gen_rng(args.object_element("seed").as_int());
+
+    auto scene = new Scene();
+    scene->image_width = args.object_element("resolution").as_int();
+    scene->image_height = args.object_element("resolution").as_int();
+
+    // the surfaces fill a cube of side n (unit spacing), centered at the origin
+    auto n = max(1, (int)std::ceil(std::cbrt((double)nsurfaces)));
+    auto extent = n * 0.5f;
+    auto materials = gen_materials(16, rng, scene->materials);
+    scene->surfaces.reserve(nsurfaces);
+    for(auto i : range(nsurfaces)) {
+        auto surface = scene->arena.make<Surface>();
+        auto kind = rng.next();
+        surface->isquad = kind < quads;
+        surface->iscyl = not surface->isquad and kind < quads + cylinders;
+        auto o = zero3f;
+        if(grid) {
+            o = vec3f(i % n + 0.5f, (i / n) % n + 0.5f, i / (n*n) + 0.5f) - one3f * extent;
+            surface->radius = 0.4f;
+        } else {
+            o = vec3f(rng.next(-extent,extent), rng.next(-extent,extent), rng.next(-extent,extent));
+            surface->radius = rng.next(0.1f,0.45f);
+        }
+        // spheres are rotation invariant, quads and cylinders get a random orientation
+        auto z = (surface->isquad or surface->iscyl) ? rng.next_dir() : z3f;
+        surface->frame = (surface->isquad or surface->iscyl) ? lookat_frame(o, o + z, rng.next_dir()) :
+                                                               frame3f(o, x3f, y3f, z3f);
+        auto color = (int)rng.next(0,16) % 16;
+        surface->material = materials[(rng.next() < reflective) ? color + 16 : color];
+        scene->surfaces.push_back(surface);
+    }
+
+    // lights on a ring above the scene, with a total power that lights the near side
+    // of the cube about as brightly as the bundled scenes
+    for(auto i : range(nlights)) {
+        auto phi = 2 * pif * (i + rng.next()) / nlights;
+        auto light = scene->arena.make<Light>();
+        light->frame.o = vec3f(cos(phi), 1.5f, sin(phi)) * (extent * 2 + 2);
+        light->intensity = one3f * (lengthSqr(light->frame.o) * 1.5f / nlights);
+        scene->lights.push_back(light);
+    }
+
+    // camera in front of the cube, looking at its center
+    *scene->camera = lookat_camera(vec3f(0, extent * 0.8f, extent * 3.5f + 1), zero3f, y3f, 1, 1, 1);
+    return scene;
+}
+
+// generates large scenes for scaling tests and saves them as json or binary (.bscene)
+int main(int argc, char** argv) {
+    auto args = parse_cmdline(argc, argv,
+        { "scene_gen", "generate large scenes of spheres, quads and cylinders",
+            {  {"count",          "n", "number of surfaces", typeid(int), true, jsonvalue(1000)},
+               {"layout",         "",  "surface placement: grid or cloud", typeid(string), true, jsonvalue("cloud")},
+               {"quads",          "",  "fraction of quads", typeid(float), true, jsonvalue(0.2)},
+               {"cylinders",      "",  "fraction of cylinders", typeid(float), true, jsonvalue(0.0)},
+               {"reflective",     "",  "fraction of reflective surfaces", typeid(float), true, jsonvalue(0.2)},
+               {"lights",         "",  "number of lights", typeid(int), true, jsonvalue(2)},
+               {"resolution",     "r", "image resolution", typeid(int), true, jsonvalue(512)},
+               {"seed",           "",  "random seed", typeid(int), true, jsonvalue(0)}  },
+            {  {"scene_filename", "",  "scene filename (.json or .bscene)", typeid(string), false, jsonvalue("")}  }
+        });
+
+    auto scene_filename = args.object_element("scene_filename").as_string();
+    message("generating %d surfaces...\n", args.object_element("count").as_int());
+    auto scene = gen_scene(args);
+    message("writing %s...\n", scene_filename.c_str());
+    save_scene(scene_filename, scene);
+    message("done\n");
+}
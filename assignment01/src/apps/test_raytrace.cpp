@@ -0,0 +1,206 @@
+#include "raytrace.h"
+#include "parallel.h"
+#include "cache.h"
+#include <cmath>
+#include <fstream>
+
+// scenes checked when no scene is given (the test scenes are created by create_test_scene)
+const vector<string> test_scenes = {
+    "01_sphere.json", "02_quad.json", "03_plane.json", "04_balls.json", "05_refl.json", "06_aa.json",
+    "testscene0", "testscene1", "testscene2"
+};
+
+// quantize a channel as write_png does
+inline int quantize(float v) { return (unsigned char)clamp(v * 255, 0.0f, 255.0f); }
+
+// comparison of a rendered image against its reference
+struct image_compare {
+    int         max_diff = 0;       // max channel difference (8 bit levels)
+    int         bad_pixels = 0;     // pixels with a channel difference over tolerance
+    double      psnr = 0;           // psnr in db (infinity if the images match)
+};
+
+// compare img to ref in 8 bits, writing the differences (amplified) into diff
+image_compare compare_images(const image3f& img, const image3f& ref, int tolerance, image3f& diff) {
+    auto cmp = image_compare();
+    auto sqerr = 0.0;
+    diff = image3f(img.width(), img.height());
+    for(auto j : range(img.height())) {
+        for(auto i : range(img.width())) {
+            auto d = vec3i(std::abs(quantize(img.at(i,j).x) - quantize(ref.at(i,j).x)),
+                           std::abs(quantize(img.at(i,j).y) - quantize(ref.at(i,j).y)),
+                           std::abs(quantize(img.at(i,j).z) - quantize(ref.at(i,j).z)));
+            auto dmax = max(d.x, max(d.y, d.z));
+            cmp.max_diff = max(cmp.max_diff, dmax);
+            if(dmax > tolerance) cmp.bad_pixels ++;
+            sqerr += d.x*d.x + d.y*d.y + d.z*d.z;
+            diff.at(i,j) = vec3f(d.x, d.y, d.z) * (16 / 255.0f);
+        }
+    }
+    auto mse = sqerr / (3.0 * img.width() * img.height());
+    cmp.psnr = (mse > 0) ? 10 * std::log10(255.0 * 255.0 / mse) : INFINITY;
+    return cmp;
+}
+
+// whether a file can be opened
+bool file_exists(const string& filename) { return std::ifstream(filename.c_str()).good(); }
+
+// loads a scene as 01_raytrace does, setting basename to the scene name without extension
+Scene* load_test_scene(const string& scene_filename, string& basename) {
+    if(scene_filename.length() > 9 and scene_filename.substr(0,9) == "testscene") {
+        basename = scene_filename;
+        return create_test_scene(atoi(scene_filename.substr(9).c_str()));
+    } else {
+        basename = scene_filename.substr(0,scene_filename.find_last_of("."));
+        return load_scene(scene_filename);
+    }
+}
+
+// overrides the rendering settings of a scene from the command line
+void set_test_options(Scene* scene, const jsonvalue& args) {
+    if(args.object_element("stream").as_bool()) scene->stream_rays = true;
+    if(args.object_element("cull_tiles").as_bool()) scene->cull_tiles = true;
+    if(args.object_element("accelerator").as_string() != "") scene->accelerator = args.object_element("accelerator").as_string();
+    if(args.object_element("no_bvh").as_bool()) scene->accelerator = "none";
+    if(args.object_element("oversized_fraction").as_float() >= 0) scene->oversized_fraction = args.object_element("oversized_fraction").as_float();
+}
+
+// renders every frame of an animation refitting the accelerator as 01_raytrace does, and compares
+// it to the same frame rendered with the accelerator rebuilt; returns whether all frames matched
+bool test_animation(Scene* scene, const string& scene_filename, const jsonvalue& args) {
+    auto basename = string();
+    auto rebuilt = load_test_scene(scene_filename, basename);
+    error_if_not(rebuilt, "scene is nullptr");
+    set_test_options(rebuilt, args);
+    auto failed = 0;
+    auto built_cost = 0.0f;
+    for(auto frame : range(scene->animation_frames)) {
+        animate_accelerator(scene, frame, args.object_element("rebuild").as_float(), built_cost);
+        animate_scene(rebuilt, frame);
+        build_accelerator(rebuilt);
+        auto img = raytrace(scene);
+        auto ref = raytrace(rebuilt);
+        if(memcmp(img.data(), ref.data(), sizeof(vec3f) * img.width() * img.height())) {
+            message("%-20s FAILED: frame %d rendered differently with the accelerator rebuilt\n", scene_filename.c_str(), frame);
+            failed ++;
+        }
+    }
+    if(not failed) message("%-20s passed: %d frames rendered the same with the accelerator rebuilt\n",
+                           scene_filename.c_str(), scene->animation_frames);
+    delete rebuilt;
+    delete scene;
+    return not failed;
+}
+
+// renders a scene and compares it to its reference (name_ref.png); returns whether the test passed
+bool test_scene(const string& scene_filename, const jsonvalue& args) {
+    auto basename = string();
+    auto scene = load_test_scene(scene_filename, basename);
+    error_if_not(scene, "scene is nullptr");
+    set_test_options(scene, args);
+    if(scene->animation_frames > 0) return test_animation(scene, scene_filename, args);
+    // page the surfaces from small clusters, evicting all but the last page used by default
+    if(args.object_element("out_of_core").as_string() != "") {
+        auto ooc_filename = args.object_element("out_of_core").as_string() + "/" +
+            basename.substr(basename.find_last_of("/\\")+1) + ".ooc";
+        auto ooc_hash = ooc_scene_hash(scene_filename);
+        save_out_of_core(ooc_filename, scene, ooc_hash, args.object_element("ooc_cluster_size").as_int());
+        if(not ooc_file_matches(ooc_filename, ooc_hash)) {
+            message("%-20s FAILED: out-of-core file not matched to its scene\n", scene_filename.c_str());
+            delete scene;
+            return false;
+        }
+        scene->surfaces.clear();
+        scene->ooc = load_out_of_core(ooc_filename, scene, (size_t)(args.object_element("ooc_budget").as_float() * (1 << 20)));
+    }
+    auto accel_cache = args.object_element("accel_cache").as_string();
+    build_accelerator(scene, accel_cache);
+    // render with the accelerator read back from the cache, whether it was just saved or not
+    if(accel_cache != "" and scene->accelerator != "none" and not load_accelerator_cache(scene, accel_cache)) {
+        message("%-20s FAILED: accelerator not cached in %s\n", scene_filename.c_str(), accel_cache.c_str());
+        delete scene;
+        return false;
+    }
+
+    auto img = raytrace(scene);
+    delete scene;
+
+    // compare to another scene, rendered with the same settings, instead of the reference
+    auto same_as = args.object_element("same_as").as_string();
+    if(same_as != "") {
+        auto other_basename = string();
+        auto other = load_test_scene(same_as, other_basename);
+        error_if_not(other, "scene is nullptr");
+        set_test_options(other, args);
+        build_accelerator(other);
+        auto other_img = raytrace(other);
+        delete other;
+        auto passed = other_img.width() == img.width() and other_img.height() == img.height() and
+            not memcmp(other_img.data(), img.data(), sizeof(vec3f) * img.width() * img.height());
+        message("%-20s %s: rendered %s as %s\n", scene_filename.c_str(), (passed) ? "passed" : "FAILED",
+                (passed) ? "the same" : "differently", same_as.c_str());
+        return passed;
+    }
+
+    auto ref_filename = basename + "_ref.png";
+    if(not file_exists(ref_filename)) {
+        message("%-20s FAILED: no reference %s\n", scene_filename.c_str(), ref_filename.c_str());
+        return false;
+    }
+    auto ref = read_png(ref_filename, true);
+    if(ref.width() != img.width() or ref.height() != img.height()) {
+        message("%-20s FAILED: size %dx%d, reference %dx%d\n", scene_filename.c_str(),
+                img.width(), img.height(), ref.width(), ref.height());
+        return false;
+    }
+
+    auto diff = image3f();
+    auto cmp = compare_images(img, ref, args.object_element("tolerance").as_int(), diff);
+    auto passed = cmp.bad_pixels <= args.object_element("max_bad").as_int() and
+                  cmp.psnr >= args.object_element("psnr").as_float();
+    message("%-20s %s: max diff %3d, pixels over tolerance %6d, psnr %6.2f db\n", scene_filename.c_str(),
+            (passed) ? "passed" : "FAILED", cmp.max_diff, cmp.bad_pixels, cmp.psnr);
+    if(not passed) {
+        auto name = basename.substr(basename.find_last_of("/\\")+1);
+        write_png(name + "_test.png", img, true);
+        write_png(name + "_diff.png", diff, true);
+        message("%-20s wrote %s_test.png and %s_diff.png\n", "", name.c_str(), name.c_str());
+    }
+    return passed;
+}
+
+// renders the scenes and compares them to the reference images
+int main(int argc, char** argv) {
+    auto args = parse_cmdline(argc, argv,
+        { "test_raytrace", "render scenes and compare them to their *_ref.png references",
+            {  {"tolerance",      "",  "per-pixel channel difference allowed (8 bit levels)", typeid(int), true, jsonvalue(2)},
+               {"max_bad",        "",  "number of pixels allowed over tolerance", typeid(int), true, jsonvalue(0)},
+               {"psnr",           "",  "minimum psnr (db)", typeid(float), true, jsonvalue(40.0)},
+               {"threads",        "t", "number of threads (0 for all cores)", typeid(int), true, jsonvalue(0)},
+               {"stream",         "",  "trace rays in sorted per-tile batches, bounce by bounce", typeid(bool), true, jsonvalue(false)},
+               {"cull_tiles",     "",  "test camera rays only against the surfaces projected onto their tile", typeid(bool), true, jsonvalue(false)},
+               {"accelerator",    "",  "acceleration structure: bvh, bvh2, bvhq, lbvh, grid, none (defaults to the scene's)", typeid(string), true, jsonvalue("")},
+               {"oversized_fraction", "", "surfaces larger than this fraction of the scene extent are tested outside the accelerator (defaults to the scene's)", typeid(float), true, jsonvalue(-1.0)},
+               {"accel_cache",    "",  "directory caching the built accelerators (rendered as loaded from it)", typeid(string), true, jsonvalue("")},
+               {"out_of_core",    "",  "directory of out-of-core cluster files to render the scenes from", typeid(string), true, jsonvalue("")},
+               {"ooc_cluster_size", "", "max surfaces per out-of-core cluster", typeid(int), true, jsonvalue(2)},
+               {"ooc_budget",     "",  "memory budget of the out-of-core pages in MB", typeid(float), true, jsonvalue(0.0)},
+               {"same_as",        "",  "scene that must render exactly as the tested one (compared instead of the reference)", typeid(string), true, jsonvalue("")},
+               {"rebuild",        "",  "rebuild the bvh of an animation when its sah cost grows by this factor", typeid(float), true, jsonvalue(1.5)},
+               {"no_bvh",         "",  "intersect all surfaces without the bvh", typeid(bool), true, jsonvalue(false)}  },
+            {  {"scene_filename", "",  "scene filename or testsceneN (all scenes if not given)", typeid(string), true, jsonvalue("")}  }
+        });
+
+    parallel_set_nthreads(args.object_element("threads").as_int());
+
+    auto scenes = test_scenes;
+    if(args.object_element("scene_filename").as_string() != "") scenes = { args.object_element("scene_filename").as_string() };
+
+    auto failed = 0;
+    for(auto& scene_filename : scenes) {
+        if(not test_scene(scene_filename, args)) failed ++;
+    }
+    if(failed) message("%d of %d scenes FAILED\n", failed, (int)scenes.size());
+    else message("all %d scenes passed\n", (int)scenes.size());
+    return (failed) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,68 @@
+#include "arena.h"
+#include <cstdlib>
+#include <cstdint>
+#include <algorithm>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+// huge page size assumed for rounding the blocks
+#define arena_huge_page_size (2 << 20)
+
+static bool _arena_huge_pages = false;
+
+void arena_set_huge_pages(bool huge_pages) { _arena_huge_pages = huge_pages; }
+
+Arena::Arena(size_t block_size) : _block_size(block_size), _huge_pages(_arena_huge_pages) { }
+
+void Arena::_add_block(size_t size) {
+    auto block = _Block{ nullptr, std::max(size, _block_size), false };
+#ifdef __linux__
+    if(_huge_pages) {
+        block.size = (block.size + arena_huge_page_size - 1) / arena_huge_page_size * arena_huge_page_size;
+        // explicit huge pages if the system reserved some, transparent ones otherwise
+        auto data = mmap(nullptr, block.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(data == MAP_FAILED) {
+            data = mmap(nullptr, block.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if(data != MAP_FAILED) madvise(data, block.size, MADV_HUGEPAGE);
+        }
+        if(data != MAP_FAILED) { block.data = (char*)data; block.mapped = true; }
+    }
+#endif
+    if(not block.data) block.data = (char*)std::malloc(block.size);
+    error_if_not(block.data, "cannot allocate %zu bytes for the arena\n", block.size);
+    _blocks.push_back(block);
+    _offset = 0;
+    _reserved += block.size;
+}
+
+void* Arena::allocate(size_t size, size_t align) {
+    if(not _blocks.empty()) {
+        auto& block = _blocks.back();
+        auto addr = (uintptr_t)(block.data + _offset);
+        auto start = _offset + (align - addr % align) % align;
+        if(start + size <= block.size) {
+            _offset = start + size;
+            _used += size;
+            return block.data + start;
+        }
+    }
+    // blocks from malloc and mmap are aligned for any type
+    _add_block(size);
+    _offset = size;
+    _used += size;
+    return _blocks.back().data;
+}
+
+void Arena::clear() {
+    for(auto i = (int)_destructors.size() - 1; i >= 0; i --) _destructors[i].destroy(_destructors[i].ptr);
+    _destructors.clear();
+    for(auto& block : _blocks) {
+#ifdef __linux__
+        if(block.mapped) { munmap(block.data, block.size); continue; }
+#endif
+        std::free(block.data);
+    }
+    _blocks.clear();
+    _offset = _used = _reserved = 0;
+}
@@ -0,0 +1,57 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include "common.h"
+#include <new>
+#include <utility>
+#include <type_traits>
+
+// whether new arenas back their blocks with huge pages (off by default)
+void arena_set_huge_pages(bool huge_pages);
+
+// bump allocator owning objects in large contiguous blocks. objects never move, so
+// pointers to them stay valid until the arena is cleared or destroyed, which runs the
+// destructors (in reverse order) and frees all the blocks at once. not thread safe.
+struct Arena {
+    // arena allocating blocks of at least block_size bytes (huge pages if enabled)
+    explicit Arena(size_t block_size = 1 << 20);
+    ~Arena() { clear(); }
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    // uninitialized memory of the given size and alignment
+    void* allocate(size_t size, size_t align);
+
+    // constructs a T in the arena; its destructor runs when the arena is cleared
+    template<typename T, typename ... Args>
+    T* make(Args&& ... args) {
+        auto ptr = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        if(not std::is_trivially_destructible<T>::value)
+            _destructors.push_back({ ptr, [](void* p){ ((T*)p)->~T(); } });
+        return ptr;
+    }
+
+    // destroys all the objects and frees the blocks
+    void clear();
+
+    // bytes handed out, and bytes held in blocks
+    size_t used() const { return _used; }
+    size_t reserved() const { return _reserved; }
+
+private:
+    struct _Block { char* data; size_t size; bool mapped; };
+    struct _Destructor { void* ptr; void (*destroy)(void*); };
+
+    size_t              _block_size;
+    bool                _huge_pages;
+    vector<_Block>      _blocks;
+    size_t              _offset = 0;        // first free byte in the last block
+    size_t              _used = 0;
+    size_t              _reserved = 0;
+    vector<_Destructor> _destructors;
+
+    void _add_block(size_t size);
+};
+
+#endif
@@ -0,0 +1,604 @@
+#include "bvh.h"
+#include "parallel.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+#define bvh_leaf_size 4         // max surfaces in a leaf when splitting is not worth it
+#define bvh_max_depth 48        // max tree depth (bounded by the traversal stack)
+#define bvh_nbins 16            // sah bins per split
+#define lbvh_chunk 4096         // surfaces per parallel task of the linear builder
+#define oversized_max 16        // max surfaces kept out of the accelerators
+
+range3f surface_bbox(Surface* surface) {
+    auto r = surface->radius;
+    auto half = vec3f(r,r,r);
+    if(surface->isquad) half.z = 0;
+    // the cylinder test accepts hits up to sqrt(2)*radius away from its axis
+    else if(surface->iscyl) half.z = r*sqrt(2.0f);
+    // the local box is centered at the frame origin, so its world extent along each
+    // axis is the sum of the frame axes scaled by the half sizes (instead of 8 corners)
+    auto& f = surface->frame;
+    auto extent = abs(f.x)*half.x + abs(f.y)*half.y + abs(f.z)*half.z;
+    // pad to avoid culling hits on flat boxes due to round-off
+    return range3f(f.o-extent-one3f*ray3f_epsilon,f.o+extent+one3f*ray3f_epsilon);
+}
+
+vector<int> oversized_surfaces(Scene* scene, float fraction) {
+    auto oversized = vector<int>();
+    auto nsurfaces = (int)scene->surfaces.size();
+    if(fraction <= 0 or not nsurfaces) return oversized;
+    auto diagonals = vector<float>(nsurfaces);
+    auto scene_bbox = range3f();
+    for(auto sid : range(nsurfaces)) {
+        auto bbox = surface_bbox(scene->surfaces[sid]);
+        diagonals[sid] = length(size(bbox));
+        scene_bbox = runion(scene_bbox, bbox);
+    }
+    auto threshold = fraction * length(size(scene_bbox));
+    for(auto sid : range(nsurfaces)) if(diagonals[sid] > threshold) oversized.push_back(sid);
+    // keep the largest ones, in scene order
+    if(oversized.size() > oversized_max) {
+        std::stable_sort(oversized.begin(), oversized.end(), [&](int a, int b){ return diagonals[a] > diagonals[b]; });
+        oversized.resize(oversized_max);
+        std::sort(oversized.begin(), oversized.end());
+    }
+    return oversized;
+}
+
+vector<int> accelerated_surfaces(Scene* scene) {
+    auto sids = vector<int>();
+    sids.reserve(scene->surfaces.size() - scene->oversized.size());
+    auto next = 0;
+    for(auto sid : range((int)scene->surfaces.size())) {
+        if(next < (int)scene->oversized.size() and scene->oversized[next] == sid) { next ++; continue; }
+        sids.push_back(sid);
+    }
+    return sids;
+}
+
+// surface area of a box
+static float _bbox_area(const range3f& bbox) {
+    if(not isvalid(bbox)) return 0;
+    auto s = size(bbox);
+    return 2*(s.x*s.y+s.y*s.z+s.z*s.x);
+}
+
+// recursively builds node nid over surfaces [start,end)
+static void _build_node(BVH* bvh, int nid, const vector<range3f>& bboxes, const vector<vec3f>& centroids,
+                        int start, int end, int depth) {
+    auto bbox = range3f(), cbox = range3f();
+    for(auto i : range(start,end)) {
+        bbox = runion(bbox,bboxes[bvh->surfaces[i]]);
+        cbox = runion(cbox,centroids[bvh->surfaces[i]]);
+    }
+    auto& node = bvh->nodes[nid];
+    node.bbox = bbox;
+    node.depth = depth;
+    node.start = start;
+    node.count = end-start;
+    if(end-start <= 1 or depth >= bvh_max_depth) return;
+
+    // split along the largest centroid extent
+    auto csize = size(cbox);
+    auto axis = (csize.x > csize.y and csize.x > csize.z) ? 0 : ((csize.y > csize.z) ? 1 : 2);
+    auto mid = start + (end-start)/2;
+    if(csize[axis] > 0) {
+        // binned surface area heuristic
+        auto bin_of = [&](int sid) {
+            auto b = (int)(bvh_nbins * (centroids[sid][axis]-cbox.min[axis]) / csize[axis]);
+            return clamp(b,0,bvh_nbins-1);
+        };
+        range3f bin_bbox[bvh_nbins]; int bin_count[bvh_nbins] = {0};
+        for(auto i : range(start,end)) {
+            auto b = bin_of(bvh->surfaces[i]);
+            bin_bbox[b] = runion(bin_bbox[b],bboxes[bvh->surfaces[i]]);
+            bin_count[b] ++;
+        }
+        float right_area[bvh_nbins]; int right_count[bvh_nbins];
+        auto acc_bbox = range3f(); auto acc_count = 0;
+        for(auto b = bvh_nbins-1; b > 0; b --) {
+            acc_bbox = runion(acc_bbox,bin_bbox[b]); acc_count += bin_count[b];
+            right_area[b] = _bbox_area(acc_bbox); right_count[b] = acc_count;
+        }
+        auto best_cost = _bbox_area(bbox)*(end-start); auto best_split = -1;
+        acc_bbox = range3f(); acc_count = 0;
+        for(auto b : range(1,bvh_nbins)) {
+            acc_bbox = runion(acc_bbox,bin_bbox[b-1]); acc_count += bin_count[b-1];
+            if(not acc_count or not right_count[b]) continue;
+            auto cost = _bbox_area(acc_bbox)*acc_count + right_area[b]*right_count[b];
+            if(cost < best_cost) { best_cost = cost; best_split = b; }
+        }
+        if(best_split < 0 and end-start <= bvh_leaf_size) return;
+        if(best_split >= 0) {
+            mid = (int)(std::partition(bvh->surfaces.begin()+start, bvh->surfaces.begin()+end,
+                                       [&](int sid){ return bin_of(sid) < best_split; }) - bvh->surfaces.begin());
+        } else {
+            std::nth_element(bvh->surfaces.begin()+start, bvh->surfaces.begin()+mid, bvh->surfaces.begin()+end,
+                             [&](int a, int b){ return centroids[a][axis] < centroids[b][axis]; });
+        }
+    } else if(end-start <= bvh_leaf_size) return;
+
+    // make children (stored consecutively after the parent)
+    auto child = (int)bvh->nodes.size();
+    bvh->nodes.resize(child+2);
+    bvh->nodes[nid].start = child;
+    bvh->nodes[nid].count = 0;
+    _build_node(bvh, child+0, bboxes, centroids, start, mid, depth+1);
+    _build_node(bvh, child+1, bboxes, centroids, mid, end, depth+1);
+}
+
+// split axis between the bounds of two siblings, swapping them if needed so that the
+// second is the farther one along the axis
+static int _sibling_axis(int& a, int& b, const MappedVector<BVHNode>& nodes) {
+    auto d = center(nodes[b].bbox) - center(nodes[a].bbox);
+    auto axis = (fabs(d.x) > fabs(d.y) and fabs(d.x) > fabs(d.z)) ? 0 : ((fabs(d.y) > fabs(d.z)) ? 1 : 2);
+    if(d[axis] < 0) std::swap(a,b);
+    return axis;
+}
+
+// sets the bounds of child c of a wide node to those of its binary node
+static void _set_wide_bbox(BVHWideNode& wnode, int c, const range3f& bbox) {
+    for(auto a : range(3)) { wnode.bmin[a][c] = bbox.min[a]; wnode.bmax[a][c] = bbox.max[a]; }
+}
+
+// collapses the binary node nid (and its children) into a new wide node, returning its index
+static int _collapse_node(BVH* bvh, int nid) {
+    auto wid = (int)bvh->wide.size();
+    bvh->wide.push_back(BVHWideNode());
+    int slots[4] = { -1, -1, -1, -1 }; int axis[3] = { 0, 0, 0 };
+    auto& node = bvh->nodes[nid];
+    if(node.count) slots[0] = nid;
+    else {
+        int pair[2] = { node.start, node.start+1 };
+        axis[0] = _sibling_axis(pair[0], pair[1], bvh->nodes);
+        for(auto p : range(2)) {
+            auto& child = bvh->nodes[pair[p]];
+            if(child.count) { slots[2*p] = pair[p]; continue; }
+            slots[2*p] = child.start; slots[2*p+1] = child.start+1;
+            axis[1+p] = _sibling_axis(slots[2*p], slots[2*p+1], bvh->nodes);
+        }
+    }
+    for(auto a : range(3)) bvh->wide[wid].axis[a] = axis[a];
+    for(auto c : range(4)) {
+        auto& wnode = bvh->wide[wid];
+        wnode.node[c] = slots[c];
+        if(slots[c] < 0) {
+            _set_wide_bbox(wnode, c, range3f(zero3f,zero3f));
+            wnode.child[c] = 0; wnode.count[c] = 0;
+            continue;
+        }
+        wnode.mask |= 1 << c;
+        _set_wide_bbox(wnode, c, bvh->nodes[slots[c]].bbox);
+        wnode.count[c] = bvh->nodes[slots[c]].count;
+        wnode.child[c] = (wnode.count[c]) ? bvh->nodes[slots[c]].start : 0;
+        // wide may grow in the recursion, so wnode cannot be used past it
+        if(not bvh->nodes[slots[c]].count) {
+            auto child = _collapse_node(bvh, slots[c]);
+            bvh->wide[wid].child[c] = child;
+        }
+    }
+    return wid;
+}
+
+// quantizes the wide node bounds on a grid local to each node, rounding them outwards
+// so that the dequantized bounds computed by the traversal enclose the children
+static BVHQuantNode _quantize_node(const BVHWideNode& wnode) {
+    static_assert(sizeof(BVHQuantNode) == 64, "quantized nodes should fill a cache line");
+    auto qnode = BVHQuantNode();
+    qnode.mask = (uint8_t)wnode.mask;
+    for(auto a : range(3)) {
+        auto bmin = ray3f_rayinf, bmax = -ray3f_rayinf;
+        for(auto c : range(4)) {
+            if(not (wnode.mask & (1 << c))) continue;
+            bmin = min(bmin, wnode.bmin[a][c]); bmax = max(bmax, wnode.bmax[a][c]);
+        }
+        if(not wnode.mask) bmin = bmax = 0;
+        // smallest power of two cell such that 255 cells cover the extent
+        auto exponent = 0;
+        std::frexp((bmax - bmin) / 255, &exponent);
+        exponent = clamp(exponent, -126, 127);
+        auto scale = bvh_exp2(exponent);
+        qnode.origin[a] = bmin;
+        qnode.exponent[a] = (int8_t)exponent;
+        qnode.axis[a] = (uint8_t)wnode.axis[a];
+        for(auto c : range(4)) {
+            if(not (wnode.mask & (1 << c))) { qnode.qmin[a][c] = qnode.qmax[a][c] = 0; continue; }
+            auto qmin = clamp((int)std::floor((wnode.bmin[a][c] - bmin) / scale), 0, 255);
+            auto qmax = clamp((int)std::ceil((wnode.bmax[a][c] - bmin) / scale), 0, 255);
+            // round-off can leave the dequantized bounds a bit inside the child ones
+            while(qmin > 0 and qnode.origin[a] + qmin * scale > wnode.bmin[a][c]) qmin --;
+            while(qmax < 255 and qnode.origin[a] + qmax * scale < wnode.bmax[a][c]) qmax ++;
+            qnode.qmin[a][c] = (uint8_t)qmin; qnode.qmax[a][c] = (uint8_t)qmax;
+        }
+    }
+    for(auto c : range(4)) {
+        error_if_not(wnode.count[c] < 256, "bvh leaf too large to quantize (%d surfaces)\n", wnode.count[c]);
+        qnode.child[c] = wnode.child[c];
+        qnode.count[c] = (uint8_t)wnode.count[c];
+    }
+    return qnode;
+}
+
+// replaces the wide nodes with quantized ones
+static void _quantize_nodes(BVH* bvh) {
+    bvh->quant.resize(bvh->wide.size());
+    parallel_for(bvh->wide.size(), [&](int wid){ bvh->quant[wid] = _quantize_node(bvh->wide[wid]); });
+    bvh->wide = MappedVector<BVHWideNode>();
+}
+
+// groups the nodes by depth and builds the wide (and quantized) nodes
+static void _finish_bvh(BVH* bvh, int width, bool quantized) {
+    for(auto nid : range(bvh->nodes.size())) {
+        auto depth = bvh->nodes[nid].depth;
+        if(depth >= (int)bvh->levels.size()) bvh->levels.resize(depth+1);
+        bvh->levels[depth].push_back(nid);
+    }
+    if(width == 4) {
+        bvh->wide.reserve(bvh->nodes.size()/3+1);
+        _collapse_node(bvh, 0);
+        if(quantized) _quantize_nodes(bvh);
+    }
+}
+
+BVH* build_bvh(Scene* scene, int width, bool quantized) {
+    auto sids = accelerated_surfaces(scene);
+    auto bboxes = vector<range3f>(sids.size());
+    parallel_for(sids.size(), [&](int i){ bboxes[i] = surface_bbox(scene->surfaces[sids[i]]); });
+    auto bvh = build_bvh(bboxes, width, quantized);
+    for(auto& sid : bvh->surfaces) sid = sids[sid];
+    return bvh;
+}
+
+BVH* build_bvh(const vector<range3f>& bboxes, int width, bool quantized) {
+    error_if_not(width == 2 or width == 4, "unsupported bvh width %d\n", width);
+    TRACE_SCOPE("build_bvh", "accel");
+    auto bvh = new BVH();
+    auto nsurfaces = (int)bboxes.size();
+    if(not nsurfaces) return bvh;
+    auto centroids = vector<vec3f>(nsurfaces);
+    for(auto sid : range(nsurfaces)) centroids[sid] = center(bboxes[sid]);
+    bvh->surfaces.resize(nsurfaces);
+    for(auto sid : range(nsurfaces)) bvh->surfaces[sid] = sid;
+    bvh->nodes.reserve(2*nsurfaces);
+    bvh->nodes.resize(1);
+    _build_node(bvh, 0, bboxes, centroids, 0, nsurfaces, 0);
+    _finish_bvh(bvh, width, quantized);
+    return bvh;
+}
+
+// leading zero bits (x not zero)
+static inline int _clz64(uint64_t x) {
+#ifdef __GNUC__
+    return __builtin_clzll(x);
+#else
+    auto n = 0;
+    while(not (x & (1ull << 63))) { x <<= 1; n ++; }
+    return n;
+#endif
+}
+
+// spreads the low 21 bits of v so that each is followed by two zero bits
+static inline uint64_t _morton_spread(uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffull;
+    v = (v | v << 16) & 0x1f0000ff0000ffull;
+    v = (v | v << 8) & 0x100f00f00f00f00full;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+    v = (v | v << 2) & 0x1249249249249249ull;
+    return v;
+}
+
+// morton code of p in cbox with bits_per_axis bits along each axis
+static inline uint64_t _morton_code(const vec3f& p, const range3f& cbox, int bits_per_axis) {
+    auto csize = size(cbox);
+    auto cells = (float)((1 << bits_per_axis) - 1);
+    uint64_t q[3];
+    for(auto a : range(3)) q[a] = (uint64_t)((csize[a] > 0) ? clamp((p[a]-cbox.min[a]) / csize[a], 0.0f, 1.0f) * cells : 0);
+    return (_morton_spread(q[0]) << 2) | (_morton_spread(q[1]) << 1) | _morton_spread(q[2]);
+}
+
+// stable lsd radix sort of the keys (and their values) on their low bits, 8 bits per
+// pass: chunks count their digits in parallel, then scatter at their prefix sums
+static void _radix_sort(vector<uint64_t>& keys, vector<int>& values, int bits) {
+    auto n = (int)keys.size();
+    auto nchunks = (n + lbvh_chunk - 1) / lbvh_chunk;
+    auto sorted_keys = vector<uint64_t>(n); auto sorted_values = vector<int>(n);
+    auto offsets = vector<int>(nchunks*256);
+    for(auto shift = 0; shift < bits; shift += 8) {
+        parallel_for(nchunks, [&](int chunk){
+            auto count = offsets.data() + chunk*256;
+            for(auto d : range(256)) count[d] = 0;
+            for(auto i : range(chunk*lbvh_chunk, min(n, (chunk+1)*lbvh_chunk))) count[(keys[i] >> shift) & 255] ++;
+        });
+        // digit-major, chunk-minor offsets keep equal digits in their input order
+        auto sum = 0;
+        for(auto d : range(256)) {
+            for(auto chunk : range(nchunks)) { auto count = offsets[chunk*256+d]; offsets[chunk*256+d] = sum; sum += count; }
+        }
+        parallel_for(nchunks, [&](int chunk){
+            auto offset = offsets.data() + chunk*256;
+            for(auto i : range(chunk*lbvh_chunk, min(n, (chunk+1)*lbvh_chunk))) {
+                auto o = offset[(keys[i] >> shift) & 255] ++;
+                sorted_keys[o] = keys[i]; sorted_values[o] = values[i];
+            }
+        });
+        std::swap(keys, sorted_keys); std::swap(values, sorted_values);
+    }
+}
+
+// node of the radix tree over the sorted surfaces. children are internal nodes, or
+// leaves (single surfaces) encoded as ~index in the sorted order
+struct _LBVHNode {
+    int         child[2];
+    int         first, last;        // sorted range covered (if contiguous)
+    int         parent = -1;
+    int         count = 0;          // surfaces in the subtree
+    bool        contiguous = true;  // whether the subtree still covers [first,last] after restructuring
+    float       cost = 0;           // sah cost of the subtree (as bvh_sah_cost, not normalized)
+    range3f     bbox;
+};
+
+#define lbvh_treelet_size 7     // leaves of the treelets restructured by the refinement
+
+// bounds, count and sah cost of a radix tree child
+static inline range3f _lbvh_bbox(const vector<_LBVHNode>& tree, const vector<range3f>& leaf_bboxes, int c) {
+    return (c >= 0) ? tree[c].bbox : leaf_bboxes[~c];
+}
+static inline int _lbvh_count(const vector<_LBVHNode>& tree, int c) { return (c >= 0) ? tree[c].count : 1; }
+static inline float _lbvh_cost(const vector<_LBVHNode>& tree, const vector<range3f>& leaf_bboxes, int c) {
+    return (c >= 0) ? tree[c].cost : _bbox_area(leaf_bboxes[~c]);
+}
+
+// sets the bounds, count and cost of node k from its children; small contiguous
+// subtrees are costed as the leaves they become
+static void _lbvh_update(vector<_LBVHNode>& tree, const vector<range3f>& leaf_bboxes, int k) {
+    auto& node = tree[k];
+    node.bbox = runion(_lbvh_bbox(tree, leaf_bboxes, node.child[0]), _lbvh_bbox(tree, leaf_bboxes, node.child[1]));
+    node.count = _lbvh_count(tree, node.child[0]) + _lbvh_count(tree, node.child[1]);
+    if(node.contiguous and node.count <= bvh_leaf_size) node.cost = _bbox_area(node.bbox) * node.count;
+    else node.cost = _bbox_area(node.bbox) + _lbvh_cost(tree, leaf_bboxes, node.child[0]) + _lbvh_cost(tree, leaf_bboxes, node.child[1]);
+}
+
+// optimal treelet topology found by _lbvh_restructure: rebuilds subset s of the treelet
+// leaves reusing its internal nodes, returning the subset root
+static int _lbvh_treelet_build(vector<_LBVHNode>& tree, const vector<range3f>& leaf_bboxes, const int* leaves,
+                               const int* internals, const int* partition, int s, int& next) {
+    if(not (s & (s-1))) { auto i = 0; while(not (s & (1 << i))) i ++; return leaves[i]; }
+    auto k = internals[next++];
+    tree[k].child[0] = _lbvh_treelet_build(tree, leaf_bboxes, leaves, internals, partition, partition[s], next);
+    tree[k].child[1] = _lbvh_treelet_build(tree, leaf_bboxes, leaves, internals, partition, s ^ partition[s], next);
+    if(k != internals[0]) tree[k].contiguous = false;
+    _lbvh_update(tree, leaf_bboxes, k);
+    return k;
+}
+
+// treelet restructuring (karras and aila 2013): grows a treelet from node k by expanding
+// its largest leaves, finds the topology of its leaves with the lowest sah cost over all
+// their partitions (dynamic programming on the subsets), and rebuilds it if cheaper
+static void _lbvh_restructure(vector<_LBVHNode>& tree, const vector<range3f>& leaf_bboxes, int k) {
+    int leaves[lbvh_treelet_size], internals[lbvh_treelet_size-1];
+    auto nleaves = 2, ninternals = 1;
+    leaves[0] = tree[k].child[0]; leaves[1] = tree[k].child[1]; internals[0] = k;
+    while(nleaves < lbvh_treelet_size) {
+        auto largest = -1; auto largest_area = -1.0f;
+        for(auto i : range(nleaves)) {
+            auto c = leaves[i];
+            if(c < 0 or tree[c].count <= bvh_leaf_size) continue;
+            auto area = _bbox_area(tree[c].bbox);
+            if(area > largest_area) { largest = i; largest_area = area; }
+        }
+        if(largest < 0) break;
+        auto c = leaves[largest];
+        internals[ninternals++] = c;
+        leaves[largest] = tree[c].child[0]; leaves[nleaves++] = tree[c].child[1];
+    }
+    if(nleaves < 3) return;
+
+    const int nsubsets = 1 << lbvh_treelet_size;
+    range3f bbox[nsubsets]; float cost[nsubsets]; int partition[nsubsets];
+    auto full = (1 << nleaves) - 1;
+    for(auto s : range(1, full+1)) {
+        if(not (s & (s-1))) {
+            auto i = 0; while(not (s & (1 << i))) i ++;
+            bbox[s] = _lbvh_bbox(tree, leaf_bboxes, leaves[i]);
+            cost[s] = _lbvh_cost(tree, leaf_bboxes, leaves[i]);
+            continue;
+        }
+        bbox[s] = runion(bbox[s & (s-1)], bbox[s & -s]);
+        // each split counted once, with the lowest leaf on the first side
+        cost[s] = 0; partition[s] = 0;
+        auto low = s & -s;
+        for(auto p = (s-1) & s; p; p = (p-1) & s) {
+            if(not (p & low)) continue;
+            auto c = cost[p] + cost[s ^ p];
+            if(not partition[s] or c < cost[s]) { cost[s] = c; partition[s] = p; }
+        }
+        cost[s] += _bbox_area(bbox[s]);
+    }
+    if(cost[full] >= tree[k].cost * 0.999f) return;
+    auto next = 0;
+    _lbvh_treelet_build(tree, leaf_bboxes, leaves, internals, partition, full, next);
+}
+
+// restructures the treelets rooted in the top levels of the tree, children first
+static void _lbvh_refine(vector<_LBVHNode>& tree, const vector<range3f>& leaf_bboxes, int k, int levels) {
+    if(levels <= 0 or tree[k].count <= bvh_leaf_size) return;
+    for(auto c : tree[k].child) if(c >= 0) _lbvh_refine(tree, leaf_bboxes, c, levels-1);
+    _lbvh_update(tree, leaf_bboxes, k);
+    _lbvh_restructure(tree, leaf_bboxes, k);
+}
+
+BVH* build_lbvh(Scene* scene, int width, bool quantized, int refine_levels) {
+    error_if_not(width == 2 or width == 4, "unsupported bvh width %d\n", width);
+    TRACE_SCOPE("build_lbvh", "accel");
+    auto bvh = new BVH();
+    auto sids = accelerated_surfaces(scene);
+    auto n = (int)sids.size();
+    if(not n) return bvh;
+    auto nchunks = (n + lbvh_chunk - 1) / lbvh_chunk;
+
+    // surface bounds and the centroid bounds, reduced per chunk
+    auto bboxes = vector<range3f>(n);
+    auto chunk_cbox = vector<range3f>(nchunks);
+    parallel_for(nchunks, [&](int chunk){
+        for(auto i : range(chunk*lbvh_chunk, min(n, (chunk+1)*lbvh_chunk))) {
+            bboxes[i] = surface_bbox(scene->surfaces[sids[i]]);
+            chunk_cbox[chunk] = runion(chunk_cbox[chunk], center(bboxes[i]));
+        }
+    });
+    auto cbox = range3f();
+    for(auto& b : chunk_cbox) cbox = runion(cbox, b);
+
+    // morton codes of the boxes (indices in sids until sorted), 30 bits while they have more cells than surfaces, 63 beyond
+    auto bits_per_axis = (n <= (1 << 20)) ? 10 : 21;
+    auto keys = vector<uint64_t>(n);
+    bvh->surfaces.resize(n);
+    parallel_for(nchunks, [&](int chunk){
+        for(auto i : range(chunk*lbvh_chunk, min(n, (chunk+1)*lbvh_chunk))) {
+            keys[i] = _morton_code(center(bboxes[i]), cbox, bits_per_axis);
+            bvh->surfaces[i] = i;
+        }
+    });
+    _radix_sort(keys, bvh->surfaces.owned(), 3*bits_per_axis);
+    auto leaf_bboxes = vector<range3f>(n);
+    parallel_for(nchunks, [&](int chunk){
+        for(auto i : range(chunk*lbvh_chunk, min(n, (chunk+1)*lbvh_chunk))) {
+            leaf_bboxes[i] = bboxes[bvh->surfaces[i]];
+            bvh->surfaces[i] = sids[bvh->surfaces[i]];
+        }
+    });
+    bvh->nodes.reserve(2*n);
+    bvh->nodes.resize(1);
+    if(n == 1) {
+        bvh->nodes[0].bbox = leaf_bboxes[0]; bvh->nodes[0].count = 1;
+        _finish_bvh(bvh, width, quantized);
+        return bvh;
+    }
+
+    // radix tree (karras 2012): internal node i splits at the highest bit differing in
+    // its range, found by binary searches on the common prefix lengths; equal codes are
+    // told apart by their index
+    auto tree = vector<_LBVHNode>(n-1);
+    auto leaf_parent = vector<int>(n, -1);
+    auto prefix = [&](int i, int j) {
+        if(j < 0 or j >= n) return -1;
+        auto x = keys[i] ^ keys[j];
+        return (x) ? _clz64(x) : 64 + _clz64((uint64_t)(uint32_t)(i ^ j)) - 32;
+    };
+    parallel_for((n-1 + lbvh_chunk-1) / lbvh_chunk, [&](int chunk){
+        for(auto i : range(chunk*lbvh_chunk, min(n-1, (chunk+1)*lbvh_chunk))) {
+            auto d = (prefix(i, i+1) - prefix(i, i-1) > 0) ? 1 : -1;
+            auto prefix_min = prefix(i, i-d);
+            auto lmax = 2;
+            while(prefix(i, i + lmax*d) > prefix_min) lmax *= 2;
+            auto l = 0;
+            for(auto t = lmax/2; t >= 1; t /= 2) if(prefix(i, i + (l+t)*d) > prefix_min) l += t;
+            auto j = i + l*d;
+            auto prefix_node = prefix(i, j);
+            auto s = 0;
+            for(auto div = 2, t = 0; t != 1; div *= 2) {
+                t = (l + div - 1) / div;
+                if(prefix(i, i + (s+t)*d) > prefix_node) s += t;
+            }
+            auto split = i + s*d + min(d, 0);
+            auto& node = tree[i];
+            node.first = min(i, j); node.last = max(i, j);
+            node.child[0] = (node.first == split) ? ~split : split;
+            node.child[1] = (node.last == split+1) ? ~(split+1) : split+1;
+            for(auto c : node.child) {
+                if(c >= 0) tree[c].parent = i;
+                else leaf_parent[~c] = i;
+            }
+        }
+    });
+
+    // bounds bottom-up: the second child to reach a node computes it and goes on
+    auto arrivals = vector<std::atomic<int>>(tree.size());
+    for(auto& a : arrivals) a = 0;
+    parallel_for(nchunks, [&](int chunk){
+        for(auto i : range(chunk*lbvh_chunk, min(n, (chunk+1)*lbvh_chunk))) {
+            auto k = leaf_parent[i];
+            while(k >= 0 and arrivals[k].fetch_add(1) == 1) {
+                _lbvh_update(tree, leaf_bboxes, k);
+                k = tree[k].parent;
+            }
+        }
+    });
+
+    // sah treelet restructuring of the top levels, where the morton splits are the coarsest
+    _lbvh_refine(tree, leaf_bboxes, 0, min(refine_levels, bvh_max_depth/2));
+
+    // emit the bvh nodes with children stored consecutively after their parent; small
+    // contiguous subtrees become leaves
+    struct _Emit { int child, nid, depth; };
+    auto stack = vector<_Emit>{ { 0, 0, 0 } };
+    while(not stack.empty()) {
+        auto e = stack.back(); stack.pop_back();
+        auto& node = bvh->nodes[e.nid];
+        node.depth = e.depth;
+        if(e.child < 0) { node.bbox = leaf_bboxes[~e.child]; node.start = ~e.child; node.count = 1; continue; }
+        auto& tnode = tree[e.child];
+        node.bbox = tnode.bbox;
+        if(tnode.contiguous and (tnode.count <= bvh_leaf_size or e.depth >= bvh_max_depth)) {
+            node.start = tnode.first; node.count = tnode.last - tnode.first + 1;
+            continue;
+        }
+        auto child = (int)bvh->nodes.size();
+        node.start = child; node.count = 0;
+        bvh->nodes.resize(child+2);
+        stack.push_back({ tnode.child[1], child+1, e.depth+1 });
+        stack.push_back({ tnode.child[0], child+0, e.depth+1 });
+    }
+    _finish_bvh(bvh, width, quantized);
+    return bvh;
+}
+
+void refit_bvh(BVH* bvh, Scene* scene) {
+    TRACE_SCOPE("refit_bvh", "accel");
+    // sweep the levels from the deepest up; nodes in a level are independent
+    for(auto depth = (int)bvh->levels.size()-1; depth >= 0; depth --) {
+        auto& level = bvh->levels[depth];
+        parallel_for(level.size(), [&](int i){
+            auto& node = bvh->nodes[level[i]];
+            auto bbox = range3f();
+            if(node.count) {
+                for(auto j : range(node.start,node.start+node.count))
+                    bbox = runion(bbox,surface_bbox(scene->surfaces[bvh->surfaces[j]]));
+            } else {
+                bbox = runion(bvh->nodes[node.start].bbox,bvh->nodes[node.start+1].bbox);
+            }
+            node.bbox = bbox;
+        });
+    }
+    parallel_for(bvh->wide.size(), [&](int wid){
+        auto& wnode = bvh->wide[wid];
+        for(auto c : range(4)) if(wnode.mask & (1 << c)) _set_wide_bbox(wnode, c, bvh->nodes[wnode.node[c]].bbox);
+    });
+    // quantized nodes do not keep their binary nodes, so they are collapsed again
+    if(not bvh->quant.empty()) {
+        bvh->quant.clear();
+        _collapse_node(bvh, 0);
+        _quantize_nodes(bvh);
+    }
+}
+
+size_t bvh_memory(BVH* bvh) {
+    auto bytes = bvh->surfaces.size() * sizeof(int);
+    if(not bvh->quant.empty()) return bytes + bvh->quant.size() * sizeof(BVHQuantNode);
+    if(not bvh->wide.empty()) return bytes + bvh->wide.size() * sizeof(BVHWideNode);
+    return bytes + bvh->nodes.size() * sizeof(BVHNode);
+}
+
+float bvh_sah_cost(BVH* bvh) {
+    if(bvh->nodes.empty()) return 0;
+    auto root_area = _bbox_area(bvh->nodes[0].bbox);
+    if(root_area <= 0) return 0;
+    auto cost = 0.0f;
+    for(auto& node : bvh->nodes) {
+        cost += _bbox_area(node.bbox) / root_area * ((node.count) ? node.count : 1);
+    }
+    return cost;
+}
@@ -0,0 +1,260 @@
+#ifndef _BVH_H_
+#define _BVH_H_
+
+#include "scene.h"
+#include "ray.h"
+#include "stats.h"
+#include "mapped.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// bvh node: internal nodes point to two consecutive children at nodes[start],
+// leaves to count surface indices at surfaces[start]. children are always
+// stored after their parent, so a reverse sweep visits children first.
+struct BVHNode {
+    range3f     bbox;           // node bounds
+    int         start = 0;      // first child (internal) or first surface index (leaf)
+    int         count = 0;      // number of surfaces (0 for internal nodes)
+    int         depth = 0;      // depth in the tree (root is 0)
+};
+
+// 4-wide node collapsed from two levels of the binary tree: children 0,1 come from the
+// first child of the binary node and 2,3 from the second (or a single leaf each). child
+// bounds are stored by axis, so that one simd slab test covers all children.
+struct BVHWideNode {
+    alignas(16) float   bmin[3][4];     // child bounds min, bmin[axis][child]
+    alignas(16) float   bmax[3][4];     // child bounds max, bmax[axis][child]
+    int         child[4];               // wide node (internal) or first surface index (leaf)
+    int         count[4];               // number of surfaces (0 for internal children)
+    int         node[4];                // binary node of each child (for refitting)
+    int         axis[3];                // split axes between the pairs, and within pairs 0,1 and 2,3
+    int         mask = 0;               // bit c is set if child c is used
+};
+
+// wide node with the child bounds quantized to 8 bits on a grid local to the node: child
+// c spans origin + q * 2^exponent for q in [qmin,qmax] along each axis, rounded outwards.
+// 64 bytes, a cache line, instead of the 176 of a full precision node.
+struct alignas(32) BVHQuantNode {
+    float       origin[3];              // grid origin (min corner of the children bounds)
+    int8_t      exponent[3];            // grid cell size is 2^exponent along each axis
+    uint8_t     mask;                   // bit c is set if child c is used
+    uint8_t     qmin[3][4];             // child bounds min in cells, qmin[axis][child]
+    uint8_t     qmax[3][4];             // child bounds max in cells, qmax[axis][child]
+    int         child[4];               // quantized node (internal) or first surface index (leaf)
+    uint8_t     count[4];               // number of surfaces (0 for internal children)
+    uint8_t     axis[3];                // split axes, as in BVHWideNode
+};
+
+// allocator of elements aligned to their type (operator new only guarantees 16 bytes in c++11)
+template<typename T>
+struct AlignedAllocator {
+    typedef T value_type;
+    AlignedAllocator() { }
+    template<typename U> AlignedAllocator(const AlignedAllocator<U>&) { }
+    T* allocate(size_t n) {
+        void* ptr = nullptr;
+#ifdef _WIN32
+        ptr = _aligned_malloc(n*sizeof(T), alignof(T));
+#else
+        if(posix_memalign(&ptr, alignof(T), n*sizeof(T))) ptr = nullptr;
+#endif
+        error_if_not(ptr or not n, "cannot allocate %zu aligned bytes\n", n*sizeof(T));
+        return (T*)ptr;
+    }
+    void deallocate(T* ptr, size_t) {
+#ifdef _WIN32
+        _aligned_free(ptr);
+#else
+        free(ptr);
+#endif
+    }
+    template<typename U> bool operator==(const AlignedAllocator<U>&) const { return true; }
+    template<typename U> bool operator!=(const AlignedAllocator<U>&) const { return false; }
+};
+
+// bounding volume hierarchy over the scene surfaces. the node and leaf arrays view the
+// file they were mapped from when loaded from the accelerator cache.
+struct BVH {
+    MappedVector<BVHNode>       nodes;  // nodes (root at 0)
+    MappedVector<BVHWideNode>   wide;   // 4-wide nodes collapsed from nodes (root at 0, empty for binary bvhs)
+    MappedVector<BVHQuantNode,AlignedAllocator<BVHQuantNode>> quant;  // quantized wide nodes (replace wide if built)
+    MappedVector<int>   surfaces;       // surface indices referenced by the leaves
+    vector<vector<int>> levels;         // node indices grouped by depth (for refitting)
+    std::shared_ptr<void> mapping;      // file mapping viewed by the arrays (if loaded from the cache)
+};
+
+// bounding box of a surface in world space
+range3f surface_bbox(Surface* surface);
+// surfaces (sorted indices) whose bounds have a diagonal longer than fraction of the scene
+// bounds diagonal, like ground planes, at most the 16 largest (none if fraction is 0)
+vector<int> oversized_surfaces(Scene* scene, float fraction);
+// indices of the surfaces the accelerators are built over: all but scene->oversized
+vector<int> accelerated_surfaces(Scene* scene);
+
+// build a bvh over the accelerated surfaces with the surface area heuristic, traversed
+// 4-wide (width 4) or as the binary tree (width 2). quantized wide nodes trade
+// bounds precision (so a few more node visits) for a smaller footprint.
+BVH* build_bvh(Scene* scene, int width = 4, bool quantized = false);
+// build a bvh as above over boxes (the leaves reference the box indices)
+BVH* build_bvh(const vector<range3f>& bboxes, int width = 4, bool quantized = false);
+// build a linear bvh (karras 2012) over the accelerated surfaces in parallel: surfaces sorted by the morton codes of
+// their centroids (30 bits, or 63 for more than 2^20 surfaces) with a radix sort, split
+// at the highest differing code bit, and the top refine_levels restructured by sah (treelets)
+BVH* build_lbvh(Scene* scene, int width = 4, bool quantized = false, int refine_levels = 0);
+// refit the bvh bounds bottom-up to the current surface frames, keeping the topology
+void refit_bvh(BVH* bvh, Scene* scene);
+// surface area heuristic cost of the bvh (used to decide when to rebuild after refits)
+float bvh_sah_cost(BVH* bvh);
+// bytes read by the traversal: the nodes traversed and the leaf surface indices
+size_t bvh_memory(BVH* bvh);
+
+// 2^exponent as a float (exponents are kept in the normal range)
+inline float bvh_exp2(int exponent) {
+    uint32_t bits = (uint32_t)(exponent + 127) << 23;
+    float f; memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// slab test of the ray segment [tmin,tmax] against the children of a wide node, returning
+// the mask of the children hit and their entry distances in tnear
+inline int bvh_node_hits(const BVHWideNode& node, const vec3f& e, const vec3f& dinv, float tmin, float tmax, float* tnear) {
+#ifdef __SSE__
+    auto tn = _mm_set1_ps(tmin), tf = _mm_set1_ps(tmax);
+    for(auto a : range(3)) {
+        auto o = _mm_set1_ps(e[a]), di = _mm_set1_ps(dinv[a]);
+        auto t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bmin[a]), o), di);
+        auto t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bmax[a]), o), di);
+        tn = _mm_max_ps(tn, _mm_min_ps(t0, t1));
+        tf = _mm_min_ps(tf, _mm_max_ps(t0, t1));
+    }
+    _mm_storeu_ps(tnear, tn);
+    return _mm_movemask_ps(_mm_cmple_ps(tn, tf)) & node.mask;
+#else
+    auto hits = 0;
+    for(auto c : range(4)) {
+        auto tn = tmin, tf = tmax;
+        for(auto a : range(3)) {
+            auto t0 = (node.bmin[a][c] - e[a]) * dinv[a], t1 = (node.bmax[a][c] - e[a]) * dinv[a];
+            tn = max(tn, min(t0, t1)); tf = min(tf, max(t0, t1));
+        }
+        tnear[c] = tn;
+        if(tn <= tf) hits |= 1 << c;
+    }
+    return hits & node.mask;
+#endif
+}
+
+// slab test against the children of a quantized node, dequantizing their bounds as
+// origin + q * scale (the same expression the build checks to enclose the children)
+inline int bvh_node_hits(const BVHQuantNode& node, const vec3f& e, const vec3f& dinv, float tmin, float tmax, float* tnear) {
+#ifdef __SSE2__
+    auto tn = _mm_set1_ps(tmin), tf = _mm_set1_ps(tmax);
+    auto zero = _mm_setzero_si128();
+    for(auto a : range(3)) {
+        auto origin = _mm_set1_ps(node.origin[a]), scale = _mm_set1_ps(bvh_exp2(node.exponent[a]));
+        int32_t qmin, qmax; memcpy(&qmin, node.qmin[a], 4); memcpy(&qmax, node.qmax[a], 4);
+        auto bmin = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(qmin), zero), zero));
+        auto bmax = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(qmax), zero), zero));
+        bmin = _mm_add_ps(origin, _mm_mul_ps(bmin, scale));
+        bmax = _mm_add_ps(origin, _mm_mul_ps(bmax, scale));
+        auto o = _mm_set1_ps(e[a]), di = _mm_set1_ps(dinv[a]);
+        auto t0 = _mm_mul_ps(_mm_sub_ps(bmin, o), di);
+        auto t1 = _mm_mul_ps(_mm_sub_ps(bmax, o), di);
+        tn = _mm_max_ps(tn, _mm_min_ps(t0, t1));
+        tf = _mm_min_ps(tf, _mm_max_ps(t0, t1));
+    }
+    _mm_storeu_ps(tnear, tn);
+    return _mm_movemask_ps(_mm_cmple_ps(tn, tf)) & node.mask;
+#else
+    auto hits = 0;
+    for(auto c : range(4)) {
+        auto tn = tmin, tf = tmax;
+        for(auto a : range(3)) {
+            auto scale = bvh_exp2(node.exponent[a]);
+            auto bmin = node.origin[a] + node.qmin[a][c] * scale, bmax = node.origin[a] + node.qmax[a][c] * scale;
+            auto t0 = (bmin - e[a]) * dinv[a], t1 = (bmax - e[a]) * dinv[a];
+            tn = max(tn, min(t0, t1)); tf = min(tf, max(t0, t1));
+        }
+        tnear[c] = tn;
+        if(tn <= tf) hits |= 1 << c;
+    }
+    return hits & node.mask;
+#endif
+}
+
+// front-to-back traversal of wide (or quantized) nodes, as bvh_intersect. the stack
+// holds nodes, and leaf children as ~(4*node+child), with their entry distance to skip
+// the ones beyond a closer hit found after their push.
+template<typename Node, typename F>
+inline void bvh_wide_intersect(BVH* bvh, const Node* nodes, const ray3f& ray, const vec3f& dinv, const float& tmax, const F& intersect_surface) {
+    int stack[128]; float stack_t[128]; int top = 0;
+    stack[top] = 0; stack_t[top] = ray.tmin; top ++;
+    while(top) {
+        top --;
+        if(stack_t[top] > min(ray.tmax,tmax)) continue;
+        auto id = stack[top];
+        if(id < 0) {
+            auto& node = nodes[(~id) >> 2]; auto c = (~id) & 3;
+            for(auto i : range(node.child[c],node.child[c]+(int)node.count[c])) intersect_surface(bvh->surfaces[i]);
+            continue;
+        }
+        STATS_INC(node_visits);
+        auto& node = nodes[id];
+        float tnear[4];
+        auto hits = bvh_node_hits(node, ray.e, dinv, ray.tmin, min(ray.tmax,tmax), tnear);
+        if(not hits) continue;
+        // near-to-far order from the direction signs along the split axes
+        int order[4]; auto k = 0;
+        auto near_pair = (ray.d[node.axis[0]] < 0) ? 1 : 0;
+        for(auto pair : { near_pair, 1-near_pair }) {
+            auto near_child = (ray.d[node.axis[1+pair]] < 0) ? 1 : 0;
+            order[k++] = 2*pair + near_child;
+            order[k++] = 2*pair + 1-near_child;
+        }
+        // push the far children first so that the near ones are visited first
+        for(auto i = 3; i >= 0; i --) {
+            auto c = order[i];
+            if(not (hits & (1 << c))) continue;
+            stack[top] = (node.count[c]) ? ~(4*id+c) : node.child[c];
+            stack_t[top] = tnear[c];
+            top ++;
+        }
+    }
+}
+
+// traverse the bvh front-to-back calling intersect_surface(sid) for each surface
+// whose leaf is hit by the ray before tmax. intersect_surface can shrink tmax
+// (usually a reference to the closest hit) to cull farther nodes.
+template<typename F>
+inline void bvh_intersect(BVH* bvh, const ray3f& ray, const float& tmax, const F& intersect_surface) {
+    if(bvh->nodes.empty()) return;
+    auto dinv = vec3f(1/ray.d.x, 1/ray.d.y, 1/ray.d.z);
+    if(not bvh->quant.empty()) { bvh_wide_intersect(bvh, bvh->quant.data(), ray, dinv, tmax, intersect_surface); return; }
+    if(not bvh->wide.empty()) { bvh_wide_intersect(bvh, bvh->wide.data(), ray, dinv, tmax, intersect_surface); return; }
+    int stack[64]; int top = 0;
+    stack[top++] = 0;
+    while(top) {
+        auto& node = bvh->nodes[stack[--top]];
+        STATS_INC(node_visits);
+        if(not intersect_bbox(node.bbox, ray.e, dinv, ray.tmin, min(ray.tmax,tmax))) continue;
+        if(node.count) {
+            for(auto i : range(node.start,node.start+node.count)) intersect_surface(bvh->surfaces[i]);
+        } else {
+            // push the far child first so that the near one is visited first
+            auto left_first = dot(center(bvh->nodes[node.start+1].bbox)-center(bvh->nodes[node.start].bbox),ray.d) >= 0;
+            stack[top++] = node.start + (left_first ? 1 : 0);
+            stack[top++] = node.start + (left_first ? 0 : 1);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,305 @@
+#include "cache.h"
+#include "bvh.h"
+#include "grid.h"
+#include "trace.h"
+
+#include <cstdint>
+#include <cstring>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <process.h>
+#define getpid _getpid
+#endif
+
+// cache files store the arrays of the accelerator in native layout and endianness, each
+// as its element count followed by the elements, after the magic and the scene hash.
+// loads map the file and view the arrays in place, after checking every index in them.
+// the magic changes with the layout of the file, so stale caches are never read.
+#define cache_magic "RTACCEL2"
+
+// geometry of a surface as hashed (the material and the cached values do not matter)
+struct _CacheSurface {
+    frame3f     frame;          // frame
+    float       radius = 1;     // radius
+    int         flags = 0;      // 1 for quads, 2 for cylinders
+};
+
+uint64_t accelerator_hash(Scene* scene) {
+    TRACE_SCOPE("accelerator_hash", "accel");
+    // the node sizes and traversal width change with the build settings, and the
+    // surfaces in the accelerator with the oversized classification
+    auto settings = tostring("%s %d %d %d %d %zu %.9g %zu", scene->accelerator.c_str(),
+                             (scene->accelerator == "lbvh") ? scene->lbvh_refine : 0,
+                             (int)sizeof(BVHNode), (int)sizeof(BVHWideNode), (int)sizeof(BVHQuantNode),
+                             scene->surfaces.size(), scene->oversized_fraction, scene->oversized.size());
+    settings.resize((settings.size() + 7) / 8 * 8, ' ');
+    auto h = hash_words(0xcbf29ce484222325ull, settings.data(), settings.size());
+    static_assert(sizeof(_CacheSurface) % 8 == 0, "surface records are hashed 64 bits at a time");
+    for(auto surface : scene->surfaces) {
+        auto record = _CacheSurface();
+        record.frame = surface->frame;
+        record.radius = surface->radius;
+        record.flags = (surface->isquad ? 1 : 0) | (surface->iscyl ? 2 : 0);
+        h = hash_words(h, &record, sizeof(record));
+    }
+    // final avalanche (murmur3), so that similar scenes get unrelated names
+    h ^= h >> 33; h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+static string _cache_filename(const string& dirname, uint64_t hash) {
+    return tostring("%s/%016llx.accel", dirname.c_str(), (unsigned long long)hash);
+}
+
+string accelerator_cache_filename(Scene* scene, const string& dirname) {
+    return _cache_filename(dirname, accelerator_hash(scene));
+}
+
+// arrays start at multiples of cache_align bytes in the file, so that the mapped
+// elements are aligned for their type (the mapping itself is page aligned)
+#define cache_align 64
+
+// writes the cache file, padding the arrays to cache_align
+struct _CacheWriter {
+    FILE*       f = nullptr;        // file
+    size_t      offset = 0;         // write position
+
+    template<typename T>
+    void write(const T& value) { fwrite(&value, sizeof(T), 1, f); offset += sizeof(T); }
+    template<typename V>
+    void write_array(const V& values) {
+        write((uint64_t)values.size());
+        static const char zeros[cache_align] = {};
+        auto pad = (cache_align - offset % cache_align) % cache_align;
+        fwrite(zeros, 1, pad, f); offset += pad;
+        if(not values.empty()) fwrite(values.data(), sizeof(values[0]), values.size(), f);
+        offset += values.size() * sizeof(values[0]);
+    }
+};
+
+// reads the cache file from its memory mapping, viewing the arrays in place; reads past
+// the end of the file set ok to false
+struct _CacheReader {
+    char*           data = nullptr;     // file contents
+    size_t          size = 0;           // file size
+    size_t          offset = 0;         // read position
+    bool            ok = true;          // whether all the reads were in the file
+
+    template<typename T>
+    void read(T& value) {
+        if(not ok or size - offset < sizeof(T)) { ok = false; return; }
+        memcpy(&value, data + offset, sizeof(T));
+        offset += sizeof(T);
+    }
+    // the elements of an array, checking that they are in the file
+    template<typename T>
+    T* read_array(uint64_t& count) {
+        count = 0;
+        read(count);
+        auto pad = (cache_align - offset % cache_align) % cache_align;
+        if(not ok or size - offset < pad or (size - offset - pad) / sizeof(T) < count) { ok = false; count = 0; return nullptr; }
+        auto values = (T*)(data + offset + pad);
+        offset += pad + count * sizeof(T);
+        return values;
+    }
+    template<typename T, typename A>
+    void map(MappedVector<T,A>& values) {
+        static_assert(alignof(T) <= cache_align, "cached elements are aligned to cache_align");
+        auto count = uint64_t(0);
+        auto elements = read_array<T>(count);
+        if(ok) values.map(elements, count);
+    }
+    template<typename T>
+    void copy(vector<T>& values) {
+        auto count = uint64_t(0);
+        auto elements = read_array<T>(count);
+        if(ok) values.assign(elements, elements + count);
+    }
+};
+
+// whether the leaf range [start,start+count) is in the surface indices
+static bool _valid_leaf(long long start, long long count, size_t nleaves) {
+    return start >= 0 and count >= 0 and (size_t)(start + count) <= nleaves;
+}
+
+// binary node of each child of a wide node, checked since refits read them
+static const int* _binary_nodes(const BVHWideNode& node) { return node.node; }
+static const int* _binary_nodes(const BVHQuantNode&) { return nullptr; }
+
+// whether the children of each wide node are stored after it, the leaves are in the
+// surface indices, and the depth fits the traversal stack
+template<typename Node>
+static bool _valid_wide(const Node* nodes, size_t nwide, const BVH* bvh) {
+    auto depth = vector<int>(nwide, 0);
+    for(auto wid : range((int)nwide)) {
+        auto& node = nodes[wid];
+        if(node.mask & ~15) return false;
+        for(auto a : range(3)) if(node.axis[a] < 0 or node.axis[a] >= 3) return false;
+        auto binary = _binary_nodes(node);
+        for(auto c : range(4)) {
+            if(not (node.mask & (1 << c))) continue;
+            if(binary and (binary[c] < 0 or (size_t)binary[c] >= bvh->nodes.size())) return false;
+            if(node.count[c]) { if(not _valid_leaf(node.child[c], node.count[c], bvh->surfaces.size())) return false; continue; }
+            if(node.child[c] <= wid or (size_t)node.child[c] >= nwide or depth[wid] >= 40) return false;
+            depth[node.child[c]] = max(depth[node.child[c]], depth[wid]+1);
+        }
+    }
+    return true;
+}
+
+// whether the children of each node are stored after it, the leaves reference surfaces
+// of the scene, and the depths fit the traversal stacks
+static bool _valid_bvh(const BVH* bvh, size_t nsurfaces) {
+    auto nnodes = bvh->nodes.size();
+    for(auto sid : bvh->surfaces) if(sid < 0 or (size_t)sid >= nsurfaces) return false;
+    auto depth = vector<int>(nnodes, 0);
+    for(auto nid : range((int)nnodes)) {
+        auto& node = bvh->nodes[nid];
+        if(node.depth != depth[nid]) return false;
+        if(node.count) { if(not _valid_leaf(node.start, node.count, bvh->surfaces.size())) return false; continue; }
+        if(node.start <= nid or (size_t)node.start+1 >= nnodes or depth[nid] >= 60) return false;
+        for(auto child : { node.start, node.start+1 }) depth[child] = max(depth[child], depth[nid]+1);
+    }
+    for(auto& level : bvh->levels) for(auto nid : level) if(nid < 0 or (size_t)nid >= nnodes) return false;
+    return _valid_wide(bvh->wide.data(), bvh->wide.size(), bvh) and _valid_wide(bvh->quant.data(), bvh->quant.size(), bvh);
+}
+
+// whether the cell ranges partition the surface indices and these reference surfaces of the scene
+static bool _valid_grid(const Grid* grid, size_t nsurfaces) {
+    if(grid->nsurfaces != (int)nsurfaces) return false;
+    if(grid->cells.empty()) return grid->surfaces.empty();
+    auto ncells = 1ll;
+    for(auto a : range(3)) {
+        if(grid->res[a] < 1 or grid->res[a] > (1 << 16) or not (grid->cell_size[a] > 0)) return false;
+        ncells *= grid->res[a];
+    }
+    if((size_t)ncells + 1 != grid->cells.size() or grid->cells[0] != 0) return false;
+    for(auto c : range((int)ncells)) if(grid->cells[c+1] < grid->cells[c]) return false;
+    if((size_t)grid->cells.back() != grid->surfaces.size()) return false;
+    for(auto sid : grid->surfaces) if(sid < 0 or (size_t)sid >= nsurfaces) return false;
+    return true;
+}
+
+// maps the file copy on write (writes, like refits, stay private), reading it where mmap is
+// not available; returns nullptr if the file cannot be read
+static std::shared_ptr<void> _map_file(const string& filename, size_t& size) {
+    size = 0;
+#ifndef _WIN32
+    auto fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0) return nullptr;
+    struct stat info;
+    void* mapped = MAP_FAILED;
+    if(fstat(fd, &info) == 0 and info.st_size > 0)
+        mapped = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(mapped == MAP_FAILED) return nullptr;
+    size = info.st_size;
+    return std::shared_ptr<void>(mapped, [size](void* ptr){ munmap(ptr, size); });
+#else
+    struct alignas(cache_align) _Block { char bytes[cache_align]; };
+    auto f = fopen(filename.c_str(), "rb");
+    if(not f) return nullptr;
+    fseek(f, 0, SEEK_END);
+    auto length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if(length <= 0) { fclose(f); return nullptr; }
+    auto nblocks = (length + cache_align - 1) / cache_align;
+    auto blocks = AlignedAllocator<_Block>().allocate(nblocks);
+    auto ok = fread(blocks, 1, length, f) == (size_t)length;
+    fclose(f);
+    if(not ok) { AlignedAllocator<_Block>().deallocate(blocks, nblocks); return nullptr; }
+    size = length;
+    return std::shared_ptr<void>(blocks, [nblocks](void* ptr){ AlignedAllocator<_Block>().deallocate((_Block*)ptr, nblocks); });
+#endif
+}
+
+bool load_accelerator_cache(Scene* scene, const string& dirname, uint64_t hash) {
+    TRACE_SCOPE("load_accelerator_cache", "accel");
+    if(scene->accelerator == "none") return false;
+    auto filename = _cache_filename(dirname, hash);
+    auto reader = _CacheReader();
+    auto mapping = _map_file(filename, reader.size);
+    if(not mapping) return false;
+    reader.data = (char*)mapping.get();
+
+    char magic[8] = {};
+    auto file_hash = uint64_t(0);
+    reader.read(magic);
+    reader.read(file_hash);
+    if(not reader.ok or string(magic,8) != cache_magic or file_hash != hash) return false;
+    auto nsurfaces = scene->surfaces.size();
+    auto bvh = (BVH*)nullptr;
+    auto grid = (Grid*)nullptr;
+    auto valid = false;
+    if(scene->accelerator == "grid") {
+        grid = new Grid();
+        reader.read(grid->bbox); reader.read(grid->res); reader.read(grid->cell_size);
+        reader.map(grid->cells); reader.map(grid->surfaces); reader.read(grid->nsurfaces);
+        grid->serial = grid_next_serial();
+        grid->mapping = mapping;
+        valid = reader.ok and reader.offset == reader.size and _valid_grid(grid, nsurfaces);
+    } else {
+        bvh = new BVH();
+        reader.map(bvh->nodes); reader.map(bvh->wide); reader.map(bvh->quant);
+        reader.map(bvh->surfaces);
+        auto nlevels = uint64_t(0);
+        reader.read(nlevels);
+        bvh->levels.resize((reader.ok and nlevels <= 64) ? nlevels : 0);
+        if(nlevels > 64) reader.ok = false;
+        for(auto& level : bvh->levels) reader.copy(level);
+        bvh->mapping = mapping;
+        valid = reader.ok and reader.offset == reader.size and _valid_bvh(bvh, nsurfaces);
+    }
+    if(not valid) {
+        message("ignoring corrupted accelerator cache %s\n", filename.c_str());
+        delete bvh; delete grid;
+        return false;
+    }
+#ifndef _WIN32
+    // the traversal reads the nodes in no particular order
+    madvise(mapping.get(), reader.size, MADV_RANDOM);
+#endif
+
+    delete scene->bvh; scene->bvh = bvh;
+    delete scene->grid; scene->grid = grid;
+    return true;
+}
+
+void save_accelerator_cache(Scene* scene, const string& dirname, uint64_t hash) {
+    TRACE_SCOPE("save_accelerator_cache", "accel");
+    if(not scene->bvh and not scene->grid) return;
+    auto filename = _cache_filename(dirname, hash);
+    // written aside and renamed, so that concurrent renders never read a partial file
+    auto tmpname = filename + tostring(".%d.tmp", (int)getpid());
+    auto f = fopen(tmpname.c_str(), "wb");
+    if(not f) { message("cannot write accelerator cache %s\n", filename.c_str()); return; }
+    auto writer = _CacheWriter();
+    writer.f = f;
+    char magic[8]; memcpy(magic, cache_magic, 8);
+    writer.write(magic);
+    writer.write(hash);
+    if(scene->grid) {
+        auto grid = scene->grid;
+        writer.write(grid->bbox); writer.write(grid->res); writer.write(grid->cell_size);
+        writer.write_array(grid->cells); writer.write_array(grid->surfaces); writer.write(grid->nsurfaces);
+    } else {
+        auto bvh = scene->bvh;
+        writer.write_array(bvh->nodes); writer.write_array(bvh->wide); writer.write_array(bvh->quant);
+        writer.write_array(bvh->surfaces);
+        writer.write((uint64_t)bvh->levels.size());
+        for(auto& level : bvh->levels) writer.write_array(level);
+    }
+    auto ok = not ferror(f);
+    ok = (fclose(f) == 0) and ok;
+    if(ok) ok = std::rename(tmpname.c_str(), filename.c_str()) == 0;
+    if(not ok) {
+        std::remove(tmpname.c_str());
+        message("cannot write accelerator cache %s\n", filename.c_str());
+    }
+}
@@ -0,0 +1,24 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include "scene.h"
+
+// built acceleration structures are cached on disk in dirname, in files named by the hash
+// of the scene geometry (surface frames, radii and types) and the accelerator settings,
+// so that scenes rendered again with other cameras, lights or resolutions skip the build
+
+// hash of the scene geometry and accelerator settings that keys the cache files
+uint64_t accelerator_hash(Scene* scene);
+// cache filename of the accelerator of the scene in dirname
+string accelerator_cache_filename(Scene* scene, const string& dirname);
+
+// load the accelerator of the scene (as selected by scene->accelerator) from the cache in
+// dirname, replacing the ones already built; returns false if it is not cached or the
+// cached file is corrupted. the loaded arrays view the file mapping.
+bool load_accelerator_cache(Scene* scene, const string& dirname, uint64_t hash);
+inline bool load_accelerator_cache(Scene* scene, const string& dirname) { return load_accelerator_cache(scene, dirname, accelerator_hash(scene)); }
+// save the accelerator built for the scene to the cache in dirname (warning on failures)
+void save_accelerator_cache(Scene* scene, const string& dirname, uint64_t hash);
+inline void save_accelerator_cache(Scene* scene, const string& dirname) { save_accelerator_cache(scene, dirname, accelerator_hash(scene)); }
+
+#endif
@@ -10,6 +10,8 @@
 #include <cstdarg>
 #include <fstream>
 #include <cstdio>
+#include <cstdint>
+#include <cstring>
 #include <typeinfo>
 
 // bringing stand libraray objects in scope
@@ -59,6 +61,17 @@ struct range {
     iterator end() { return iterator(max); }
 };
 
+// mixes size bytes of data (a multiple of 8) into the hash h, 64 bits at a time
+inline uint64_t hash_words(uint64_t h, const void* data, size_t size) {
+    auto words = (const char*)data;
+    for(size_t i = 0; i + 8 <= size; i += 8) {
+        uint64_t w; memcpy(&w, words + i, 8);
+        h = (h ^ w) * 0x9e3779b97f4a7c15ull;
+        h ^= h >> 32;
+    }
+    return h;
+}
+
 // load a text file into a buffer
 inline string load_text_file(const char* filename) {
     auto text = string("");
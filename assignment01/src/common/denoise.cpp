@@ -0,0 +1,184 @@
+#include "denoise.h"
+#include "parallel.h"
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+// b3 spline kernel of the a-trous transform
+static const float _atrous_kernel[5] = { 1/16.0f, 1/4.0f, 3/8.0f, 1/4.0f, 1/16.0f };
+
+// exp(x) for x <= 0 as (1+x/64)^64, accurate enough for filter weights and
+// made of multiplications only, so that it vectorizes
+static inline float _exp_neg(float x) {
+    x = 1 + max(x, -16.0f) * (1 / 64.0f);
+    x *= x; x *= x; x *= x; x *= x; x *= x; x *= x;
+    return x;
+}
+
+#ifdef __SSE__
+static inline __m128 _exp_neg(__m128 x) {
+    x = _mm_add_ps(_mm_set1_ps(1), _mm_mul_ps(_mm_max_ps(x, _mm_set1_ps(-16)), _mm_set1_ps(1 / 64.0f)));
+    for(auto i = 0; i < 6; i ++) x = _mm_mul_ps(x, x);
+    return x;
+}
+#endif
+
+// planar guide buffers
+struct _DenoiseGuides {
+    int             w = 0, h = 0;
+    vector<float>   n[3];       // normal
+    vector<float>   a[3];       // albedo
+    vector<float>   z;          // depth
+};
+
+// planar illumination buffer (color / albedo)
+struct _DenoiseColor {
+    vector<float>   c[3];
+};
+
+// edge-stopping terms of one pass
+struct _DenoiseSigmas {
+    float   inv_c2;     // 1 / sigma_color^2
+    float   inv_n2;     // 1 / sigma_normal^2
+    float   inv_a2;     // 1 / sigma_albedo^2
+    float   sigma_z;    // relative depth sigma
+};
+
+// filters the pixel x of row j over the 5x5 taps step pixels apart, skipping the taps
+// outside the image
+static inline void _atrous_pixel_scalar(const _DenoiseGuides& g, const _DenoiseColor& src, _DenoiseColor& dst, const _DenoiseSigmas& s,
+                                        int x, int j, int step) {
+    auto p = j * g.w + x;
+    float sum_c[3] = { 0, 0, 0 }, sum_w = 0;
+    for(auto ty = 0; ty < 5; ty ++) {
+        auto y = j + (ty - 2) * step;
+        if(y < 0 or y >= g.h) continue;
+        for(auto tx = 0; tx < 5; tx ++) {
+            auto xx = x + (tx - 2) * step;
+            if(xx < 0 or xx >= g.w) continue;
+            auto q = y * g.w + xx;
+            auto d = 0.0f;
+            d = src.c[0][p] - src.c[0][q]; auto dc = d*d;
+            d = src.c[1][p] - src.c[1][q]; dc += d*d;
+            d = src.c[2][p] - src.c[2][q]; dc += d*d;
+            d = g.n[0][p] - g.n[0][q]; auto dn = d*d;
+            d = g.n[1][p] - g.n[1][q]; dn += d*d;
+            d = g.n[2][p] - g.n[2][q]; dn += d*d;
+            d = g.a[0][p] - g.a[0][q]; auto da = d*d;
+            d = g.a[1][p] - g.a[1][q]; da += d*d;
+            d = g.a[2][p] - g.a[2][q]; da += d*d;
+            auto dz = std::abs(g.z[p] - g.z[q]) / (s.sigma_z * g.z[p] + 1e-4f);
+            auto w = _atrous_kernel[tx] * _atrous_kernel[ty] *
+                     _exp_neg(-(dc * s.inv_c2 + dn * s.inv_n2 + da * s.inv_a2 + dz));
+            sum_c[0] += w * src.c[0][q]; sum_c[1] += w * src.c[1][q]; sum_c[2] += w * src.c[2][q];
+            sum_w += w;
+        }
+    }
+    for(auto c = 0; c < 3; c ++) dst.c[c][p] = sum_c[c] / sum_w;
+}
+
+#ifdef __SSE__
+// same as _atrous_pixel_scalar for the 4 pixels from x, whose taps must all be inside the
+// row; the center features and the sums stay in registers over the taps
+static inline void _atrous_pixels_sse(const _DenoiseGuides& g, const _DenoiseColor& src, _DenoiseColor& dst, const _DenoiseSigmas& s,
+                                      int x, int j, int step) {
+    auto p = j * g.w + x;
+    auto inv_c2 = _mm_set1_ps(s.inv_c2), inv_n2 = _mm_set1_ps(s.inv_n2), inv_a2 = _mm_set1_ps(s.inv_a2);
+    auto sign_mask = _mm_set1_ps(-0.0f);
+    __m128 pc[3], pn[3], pa[3];
+    for(auto c = 0; c < 3; c ++) {
+        pc[c] = _mm_loadu_ps(&src.c[c][p]);
+        pn[c] = _mm_loadu_ps(&g.n[c][p]);
+        pa[c] = _mm_loadu_ps(&g.a[c][p]);
+    }
+    auto pz = _mm_loadu_ps(&g.z[p]);
+    auto inv_z = _mm_div_ps(_mm_set1_ps(1), _mm_add_ps(_mm_mul_ps(_mm_set1_ps(s.sigma_z), pz), _mm_set1_ps(1e-4f)));
+    auto sum_c0 = _mm_setzero_ps(), sum_c1 = _mm_setzero_ps(), sum_c2 = _mm_setzero_ps(), sum_w = _mm_setzero_ps();
+    for(auto ty = 0; ty < 5; ty ++) {
+        auto y = j + (ty - 2) * step;
+        if(y < 0 or y >= g.h) continue;
+        for(auto tx = 0; tx < 5; tx ++) {
+            auto q = y * g.w + x + (tx - 2) * step;
+            auto sqdiff = [&](const vector<float>* plane, const __m128* center) {
+                auto d0 = _mm_sub_ps(center[0], _mm_loadu_ps(&plane[0][q]));
+                auto d1 = _mm_sub_ps(center[1], _mm_loadu_ps(&plane[1][q]));
+                auto d2 = _mm_sub_ps(center[2], _mm_loadu_ps(&plane[2][q]));
+                return _mm_add_ps(_mm_add_ps(_mm_mul_ps(d0,d0), _mm_mul_ps(d1,d1)), _mm_mul_ps(d2,d2));
+            };
+            auto dz = _mm_mul_ps(_mm_andnot_ps(sign_mask, _mm_sub_ps(pz, _mm_loadu_ps(&g.z[q]))), inv_z);
+            auto e = _mm_add_ps(_mm_add_ps(_mm_mul_ps(sqdiff(src.c, pc), inv_c2), _mm_mul_ps(sqdiff(g.n, pn), inv_n2)),
+                                _mm_add_ps(_mm_mul_ps(sqdiff(g.a, pa), inv_a2), dz));
+            auto w = _mm_mul_ps(_mm_set1_ps(_atrous_kernel[tx] * _atrous_kernel[ty]),
+                                _exp_neg(_mm_sub_ps(_mm_setzero_ps(), e)));
+            sum_c0 = _mm_add_ps(sum_c0, _mm_mul_ps(w, _mm_loadu_ps(&src.c[0][q])));
+            sum_c1 = _mm_add_ps(sum_c1, _mm_mul_ps(w, _mm_loadu_ps(&src.c[1][q])));
+            sum_c2 = _mm_add_ps(sum_c2, _mm_mul_ps(w, _mm_loadu_ps(&src.c[2][q])));
+            sum_w = _mm_add_ps(sum_w, w);
+        }
+    }
+    auto inv_w = _mm_div_ps(_mm_set1_ps(1), sum_w);
+    _mm_storeu_ps(&dst.c[0][p], _mm_mul_ps(sum_c0, inv_w));
+    _mm_storeu_ps(&dst.c[1][p], _mm_mul_ps(sum_c1, inv_w));
+    _mm_storeu_ps(&dst.c[2][p], _mm_mul_ps(sum_c2, inv_w));
+}
+#endif
+
+// one a-trous pass with taps step pixels apart, from the illumination src into dst
+static void _atrous_pass(const _DenoiseGuides& g, const _DenoiseColor& src, _DenoiseColor& dst, const _DenoiseSigmas& sigmas, int step) {
+    auto w = g.w;
+    // pixels whose horizontal taps are all inside the row
+    auto x0 = min(2*step, w), x1 = max(x0, w - 2*step);
+    parallel_for(g.h, [&](int j){
+        auto x = 0;
+        for(; x < x0; x ++) _atrous_pixel_scalar(g, src, dst, sigmas, x, j, step);
+#ifdef __SSE__
+        for(; x + 4 <= x1; x += 4) _atrous_pixels_sse(g, src, dst, sigmas, x, j, step);
+#endif
+        for(; x < w; x ++) _atrous_pixel_scalar(g, src, dst, sigmas, x, j, step);
+    });
+}
+
+void denoise_inplace(image3f& img, const DenoiseAux& aux, const DenoiseParams& params) {
+    auto w = img.width(), h = img.height();
+    error_if_not(aux.normal.width() == w and aux.normal.height() == h and (int)aux.depth.size() == w*h,
+                 "denoise buffers do not match the image\n");
+    if(not w or not h or params.iterations <= 0) return;
+
+    // split into planes, dividing the color by the albedo
+    auto guides = _DenoiseGuides();
+    guides.w = w; guides.h = h;
+    _DenoiseColor color[2];
+    for(auto c = 0; c < 3; c ++) {
+        guides.n[c].resize(w*h); guides.a[c].resize(w*h);
+        color[0].c[c].resize(w*h); color[1].c[c].resize(w*h);
+    }
+    guides.z.resize(w*h);
+    auto albedo_min = vec3f(0.01f, 0.01f, 0.01f);
+    parallel_for(h, [&](int j){
+        for(auto i = j*w; i < (j+1)*w; i ++) {
+            auto albedo = max(aux.albedo.data()[i], albedo_min);
+            auto illum = img.data()[i] / albedo;
+            auto norm = aux.normal.data()[i];
+            color[0].c[0][i] = illum.x; color[0].c[1][i] = illum.y; color[0].c[2][i] = illum.z;
+            guides.n[0][i] = norm.x; guides.n[1][i] = norm.y; guides.n[2][i] = norm.z;
+            guides.a[0][i] = albedo.x; guides.a[1][i] = albedo.y; guides.a[2][i] = albedo.z;
+            guides.z[i] = aux.depth[i];
+        }
+    });
+
+    // passes ping-pong the illumination
+    for(auto it = 0; it < params.iterations; it ++) {
+        auto sigma_c = params.sigma_color / (1 << it);
+        auto sigmas = _DenoiseSigmas{ 1 / (sigma_c*sigma_c), 1 / (params.sigma_normal*params.sigma_normal),
+                                      1 / (params.sigma_albedo*params.sigma_albedo), params.sigma_depth };
+        _atrous_pass(guides, color[it%2], color[(it+1)%2], sigmas, 1 << it);
+    }
+
+    // back to color
+    auto& illum = color[params.iterations%2];
+    parallel_for(h, [&](int j){
+        for(auto i = j*w; i < (j+1)*w; i ++)
+            img.data()[i] = vec3f(illum.c[0][i], illum.c[1][i], illum.c[2][i]) *
+                            vec3f(guides.a[0][i], guides.a[1][i], guides.a[2][i]);
+    });
+}
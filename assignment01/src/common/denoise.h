@@ -0,0 +1,32 @@
+#ifndef _DENOISE_H_
+#define _DENOISE_H_
+
+#include "image.h"
+
+// per-pixel features of the first hit, captured while rendering to guide the denoiser
+struct DenoiseAux {
+    image3f         normal;     // surface normal (zero for the background)
+    image3f         albedo;     // diffuse color (one for the background)
+    vector<float>   depth;      // hit distance (ray3f_rayinf for the background)
+
+    DenoiseAux() { }
+    DenoiseAux(int w, int h) : normal(w,h), albedo(w,h), depth(w*h) { }
+};
+
+// denoiser parameters
+struct DenoiseParams {
+    int     iterations = 5;         // a-trous passes (the kernel spans 4*2^iterations+1 pixels)
+    float   sigma_color = 0.3f;     // color edge stopping (halved every pass)
+    float   sigma_normal = 0.1f;    // normal edge stopping
+    float   sigma_depth = 0.1f;     // relative depth edge stopping
+    float   sigma_albedo = 0.1f;    // albedo edge stopping
+};
+
+// edge-avoiding a-trous wavelet filter (dammertz et al. 2010) guided by the normal,
+// depth and albedo buffers. the filter works on the illumination (color divided by
+// albedo), so textures are not blurred. passes are multithreaded over rows and filter
+// planar buffers 4 pixels at a time with sse when available; the cost per pixel is
+// fixed by the number of passes.
+void denoise_inplace(image3f& img, const DenoiseAux& aux, const DenoiseParams& params = DenoiseParams());
+
+#endif
@@ -0,0 +1,113 @@
+#include "film.h"
+#include "parallel.h"
+#include <cmath>
+
+FilterType filter_type(const string& name) {
+    if(name == "box") return filter_box;
+    if(name == "gaussian") return filter_gaussian;
+    if(name == "mitchell") return filter_mitchell;
+    if(name == "blackmanharris") return filter_blackman_harris;
+    error("unknown filter %s\n", name.c_str());
+    return filter_box;
+}
+
+Filter make_filter(FilterType type, float radius) {
+    auto filter = Filter();
+    filter.type = type;
+    if(radius > 0) filter.radius = radius;
+    else {
+        switch(type) {
+            case filter_box: filter.radius = 0.5f; break;
+            case filter_gaussian: filter.radius = 1.5f; break;
+            case filter_mitchell: filter.radius = 2; break;
+            case filter_blackman_harris: filter.radius = 2; break;
+        }
+    }
+    return filter;
+}
+
+float Filter::eval(float x) const {
+    x = std::abs(x);
+    if(x >= radius) return 0;
+    switch(type) {
+        case filter_box: return 1;
+        case filter_gaussian: {
+            // shifted so that it reaches zero at the radius
+            const auto alpha = 2.0f;
+            return std::exp(-alpha * x * x) - std::exp(-alpha * radius * radius);
+        }
+        case filter_mitchell: {
+            // the cubic spans [-2,2], scaled to the radius
+            const auto b = 1 / 3.0f, c = 1 / 3.0f;
+            x = 2 * x / radius;
+            if(x < 1) return ((12 - 9*b - 6*c) * x*x*x + (-18 + 12*b + 6*c) * x*x + (6 - 2*b)) / 6;
+            return ((-b - 6*c) * x*x*x + (6*b + 30*c) * x*x + (-12*b - 48*c) * x + (8*b + 24*c)) / 6;
+        }
+        case filter_blackman_harris: {
+            const auto a0 = 0.35875f, a1 = 0.48829f, a2 = 0.14128f, a3 = 0.01168f;
+            auto t = pif * (x / radius + 1);
+            return a0 - a1 * std::cos(t) + a2 * std::cos(2*t) - a3 * std::cos(3*t);
+        }
+    }
+    return 0;
+}
+
+// pixels whose center is within the filter radius of the tile border
+static inline int _film_margin(const Filter& filter) { return (int)std::ceil(filter.radius); }
+
+FilmTile::FilmTile(const Filter& filter, int x0, int x1, int y0, int y1, int width, int height) {
+    auto margin = _film_margin(filter);
+    this->x0 = max(0, x0 - margin);
+    this->y0 = max(0, y0 - margin);
+    w = min(width, x1 + margin) - this->x0;
+    h = min(height, y1 + margin) - this->y0;
+    color.assign(w*h, zero3f);
+    weight.assign(w*h, 0);
+}
+
+void FilmTile::add_sample(const Filter& filter, float x, float y, const vec3f& c) {
+    // pixels i whose center i+0.5 is within the radius of x
+    auto i0 = max(x0, (int)std::ceil(x - 0.5f - filter.radius));
+    auto i1 = min(x0 + w - 1, (int)std::floor(x - 0.5f + filter.radius));
+    auto j0 = max(y0, (int)std::ceil(y - 0.5f - filter.radius));
+    auto j1 = min(y0 + h - 1, (int)std::floor(y - 0.5f + filter.radius));
+    for(auto j = j0; j <= j1; j ++) {
+        auto wy = filter.eval(j + 0.5f - y);
+        if(wy == 0) continue;
+        for(auto i = i0; i <= i1; i ++) {
+            auto wxy = filter.eval(i + 0.5f - x) * wy;
+            if(wxy == 0) continue;
+            auto idx = (j - y0) * w + (i - x0);
+            color[idx] += c * wxy;
+            weight[idx] += wxy;
+        }
+    }
+}
+
+void merge_film_tiles(const vector<FilmTile>& tiles, const Filter& filter, int ntiles_x, int ntiles_y,
+                      int tile_size, image3f& image) {
+    // tiles up to reach away can overlap a tile
+    auto reach = (_film_margin(filter) + tile_size - 1) / tile_size;
+    parallel_for(ntiles_x*ntiles_y, [&](int tile){
+        auto tx = tile % ntiles_x, ty = tile / ntiles_x;
+        auto x0 = tx * tile_size, x1 = min(x0 + tile_size, image.width());
+        auto y0 = ty * tile_size, y1 = min(y0 + tile_size, image.height());
+        for(auto j = y0; j < y1; j ++) {
+            for(auto i = x0; i < x1; i ++) {
+                auto c = zero3f;
+                auto w = 0.0f;
+                for(auto ny = max(0, ty - reach); ny <= min(ntiles_y - 1, ty + reach); ny ++) {
+                    for(auto nx = max(0, tx - reach); nx <= min(ntiles_x - 1, tx + reach); nx ++) {
+                        auto& ft = tiles[ny*ntiles_x + nx];
+                        if(i < ft.x0 or i >= ft.x0 + ft.w or j < ft.y0 or j >= ft.y0 + ft.h) continue;
+                        auto idx = (j - ft.y0) * ft.w + (i - ft.x0);
+                        c += ft.color[idx];
+                        w += ft.weight[idx];
+                    }
+                }
+                // negative lobes can leave tiny or negative weights at the image border
+                image.at(i,j) = (w > 1e-6f) ? c / w : zero3f;
+            }
+        }
+    });
+}
@@ -0,0 +1,54 @@
+#ifndef _FILM_H_
+#define _FILM_H_
+
+#include "image.h"
+
+// pixel reconstruction filters
+enum FilterType {
+    filter_box,                 // box
+    filter_gaussian,            // truncated gaussian (alpha 2)
+    filter_mitchell,            // mitchell-netravali (b = c = 1/3)
+    filter_blackman_harris,     // blackman-harris window
+};
+
+// filter type from its name (box, gaussian, mitchell, blackmanharris)
+FilterType filter_type(const string& name);
+
+// separable reconstruction filter of the given radius in pixels
+struct Filter {
+    FilterType  type = filter_box;      // filter
+    float       radius = 0.5f;          // support radius (pixels)
+
+    // 1d filter value at distance x from the pixel center
+    float eval(float x) const;
+    // 2d filter value at offset (x,y) from the pixel center
+    float eval(float x, float y) const { return eval(x) * eval(y); }
+};
+
+// filter of the given type; radius 0 picks the filter's usual radius
+Filter make_filter(FilterType type, float radius = 0);
+
+// weighted sums of the samples of an image tile [x0,x1)x[y0,y1), extended by the
+// filter radius so that samples near the tile border reach the neighboring pixels.
+// each tile is written by one thread only.
+struct FilmTile {
+    int                 x0 = 0, y0 = 0;     // origin of the buffer in the image
+    int                 w = 0, h = 0;       // size of the buffer
+    vector<vec3f>       color;              // weighted color sums
+    vector<float>       weight;             // filter weight sums
+
+    // buffer for the pixels [x0,x1)x[y0,y1) of an image of size (width,height)
+    FilmTile() { }
+    FilmTile(const Filter& filter, int x0, int x1, int y0, int y1, int width, int height);
+
+    // splat a sample at image position (x,y) (in pixels) into the pixels within the filter radius
+    void add_sample(const Filter& filter, float x, float y, const vec3f& c);
+};
+
+// merges the tiles of a ntiles_x x ntiles_y grid (of tile_size pixels) into image,
+// dividing the color sums by the weight sums. each output pixel is gathered from the
+// tiles overlapping it by a single thread, so no locks are needed
+void merge_film_tiles(const vector<FilmTile>& tiles, const Filter& filter, int ntiles_x, int ntiles_y,
+                      int tile_size, image3f& image);
+
+#endif
@@ -0,0 +1,91 @@
+#include "grid.h"
+#include "bvh.h"
+#include "trace.h"
+
+#include <cmath>
+#include <atomic>
+
+#define grid_density 4.0f       // target cells per surface
+#define grid_max_res 512        // max cells along an axis
+
+static std::atomic<uint32_t> _grid_serial(0);
+static thread_local GridMailbox _grid_mailbox;
+
+uint32_t grid_next_serial() { return ++_grid_serial; }
+
+GridMailbox& grid_mailbox(const Grid* grid) {
+    auto& mailbox = _grid_mailbox;
+    if(mailbox.serial != grid->serial or (int)mailbox.rays.size() != grid->nsurfaces) {
+        mailbox.serial = grid->serial;
+        mailbox.ray = 0;
+        mailbox.rays.assign(grid->nsurfaces, 0);
+    }
+    // on wrap around, old ids could match new rays
+    if(++mailbox.ray == 0) {
+        std::fill(mailbox.rays.begin(), mailbox.rays.end(), 0);
+        mailbox.ray = 1;
+    }
+    return mailbox;
+}
+
+// cell range [cmin,cmax] overlapped by bbox
+static void _grid_cells(const Grid* grid, const range3f& bbox, vec3i& cmin, vec3i& cmax) {
+    for(auto a : range(3)) {
+        cmin[a] = clamp((int)((bbox.min[a] - grid->bbox.min[a]) / grid->cell_size[a]), 0, grid->res[a]-1);
+        cmax[a] = clamp((int)((bbox.max[a] - grid->bbox.min[a]) / grid->cell_size[a]), 0, grid->res[a]-1);
+    }
+}
+
+Grid* build_grid(Scene* scene) {
+    TRACE_SCOPE("build_grid", "accel");
+    auto grid = new Grid();
+    grid->serial = grid_next_serial();
+    grid->nsurfaces = (int)scene->surfaces.size();
+    auto sids = accelerated_surfaces(scene);
+    auto n = (int)sids.size();
+    if(not n) return grid;
+
+    auto bboxes = vector<range3f>(n);
+    for(auto i : range(n)) {
+        bboxes[i] = surface_bbox(scene->surfaces[sids[i]]);
+        grid->bbox = runion(grid->bbox, bboxes[i]);
+    }
+
+    // resolution proportional to the extent along each axis, so that cells are about
+    // cubes; flat extents get a minimum thickness so that the volume is not zero
+    auto extent = size(grid->bbox);
+    auto max_extent = max(extent.x, max(extent.y, extent.z));
+    for(auto a : range(3)) extent[a] = max(extent[a], max_extent * 1e-3f);
+    auto cells_per_unit = std::cbrt(grid_density * n / (extent.x * extent.y * extent.z));
+    for(auto a : range(3)) {
+        grid->res[a] = clamp((int)std::round(extent[a] * cells_per_unit), 1, grid_max_res);
+        grid->cell_size[a] = size(grid->bbox)[a] / grid->res[a];
+        // flat grids get one cell of the minimum thickness
+        if(grid->cell_size[a] <= 0) grid->cell_size[a] = extent[a];
+    }
+
+    // count the surfaces per cell, then fill the cells at their prefix sums
+    auto ncells = grid->res.x * grid->res.y * grid->res.z;
+    grid->cells.assign(ncells+1, 0);
+    auto cmin = zero3i, cmax = zero3i;
+    for(auto i : range(n)) {
+        _grid_cells(grid, bboxes[i], cmin, cmax);
+        for(auto z = cmin.z; z <= cmax.z; z ++)
+            for(auto y = cmin.y; y <= cmax.y; y ++)
+                for(auto x = cmin.x; x <= cmax.x; x ++) grid->cells[x + grid->res.x * (y + grid->res.y * z) + 1] ++;
+    }
+    for(auto c : range(ncells)) grid->cells[c+1] += grid->cells[c];
+    grid->surfaces.resize(grid->cells[ncells]);
+    auto fill = vector<int>(grid->cells.begin(), grid->cells.end()-1);
+    for(auto i : range(n)) {
+        _grid_cells(grid, bboxes[i], cmin, cmax);
+        for(auto z = cmin.z; z <= cmax.z; z ++)
+            for(auto y = cmin.y; y <= cmax.y; y ++)
+                for(auto x = cmin.x; x <= cmax.x; x ++) grid->surfaces[fill[x + grid->res.x * (y + grid->res.y * z)]++] = sids[i];
+    }
+    return grid;
+}
+
+size_t grid_memory(Grid* grid) {
+    return (grid->cells.size() + grid->surfaces.size()) * sizeof(int);
+}
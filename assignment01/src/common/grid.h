@@ -0,0 +1,96 @@
+#ifndef _GRID_H_
+#define _GRID_H_
+
+#include "scene.h"
+#include "ray.h"
+#include "stats.h"
+#include "mapped.h"
+
+// uniform grid over the scene surfaces: cell c (at x + res.x*(y + res.y*z)) lists the
+// surfaces whose bounds overlap it at surfaces[cells[c]] to surfaces[cells[c+1]-1].
+// the arrays view the file they were mapped from when loaded from the accelerator cache.
+struct Grid {
+    range3f         bbox;               // grid bounds
+    vec3i           res;                // cells along each axis
+    vec3f           cell_size;          // size of a cell
+    MappedVector<int> cells;            // first surface index of each cell, plus the end of the last
+    MappedVector<int> surfaces;         // surface indices referenced by the cells
+    int             nsurfaces = 0;      // surfaces in the scene (size of the mailboxes)
+    uint32_t        serial = 0;         // build number, to reset the thread mailboxes
+    std::shared_ptr<void> mapping;      // file mapping viewed by the arrays (if loaded from the cache)
+};
+
+// build a grid over the accelerated surfaces, with about grid_density cells per surface
+// spread over the axes in proportion to the scene extent
+Grid* build_grid(Scene* scene);
+// a new build number for a grid (built or loaded)
+uint32_t grid_next_serial();
+// bytes read by the traversal: the cells and the surface indices they reference
+size_t grid_memory(Grid* grid);
+
+// mailbox of a thread: the last ray that tested each surface, so that surfaces
+// overlapping several cells are tested once per ray
+struct GridMailbox {
+    uint32_t            serial = 0;     // grid the mailbox is for
+    uint32_t            ray = 0;        // id of the current ray
+    vector<uint32_t>    rays;           // last ray id per surface
+};
+
+// the mailbox of the calling thread for grid, with a fresh ray id
+GridMailbox& grid_mailbox(const Grid* grid);
+
+// traverse the grid cells pierced by the ray front-to-back (3d-dda), calling
+// intersect_surface(sid) once for each surface in them, and stopping at the first cell
+// that ends after tmax. intersect_surface can shrink tmax (usually a reference to the
+// closest hit), which ends the traversal earlier.
+template<typename F>
+inline void grid_intersect(Grid* grid, const ray3f& ray, const float& tmax, const F& intersect_surface) {
+    if(grid->cells.empty()) return;
+    // clip the ray to the grid bounds
+    auto dinv = vec3f(1/ray.d.x, 1/ray.d.y, 1/ray.d.z);
+    auto t0 = (grid->bbox.min - ray.e) * dinv, t1 = (grid->bbox.max - ray.e) * dinv;
+    auto tn = min(t0,t1), tf = max(t0,t1);
+    auto tenter = max(ray.tmin, max(tn.x, max(tn.y, tn.z)));
+    auto texit = min(min(ray.tmax,tmax), min(tf.x, min(tf.y, tf.z)));
+    if(tenter > texit) return;
+
+    // starting cell, and the ray parameters where it crosses the next cell boundaries
+    auto p = ray.eval(tenter);
+    int cell[3], step[3], end[3];
+    float tnext[3], tdelta[3];
+    for(auto a : range(3)) {
+        cell[a] = clamp((int)((p[a] - grid->bbox.min[a]) / grid->cell_size[a]), 0, grid->res[a]-1);
+        if(ray.d[a] > 0) {
+            step[a] = 1; end[a] = grid->res[a];
+            tnext[a] = (grid->bbox.min[a] + (cell[a]+1) * grid->cell_size[a] - ray.e[a]) * dinv[a];
+            tdelta[a] = grid->cell_size[a] * dinv[a];
+        } else if(ray.d[a] < 0) {
+            step[a] = -1; end[a] = -1;
+            tnext[a] = (grid->bbox.min[a] + cell[a] * grid->cell_size[a] - ray.e[a]) * dinv[a];
+            tdelta[a] = -grid->cell_size[a] * dinv[a];
+        } else {
+            step[a] = 0; end[a] = -1;
+            tnext[a] = ray3f_rayinf; tdelta[a] = 0;
+        }
+    }
+
+    auto& mailbox = grid_mailbox(grid);
+    while(true) {
+        auto c = cell[0] + grid->res.x * (cell[1] + grid->res.y * cell[2]);
+        STATS_INC(node_visits);
+        for(auto i = grid->cells[c]; i < grid->cells[c+1]; i ++) {
+            auto sid = grid->surfaces[i];
+            if(mailbox.rays[sid] == mailbox.ray) continue;
+            mailbox.rays[sid] = mailbox.ray;
+            intersect_surface(sid);
+        }
+        // step along the axis whose boundary is crossed first
+        auto a = (tnext[0] < tnext[1]) ? ((tnext[0] < tnext[2]) ? 0 : 2) : ((tnext[1] < tnext[2]) ? 1 : 2);
+        if(tnext[a] > min(texit, tmax)) break;
+        cell[a] += step[a];
+        if(cell[a] == end[a]) break;
+        tnext[a] += tdelta[a];
+    }
+}
+
+#endif
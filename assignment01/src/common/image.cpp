@@ -1,5 +1,36 @@
 #include "image.h"
 #include "lodepng.h"
+#include "trace.h"
+
+#include <algorithm>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+void image3f::flipy_inplace() {
+    for(int j = 0; j < height()/2; j ++) {
+        std::swap_ranges(row(j), row(j)+width(), row(height()-1-j));
+    }
+}
+
+void image3f::gamma_inplace(float gamma) {
+    // pow has no vector instruction, so this stays a flat loop over the components
+    float* buf = (float*)_d.data();
+    int n = width()*height()*3;
+    for(int i = 0; i < n; i ++) buf[i] = pow(buf[i],gamma);
+}
+
+void image3f::scale_inplace(float s) {
+    // pixels are contiguous, so the components are scaled as a flat float array
+    float* buf = (float*)_d.data();
+    int n = width()*height()*3;
+    int i = 0;
+#ifdef __SSE__
+    __m128 s4 = _mm_set1_ps(s);
+    for(; i+4 <= n; i += 4) _mm_storeu_ps(buf+i, _mm_mul_ps(_mm_loadu_ps(buf+i), s4));
+#endif
+    for(; i < n; i ++) buf[i] *= s;
+}
 
 static void _read_pnm(const string& filename, char& type,
                int& width, int& height, int& nc,
@@ -63,6 +94,7 @@ static void _read_pnm(const string& filename, char& type,
 }
 
 image3f read_pnm(const string& filename, bool flipY) {
+    TRACE_SCOPE("read_pnm", "io");
     int width, height, nc; float scale; unsigned char* buffer; char type;
     _read_pnm(filename, type, width, height, nc, scale, buffer);
     if (not buffer) {
@@ -71,28 +103,30 @@ image3f read_pnm(const string& filename, bool flipY) {
     }
     error_if_not(nc == 3 && (type == 'f' || type == 'B'), "unsupported image format in file %s", filename.c_str());
     
+    // flip y while converting
     image3f img(width,height);
-    if(type == 'f') {
-        float* buf = (float*)buffer;
-        for(int i = 0; i < img.width()*img.height(); i ++) {
-            img.data()[i] = vec3f(buf[i*3+0],buf[i*3+1],buf[i*3+2]) * scale;
+    for(int j = 0; j < height; j ++) {
+        vec3f* row = img.row((flipY) ? height-1-j : j);
+        if(type == 'f') {
+            float* buf = (float*)buffer + j*width*3;
+            for(int i = 0; i < width; i ++) {
+                row[i] = vec3f(buf[i*3+0],buf[i*3+1],buf[i*3+2]) * scale;
+            }
+        } else if(type == 'B') {
+            unsigned char* buf = (unsigned char*)buffer + j*width*3;
+            for(int i = 0; i < width; i ++) {
+                row[i] = vec3f((float)buf[i*3+0],(float)buf[i*3+1],(float)buf[i*3+2]) * scale;
+            }
         }
-    } else if(type == 'B') {
-        unsigned char* buf = (unsigned char*)buffer;
-        for(int i = 0; i < img.width()*img.height(); i ++) {
-            img.data()[i] = vec3f((float)buf[i*3+0],(float)buf[i*3+1],(float)buf[i*3+2]) * scale;
-        }        
     }
     if (buffer) delete [] buffer;
     
-    if(flipY) img = img.flipy();
-    
     return img;
 }
 
 static void _write_pnm(const char *filename, char type,
                          int width, int height, int nc,
-                         bool ascii, unsigned char* buffer) {
+                         bool ascii, unsigned char* buffer, bool flipY = false) {
     FILE *f = fopen(filename, "wb");
     error_if_not(f != 0, "failed to create image file %s", filename);
     
@@ -119,9 +153,11 @@ static void _write_pnm(const char *filename, char type,
     
     if(!ascii) {
         if(type == 'f') {
+            // pfm rows are bottom-to-top; flipY reads the rows in reverse instead
             for(int j = height-1; j >= 0; j --) {
                 float* buf = (float*)buffer;
-                error_if_not((int)fwrite(buf + j*width*nc, ds, width*nc, f) == width*nc, "error writing file %s", filename);
+                int jj = (flipY) ? height-1-j : j;
+                error_if_not((int)fwrite(buf + jj*width*nc, ds, width*nc, f) == width*nc, "error writing file %s", filename);
             }
         } else {
             error_if_not((int)fwrite(buffer, ds, width*height*nc, f) == width*height*nc, "error writing file %s", filename);
@@ -138,11 +174,13 @@ static void _write_pnm(const char *filename, char type,
 }
 
 void write_pfm(const string& filename, const image3f& img, bool flipY) {
+    TRACE_SCOPE("write_pfm", "io");
     _write_pnm(filename.c_str(), 'f', img.width(), img.height(), 3, false,
-               (flipY)?(unsigned char*)img.flipy().data():(unsigned char*)img.data());
+               (unsigned char*)img.data(), flipY);
 }
 
 image3f read_png(const string& filename, bool flipY) {
+    TRACE_SCOPE("read_png", "io");
     vector<unsigned char> pixels;
     unsigned width, height;
     
@@ -165,14 +203,16 @@ image3f read_png(const string& filename, bool flipY) {
 }
 
 void write_png(const string& filename, const image3f& img, bool flipY) {
+    TRACE_SCOPE("write_png", "io");
     vector<unsigned char> img_png(img.width()*img.height()*4);
-    for(int x = 0; x < img.width(); x++ ) {
-        for( int y = 0; y < img.height(); y++ ) {
-            int i_img = y * img.width() + x;
-            int i_png = ( ( flipY ? (img.height()-1-y) : y ) * img.width() + x ) * 4;
-            img_png[i_png+0] = (unsigned char)clamp(img.data()[i_img].x * 255, 0.0f, 255.0f);
-            img_png[i_png+1] = (unsigned char)clamp(img.data()[i_img].y * 255, 0.0f, 255.0f);
-            img_png[i_png+2] = (unsigned char)clamp(img.data()[i_img].z * 255, 0.0f, 255.0f);
+    auto view = image3f_view(img, flipY);
+    for( int y = 0; y < view.height(); y++ ) {
+        const vec3f* row = view.row(y);
+        for(int x = 0; x < view.width(); x++ ) {
+            int i_png = ( y * view.width() + x ) * 4;
+            img_png[i_png+0] = (unsigned char)clamp(row[x].x * 255, 0.0f, 255.0f);
+            img_png[i_png+1] = (unsigned char)clamp(row[x].y * 255, 0.0f, 255.0f);
+            img_png[i_png+2] = (unsigned char)clamp(row[x].z * 255, 0.0f, 255.0f);
             img_png[i_png+3] = 255;
         }
     }
@@ -30,44 +30,48 @@ struct image3f {
     // data access
     const vec3f* data() const { return _d.data(); }
     
+    // row access (rows are stored contiguously)
+    vec3f* row(int j) { return _d.data()+j*_w; }
+    // row access (rows are stored contiguously)
+    const vec3f* row(int j) const { return _d.data()+j*_w; }
+    
     // flips this image along the y axis returning a new image
-    image3f flipy() const {
-        image3f ret(width(),height());
-        for(int j = 0; j < height(); j ++) {
-            for(int i = 0; i < width(); i ++) {
-                ret.at(i,height()-1-j) = at(i,j);
-            }
-        }
-        return ret;
-    }
+    image3f flipy() const { image3f ret = *this; ret.flipy_inplace(); return ret; }
     
     // apply gamma correction
-    image3f gamma(float gamma) const {
-        image3f ret(width(),height());
-        for(int j = 0; j < height(); j ++) {
-            for(int i = 0; i < width(); i ++) {
-                ret.at(i,j) = pow(at(i,j),gamma);
-            }
-        }
-        return ret;
-    }
+    image3f gamma(float gamma) const { image3f ret = *this; ret.gamma_inplace(gamma); return ret; }
     
     // apply a scale to the image
-    image3f scale(float s) {
-        image3f ret(width(),height());
-        for(int j = 0; j < height(); j ++) {
-            for(int i = 0; i < width(); i ++) {
-                ret.at(i,j) = at(i,j)*s;
-            }
-        }
-        return ret;
-    }
+    image3f scale(float s) const { image3f ret = *this; ret.scale_inplace(s); return ret; }
+    
+    // flips this image along the y axis in place (swapping rows)
+    void flipy_inplace();
+    // apply gamma correction in place
+    void gamma_inplace(float gamma);
+    // apply a scale to the image in place
+    void scale_inplace(float s);
     
 private:
     int _w, _h;
     vector<vec3f> _d;
 };
 
+// read-only view of an image with its rows optionally in flipped order (no pixel copies)
+struct image3f_view {
+    const image3f*  img = nullptr;  // viewed image
+    bool            flipY = false;  // whether rows are flipped
+    
+    // constructor
+    image3f_view(const image3f& img, bool flipY) : img(&img), flipY(flipY) { }
+    
+    // image width
+    int width() const { return img->width(); }
+    // image height
+    int height() const { return img->height(); }
+    // row access in view order
+    const vec3f* row(int j) const { return img->row((flipY) ? img->height()-1-j : j); }
+};
+
 // Write an floating point color PFM image file
 void write_pfm(const string& filename, const image3f& img, bool flipY = false);
 // Write an 8-bit color compressed PNG file (sets PNG alpha to 1 everywhere)
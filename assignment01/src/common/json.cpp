@@ -1,5 +1,6 @@
 #include "json.h"
 #include "picojson.h"
+#include "trace.h"
 
 // json value conversion from parser
 static jsonvalue _to_jsonvalue(const picojson::value& pjson) {
@@ -21,6 +22,7 @@ static jsonvalue _to_jsonvalue(const picojson::value& pjson) {
 
 // json handling
 jsonvalue load_json(const string& filename) {
+    TRACE_SCOPE("load_json", "io");
     // open file
     std::ifstream stream(filename.c_str(), std::ifstream::in);
     error_if_not(stream.good(), "cannot open file: %s\n", filename.c_str());
@@ -0,0 +1,51 @@
+#ifndef _MAPPED_H_
+#define _MAPPED_H_
+
+#include "common.h"
+#include <cstddef>
+#include <memory>
+
+// vector that can also view elements stored elsewhere, like arrays mapped from a file.
+// views are read (and written) in place, and copied into owned storage when they are
+// resized, so builders use it as a vector. the memory viewed must outlive the views.
+template<typename T, typename A = std::allocator<T>>
+struct MappedVector {
+    typedef T value_type;
+
+    // views n elements at data, dropping the owned ones
+    void map(T* data, size_t n) { vector<T,A>().swap(_owned); _view = data; _view_size = n; }
+    // whether the elements are viewed rather than owned
+    bool mapped() const { return _view != nullptr; }
+
+    size_t size() const { return (_view) ? _view_size : _owned.size(); }
+    bool empty() const { return size() == 0; }
+    T* data() { return (_view) ? _view : _owned.data(); }
+    const T* data() const { return (_view) ? _view : _owned.data(); }
+    T& operator[](size_t i) { return data()[i]; }
+    const T& operator[](size_t i) const { return data()[i]; }
+    T* begin() { return data(); }
+    T* end() { return data() + size(); }
+    const T* begin() const { return data(); }
+    const T* end() const { return data() + size(); }
+    T& back() { return data()[size()-1]; }
+    const T& back() const { return data()[size()-1]; }
+
+    void resize(size_t n) { owned().resize(n); }
+    void reserve(size_t n) { owned().reserve(n); }
+    void assign(size_t n, const T& value) { owned().assign(n, value); }
+    void push_back(const T& value) { owned().push_back(value); }
+    void clear() { _view = nullptr; _view_size = 0; _owned.clear(); }
+
+    // the elements as a vector, copying the viewed ones first
+    vector<T,A>& owned() {
+        if(_view) { _owned.assign(_view, _view + _view_size); _view = nullptr; _view_size = 0; }
+        return _owned;
+    }
+
+private:
+    vector<T,A>     _owned;                 // owned elements (empty while viewing)
+    T*              _view = nullptr;        // viewed elements (nullptr if owned)
+    size_t          _view_size = 0;         // number of viewed elements
+};
+
+#endif
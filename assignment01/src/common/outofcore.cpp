@@ -0,0 +1,324 @@
+#include "outofcore.h"
+#include "trace.h"
+
+#include <cstring>
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <process.h>
+#define getpid _getpid
+#endif
+
+// out-of-core files store in native layout and endianness: magic, hash of the scene they
+// were written from, surface count, the materials, the cluster table, and the pages. a
+// page holds the surface records followed by the nodes, wide nodes and leaf surface
+// indices of the bvh over them (each array as its element count and the elements).
+#define ooc_magic "RTOOC002"
+
+// surface record of the pages
+struct _OOCSurface {
+    frame3f     frame;          // frame
+    float       radius = 1;     // radius
+    int         material = 0;   // index in the material table of the file
+    int         flags = 0;      // 1 for quads, 2 for cylinders
+};
+
+template<typename T>
+static void _ooc_write(FILE* f, const T* values, size_t n = 1) { if(n) fwrite(values, sizeof(T), n, f); }
+template<typename T>
+static void _ooc_read(FILE* f, T* values, size_t n = 1) {
+    error_if_not(not n or fread(values, sizeof(T), n, f) == n, "truncated out-of-core file\n");
+}
+template<typename V>
+static void _ooc_write_array(FILE* f, const V& values) {
+    auto n = (uint64_t)values.size();
+    _ooc_write(f, &n); _ooc_write(f, values.data(), values.size());
+}
+template<typename V>
+static void _ooc_read_array(FILE* f, V& values) {
+    auto n = uint64_t(0);
+    _ooc_read(f, &n);
+    values.resize(n); _ooc_read(f, values.data(), n);
+}
+
+// takes n values from the page buffer at p, before end
+template<typename T>
+static void _ooc_take(const char*& p, const char* end, T* values, size_t n = 1) {
+    if((size_t)(end - p) / sizeof(T) < n) { error_if_not(false, "truncated out-of-core file\n"); p = end; return; }
+    if(n) memcpy(values, p, n * sizeof(T));
+    p += n * sizeof(T);
+}
+template<typename V>
+static void _ooc_take_array(const char*& p, const char* end, V& values) {
+    auto n = uint64_t(0);
+    _ooc_take(p, end, &n);
+    if(n > (uint64_t)(end - p) / sizeof(values[0])) { error_if_not(false, "truncated out-of-core file\n"); n = 0; p = end; }
+    values.resize(n); _ooc_take(p, end, values.data(), n);
+}
+
+// reads bytes at offset in the file, concurrently with other reads where pread is available
+static bool _ooc_read_at(FILE* f, uint64_t offset, char* buffer, size_t bytes) {
+#ifndef _WIN32
+    for(size_t done = 0; done < bytes; ) {
+        auto n = pread(fileno(f), buffer + done, bytes - done, offset + done);
+        if(n <= 0) return false;
+        done += n;
+    }
+    return true;
+#else
+    static std::mutex file_mutex;
+    std::lock_guard<std::mutex> lock(file_mutex);
+    return _fseeki64(f, offset, SEEK_SET) == 0 and fread(buffer, 1, bytes, f) == bytes;
+#endif
+}
+
+OutOfCore::~OutOfCore() {
+    if(file) fclose(file);
+    delete top;
+}
+
+uint64_t ooc_scene_hash(const string& scene_filename) {
+    TRACE_SCOPE("ooc_scene_hash", "scene");
+    auto f = fopen(scene_filename.c_str(), "rb");
+    auto name = scene_filename;
+    if(not f) { name.resize((name.size() + 7) / 8 * 8, ' '); return hash_words(0xcbf29ce484222325ull, name.data(), name.size()); }
+    // read in chunks, the last one padded with zeros to whole words, and then the size
+    auto h = 0xcbf29ce484222325ull;
+    auto size = uint64_t(0);
+    auto chunk = vector<char>(1 << 20);
+    while(auto n = fread(chunk.data(), 1, chunk.size(), f)) {
+        size += n;
+        while(n % 8) chunk[n++] = 0;
+        h = hash_words(h, chunk.data(), n);
+    }
+    fclose(f);
+    return hash_words(h, &size, sizeof(size));
+}
+
+bool ooc_file_matches(const string& filename, uint64_t scene_hash) {
+    auto f = fopen(filename.c_str(), "rb");
+    if(not f) return false;
+    char magic[8] = {};
+    auto hash = uint64_t(0);
+    auto ok = fread(magic, 1, 8, f) == 8 and fread(&hash, sizeof(hash), 1, f) == 1;
+    fclose(f);
+    return ok and string(magic,8) == ooc_magic and hash == scene_hash;
+}
+
+void save_out_of_core(const string& filename, Scene* scene, uint64_t scene_hash, int cluster_size) {
+    TRACE_SCOPE("save_out_of_core", "scene");
+    error_if_not(scene->animations.empty(), "out-of-core scenes cannot be animated\n");
+
+    // clusters are the largest subtrees of the sah bvh with at most cluster_size surfaces;
+    // the surfaces of a subtree are contiguous in bvh->surfaces, in [first,end)
+    auto nsurfaces = (int)scene->surfaces.size();
+    auto bboxes = vector<range3f>(nsurfaces);
+    for(auto sid : range(nsurfaces)) bboxes[sid] = surface_bbox(scene->surfaces[sid]);
+    auto bvh = build_bvh(bboxes, 2);
+    auto first = vector<int>(bvh->nodes.size()), end = vector<int>(bvh->nodes.size());
+    for(auto nid = (int)bvh->nodes.size() - 1; nid >= 0; nid --) {
+        auto& node = bvh->nodes[nid];
+        if(node.count) { first[nid] = node.start; end[nid] = node.start + node.count; }
+        else { first[nid] = first[node.start]; end[nid] = end[node.start+1]; }
+    }
+    auto ranges = vector<pair<int,int>>();
+    auto stack = vector<int>();
+    if(nsurfaces) stack.push_back(0);
+    while(not stack.empty()) {
+        auto nid = stack.back(); stack.pop_back();
+        auto& node = bvh->nodes[nid];
+        if(node.count or end[nid] - first[nid] <= cluster_size) { ranges.push_back({first[nid], end[nid]}); continue; }
+        stack.push_back(node.start+1);
+        stack.push_back(node.start);
+    }
+
+    // written aside and renamed, so that concurrent renders never read a partial file
+    auto tmpname = filename + tostring(".%d.tmp", (int)getpid());
+    auto f = fopen(tmpname.c_str(), "wb");
+    error_if_not(f, "cannot open file: %s\n", tmpname.c_str());
+    _ooc_write(f, ooc_magic, 8);
+    _ooc_write(f, &scene_hash);
+    auto nsurfaces64 = (int64_t)nsurfaces;
+    _ooc_write(f, &nsurfaces64);
+    auto nmaterials = scene->materials.size();
+    _ooc_write(f, &nmaterials);
+    for(auto& material : scene->materials.materials) {
+        _ooc_write(f, &material.kd); _ooc_write(f, &material.ks);
+        _ooc_write(f, &material.kr); _ooc_write(f, &material.n);
+    }
+    // the table is written again once the page offsets are known
+    auto clusters = vector<OOCCluster>(ranges.size());
+    auto nclusters = (int)clusters.size();
+    _ooc_write(f, &nclusters);
+    auto table_offset = ftell(f);
+    _ooc_write(f, clusters.data(), clusters.size());
+
+    auto records = vector<_OOCSurface>();
+    auto page_bboxes = vector<range3f>();
+    for(auto c : range(nclusters)) {
+        auto& cluster = clusters[c];
+        records.clear(); page_bboxes.clear();
+        for(auto i : range(ranges[c].first, ranges[c].second)) {
+            auto surface = scene->surfaces[bvh->surfaces[i]];
+            auto record = _OOCSurface();
+            record.frame = surface->frame;
+            record.radius = surface->radius;
+            record.material = surface->material;
+            record.flags = (surface->isquad ? 1 : 0) | (surface->iscyl ? 2 : 0);
+            records.push_back(record);
+            page_bboxes.push_back(bboxes[bvh->surfaces[i]]);
+            cluster.bbox = runion(cluster.bbox, page_bboxes.back());
+        }
+        auto page_bvh = build_bvh(page_bboxes, 4);
+        cluster.offset = ftell(f);
+        cluster.nsurfaces = (int)records.size();
+        _ooc_write(f, records.data(), records.size());
+        _ooc_write_array(f, page_bvh->nodes);
+        _ooc_write_array(f, page_bvh->wide);
+        _ooc_write_array(f, page_bvh->surfaces);
+        cluster.bytes = ftell(f) - cluster.offset;
+        delete page_bvh;
+    }
+    delete bvh;
+    fseek(f, table_offset, SEEK_SET);
+    _ooc_write(f, clusters.data(), clusters.size());
+    auto ok = not ferror(f);
+    ok = (fclose(f) == 0) and ok;
+    if(ok) ok = std::rename(tmpname.c_str(), filename.c_str()) == 0;
+    if(not ok) std::remove(tmpname.c_str());
+    error_if_not(ok, "cannot write file: %s\n", filename.c_str());
+}
+
+OutOfCore* load_out_of_core(const string& filename, Scene* scene, size_t budget) {
+    TRACE_SCOPE("load_out_of_core", "scene");
+    auto f = fopen(filename.c_str(), "rb");
+    error_if_not(f, "cannot open file: %s\n", filename.c_str());
+    char magic[8];
+    _ooc_read(f, magic, 8);
+    error_if_not(string(magic,8) == ooc_magic, "not an out-of-core file: %s\n", filename.c_str());
+    auto scene_hash = uint64_t(0);
+    _ooc_read(f, &scene_hash);
+    auto ooc = new OutOfCore();
+    ooc->file = f;
+    ooc->budget = budget;
+    auto nsurfaces = int64_t(0);
+    _ooc_read(f, &nsurfaces);
+    ooc->nsurfaces = (int)nsurfaces;
+    auto nmaterials = 0;
+    _ooc_read(f, &nmaterials);
+    ooc->materials.resize(nmaterials);
+    for(auto& id : ooc->materials) {
+        auto material = Material();
+        _ooc_read(f, &material.kd); _ooc_read(f, &material.ks);
+        _ooc_read(f, &material.kr); _ooc_read(f, &material.n);
+        id = scene->materials.intern(material);
+    }
+    auto nclusters = 0;
+    _ooc_read(f, &nclusters);
+    ooc->clusters.resize(nclusters);
+    _ooc_read(f, ooc->clusters.data(), nclusters);
+
+    auto bboxes = vector<range3f>(nclusters);
+    for(auto c : range(nclusters)) bboxes[c] = ooc->clusters[c].bbox;
+    ooc->top = build_bvh(bboxes, 4);
+    ooc->pages.resize(nclusters);
+    ooc->last_use = vector<std::atomic<uint32_t>>(nclusters);
+    ooc->reading.resize(nclusters);
+    return ooc;
+}
+
+// reads the page of a cluster (without locks, the file being read at explicit offsets)
+static std::shared_ptr<OOCPage> _ooc_read_page(OutOfCore* ooc, int c) {
+    TRACE_SCOPE("page_in", "accel", c);
+    auto& cluster = ooc->clusters[c];
+    auto page = std::make_shared<OOCPage>();
+    auto buffer = vector<char>(cluster.bytes);
+    error_if_not(_ooc_read_at(ooc->file, cluster.offset, buffer.data(), buffer.size()), "truncated out-of-core file\n");
+    auto p = (const char*)buffer.data(), end = p + buffer.size();
+    auto records = vector<_OOCSurface>(cluster.nsurfaces);
+    _ooc_take(p, end, records.data(), records.size());
+    _ooc_take_array(p, end, page->bvh.nodes);
+    _ooc_take_array(p, end, page->bvh.wide);
+    _ooc_take_array(p, end, page->bvh.surfaces);
+    page->surfaces.resize(records.size());
+    for(auto i : range(records.size())) {
+        auto& record = records[i];
+        auto& surface = page->surfaces[i];
+        error_if_not(record.material >= 0 and record.material < (int)ooc->materials.size(), "bad material index in out-of-core file\n");
+        surface.frame = record.frame;
+        surface.radius = record.radius;
+        surface.material = ooc->materials[record.material];
+        surface.isquad = record.flags & 1;
+        surface.iscyl = record.flags & 2;
+        update_surface(&surface);
+    }
+    page->bytes = page->surfaces.size() * sizeof(Surface) + page->bvh.nodes.size() * sizeof(BVHNode) +
+                  page->bvh.wide.size() * sizeof(BVHWideNode) + page->bvh.surfaces.size() * sizeof(int);
+    STATS_INC(page_loads);
+    STATS_ADD(page_bytes_read, cluster.bytes);
+    return page;
+}
+
+// resident page of a cluster (or nullptr), marked as used since the last page read; the
+// mark is only written when it changes, so that threads do not contend for its cache line
+static std::shared_ptr<OOCPage> _ooc_resident_page(OutOfCore* ooc, int cluster) {
+    auto page = std::shared_ptr<OOCPage>();
+    {
+        std::lock_guard<std::mutex> lock(ooc->shards[cluster % ooc_shards]);
+        page = ooc->pages[cluster];
+    }
+    auto now = ooc->reads.load(std::memory_order_relaxed);
+    if(page and ooc->last_use[cluster].load(std::memory_order_relaxed) != now) ooc->last_use[cluster].store(now, std::memory_order_relaxed);
+    return page;
+}
+
+std::shared_ptr<OOCPage> ooc_page(OutOfCore* ooc, int cluster, bool load) {
+    auto page = _ooc_resident_page(ooc, cluster);
+    if(page or not load) return page;
+
+    // claim the read, waiting instead if another thread is reading the page
+    std::unique_lock<std::mutex> lock(ooc->mutex);
+    while(ooc->reading[cluster]) ooc->read_cv.wait(lock);
+    page = _ooc_resident_page(ooc, cluster);
+    if(page) return page;
+    ooc->reading[cluster] = true;
+    lock.unlock();
+    page = _ooc_read_page(ooc, cluster);
+    lock.lock();
+
+    // evict the least recently used pages over budget (pages used between the same two
+    // reads tie), releasing them after unlocking, and publish the page
+    auto evicted = vector<std::shared_ptr<OOCPage>>();
+    while(not ooc->resident_clusters.empty() and ooc->resident + page->bytes > ooc->budget) {
+        auto& resident = ooc->resident_clusters;
+        auto oldest = 0;
+        for(auto i : range(1, (int)resident.size())) {
+            if(ooc->last_use[resident[i]].load(std::memory_order_relaxed) <
+               ooc->last_use[resident[oldest]].load(std::memory_order_relaxed)) oldest = i;
+        }
+        auto c = resident[oldest];
+        resident[oldest] = resident.back();
+        resident.pop_back();
+        {
+            std::lock_guard<std::mutex> shard(ooc->shards[c % ooc_shards]);
+            evicted.push_back(nullptr);
+            evicted.back().swap(ooc->pages[c]);
+        }
+        ooc->resident -= evicted.back()->bytes;
+    }
+    ooc->reading[cluster] = false;
+    ooc->last_use[cluster].store(++ ooc->reads, std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> shard(ooc->shards[cluster % ooc_shards]);
+        ooc->pages[cluster] = page;
+    }
+    ooc->resident_clusters.push_back(cluster);
+    ooc->resident += page->bytes;
+    lock.unlock();
+    ooc->read_cv.notify_all();
+    return page;
+}
+
+size_t ooc_memory(OutOfCore* ooc) {
+    return ooc->clusters.size() * sizeof(OOCCluster) + bvh_memory(ooc->top);
+}
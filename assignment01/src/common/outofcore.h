@@ -0,0 +1,91 @@
+#ifndef _OUTOFCORE_H_
+#define _OUTOFCORE_H_
+
+#include "scene.h"
+#include "bvh.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+#define ooc_cluster_size 1024   // max surfaces in a cluster (page)
+#define ooc_shards 64           // locks over the resident pages (cluster c uses shard c % ooc_shards)
+
+// out-of-core geometry: the surfaces are partitioned spatially into clusters (subtrees of
+// the sah bvh) stored as pages of a file, each with its own bvh. the cluster bounds and a
+// bvh over them stay resident, while the pages are read on demand into an lru cache.
+
+// cluster of spatially close surfaces, stored as a page of the file
+struct OOCCluster {
+    range3f     bbox;               // bounds of the surfaces
+    uint64_t    offset = 0;         // page offset in the file
+    uint64_t    bytes = 0;          // page size in the file
+    int         nsurfaces = 0;      // surfaces in the page
+};
+
+// page of a cluster read in memory
+struct OOCPage {
+    vector<Surface>     surfaces;   // surfaces, with material ids in the scene table
+    BVH                 bvh;        // bvh over the surfaces
+    size_t              bytes = 0;  // memory footprint, charged to the cache budget
+};
+
+// out-of-core geometry of a scene (which then has no surfaces of its own)
+struct OutOfCore {
+    FILE*                   file = nullptr;     // file holding the pages
+    vector<OOCCluster>      clusters;           // clusters
+    BVH*                    top = nullptr;      // bvh over the cluster bounds (its leaves reference clusters)
+    vector<uint32_t>        materials;          // scene material ids of the materials in the file
+    int                     nsurfaces = 0;      // surfaces in all the clusters
+    size_t                  budget = 0;         // max bytes of resident pages (at least one is kept)
+
+    // lru cache of the pages; pages evicted while other threads use them live on until released.
+    // resident pages are looked up under the lock of their shard only; misses claim the read
+    // of their page under mutex, read it without locks, and relock to publish it and evict.
+    std::mutex                          shards[ooc_shards]; // guard the pages of their clusters
+    vector<std::shared_ptr<OOCPage>>    pages;      // resident pages by cluster (null if not resident)
+    vector<std::atomic<uint32_t>>       last_use;   // reads count at the last lookup of each cluster (lru order)
+    std::atomic<uint32_t>               reads{0};   // pages read so far
+    std::mutex                          mutex;      // guards the fields below
+    std::condition_variable             read_cv;    // signals that a page was read
+    vector<bool>                        reading;    // clusters whose page is being read
+    vector<int>                         resident_clusters;  // clusters with resident pages
+    size_t                              resident = 0;   // bytes of the resident pages
+
+    // closes the file and frees the pages
+    ~OutOfCore();
+};
+
+// hash of the scene an out-of-core file is written from: of the contents of scene_filename,
+// or of the name itself for generated scenes (when there is no such file)
+uint64_t ooc_scene_hash(const string& scene_filename);
+// whether filename is an out-of-core file written from the scene with hash scene_hash
+bool ooc_file_matches(const string& filename, uint64_t scene_hash);
+// partition the scene surfaces into clusters of at most cluster_size surfaces and write
+// them to filename, tagged with scene_hash (animated scenes are not supported)
+void save_out_of_core(const string& filename, Scene* scene, uint64_t scene_hash, int cluster_size = ooc_cluster_size);
+// open an out-of-core file for scene, adding its materials to the scene table; at most
+// budget bytes of pages are kept in memory
+OutOfCore* load_out_of_core(const string& filename, Scene* scene, size_t budget);
+
+// page of cluster c, read from disk (evicting the least recently used pages over budget)
+// if not resident, while other threads look up or read other pages; with load false,
+// non-resident pages are not read and nullptr is returned. callers count the page_lookups
+// stat, once per ray and cluster.
+std::shared_ptr<OOCPage> ooc_page(OutOfCore* ooc, int cluster, bool load = true);
+// bytes of the resident index: the cluster table and the top bvh
+size_t ooc_memory(OutOfCore* ooc);
+
+// traverse the clusters hit by the ray front-to-back, as bvh_intersect, reading their
+// pages as needed and calling intersect_surface(surface) for the surfaces in the leaves hit
+template<typename F>
+inline void ooc_intersect(OutOfCore* ooc, const ray3f& ray, const float& tmax, const F& intersect_surface) {
+    bvh_intersect(ooc->top, ray, tmax, [&](int cluster){
+        STATS_INC(page_lookups);
+        auto page = ooc_page(ooc, cluster);
+        bvh_intersect(&page->bvh, ray, tmax, [&](int sid){ intersect_surface(&page->surfaces[sid]); });
+    });
+}
+
+#endif
@@ -0,0 +1,126 @@
+#include "parallel.h"
+#include "trace.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+// thread index and whether the thread is executing a parallel_for
+static thread_local int _thread_id = 0;
+static thread_local bool _thread_busy = false;
+
+// persistent pool of worker threads; the thread calling parallel_for works
+// as thread 0, the pool provides threads [1,nthreads)
+struct _ThreadPool {
+    vector<std::thread>                     workers;            // worker threads
+    std::mutex                              mutex;              // guards the job state
+    std::condition_variable                 job_cv;             // signals a new job (or quit)
+    std::condition_variable                 done_cv;            // signals job completion
+    std::mutex                              submit_mutex;       // serializes parallel_for calls
+    const std::function<void(int)>*         job = nullptr;      // current job
+    int                                     job_count = 0;      // current job iterations
+    std::atomic<int>                        job_next;           // next iteration to run
+    int                                     job_running = 0;    // workers still in the job
+    unsigned                                generation = 0;     // incremented for each job
+    bool                                    quit = false;       // tells workers to exit
+
+    _ThreadPool(int nthreads) {
+        job_next = 0;
+        for(auto tid : range(1,nthreads)) workers.push_back(std::thread([this,tid](){ _work(tid); }));
+    }
+
+    ~_ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        job_cv.notify_all();
+        for(auto& worker : workers) worker.join();
+    }
+
+    // run iterations of the current job until none are left
+    void _run() {
+        _thread_busy = true;
+        for(auto i = job_next++; i < job_count; i = job_next++) (*job)(i);
+        _thread_busy = false;
+    }
+
+    // worker loop
+    void _work(int tid) {
+        _thread_id = tid;
+        trace_thread_name(tostring("worker %d", tid));
+        auto seen = 0u;
+        while(true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                job_cv.wait(lock, [&](){ return quit or generation != seen; });
+                if(quit) return;
+                seen = generation;
+            }
+            _run();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                job_running --;
+                if(not job_running) done_cv.notify_one();
+            }
+        }
+    }
+
+    // run a job over the pool and the calling thread
+    void run(int count, const std::function<void(int)>& func) {
+        std::lock_guard<std::mutex> submit(submit_mutex);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &func;
+            job_count = count;
+            job_next = 0;
+            job_running = (int)workers.size();
+            generation ++;
+        }
+        job_cv.notify_all();
+        _run();
+        std::unique_lock<std::mutex> lock(mutex);
+        done_cv.wait(lock, [&](){ return job_running == 0; });
+        job = nullptr;
+    }
+};
+
+static int _nthreads = 0;
+static _ThreadPool* _pool = nullptr;
+static std::mutex _pool_mutex;
+
+// destroys the pool at exit so that workers are joined
+struct _ThreadPoolCleanup { ~_ThreadPoolCleanup() { delete _pool; _pool = nullptr; } };
+static _ThreadPoolCleanup _pool_cleanup;
+
+int parallel_nthreads() {
+    if(_nthreads <= 0) _nthreads = (std::thread::hardware_concurrency()) ? (int)std::thread::hardware_concurrency() : 1;
+    return _nthreads;
+}
+
+void parallel_set_nthreads(int nthreads) {
+    std::lock_guard<std::mutex> lock(_pool_mutex);
+    if(_pool) { delete _pool; _pool = nullptr; }
+    _nthreads = nthreads;
+}
+
+int parallel_thread_id() { return _thread_id; }
+
+void parallel_for(int count, const std::function<void(int)>& func) {
+    if(count <= 0) return;
+    if(_thread_busy or count == 1 or parallel_nthreads() == 1) {
+        auto busy = _thread_busy;
+        _thread_busy = true;
+        for(auto i : range(count)) func(i);
+        _thread_busy = busy;
+        return;
+    }
+    _ThreadPool* pool = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(_pool_mutex);
+        if(not _pool) _pool = new _ThreadPool(parallel_nthreads());
+        pool = _pool;
+    }
+    pool->run(count, func);
+}
@@ -0,0 +1,19 @@
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+
+#include "common.h"
+#include <functional>
+
+// number of threads used by parallel_for (the calling thread included)
+int parallel_nthreads();
+// sets the number of threads used by parallel_for (0 uses the hardware concurrency)
+void parallel_set_nthreads(int nthreads);
+// index of the current thread in [0,parallel_nthreads()); 0 outside the worker threads
+int parallel_thread_id();
+
+// runs func(i) for every i in [0,count) distributing the iterations over a
+// persistent pool of worker threads; returns when all iterations are done.
+// nested calls (made from inside func) run serially on the calling thread.
+void parallel_for(int count, const std::function<void(int)>& func);
+
+#endif
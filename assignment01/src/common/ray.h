@@ -0,0 +1,54 @@
+#ifndef _RAY_H_
+#define _RAY_H_
+
+#include "vmath.h"
+
+#define ray3f_epsilon 0.0005f
+#define ray3f_rayinf 1000000.0f
+
+// 3D Ray
+struct ray3f {
+    vec3f e;        // origin
+    vec3f d;        // direction
+    float tmin;     // min t value
+    float tmax;     // max t value
+
+    // Default constructor
+    ray3f() : e(zero3f), d(z3f), tmin(ray3f_epsilon), tmax(ray3f_rayinf) { }
+
+    // Element-wise constructor
+    ray3f(const vec3f& e, const vec3f& d) :
+    e(e), d(d), tmin(ray3f_epsilon), tmax(ray3f_rayinf) { }
+
+    // Element-wise constructor
+    ray3f(const vec3f& e, const vec3f& d, float tmin, float tmax) :
+    e(e), d(d), tmin(tmin), tmax(tmax) { }
+
+    // Eval ray at a specific t
+    vec3f eval(float t) const { return e + d * t; }
+
+    // Create a ray from a segment
+    static ray3f make_segment(const vec3f& a, const vec3f& b) { return ray3f(a,normalize(b-a),ray3f_epsilon,dist(a,b)-2*ray3f_epsilon); }
+};
+
+// transform a ray by a frame
+inline ray3f transform_ray(const frame3f& f, const ray3f& v) {
+    return ray3f(transform_point(f,v.e), transform_vector(f,v.d), v.tmin, v.tmax);
+}
+// transform a ray by a frame inverse
+inline ray3f transform_ray_inverse(const frame3f& f, const ray3f& v) {
+    return ray3f(transform_point_inverse(f,v.e),transform_vector_inverse(f,v.d),v.tmin,v.tmax);
+}
+
+// intersects a bounding box with a ray segment [tmin,tmax], given the ray origin
+// and its inverse direction (slab test)
+inline bool intersect_bbox(const range3f& bbox, const vec3f& e, const vec3f& dinv, float tmin, float tmax) {
+    auto t0 = (bbox.min - e) * dinv;
+    auto t1 = (bbox.max - e) * dinv;
+    auto tn = min(t0,t1), tf = max(t0,t1);
+    tmin = max(tmin, max(tn.x, max(tn.y, tn.z)));
+    tmax = min(tmax, min(tf.x, min(tf.y, tf.z)));
+    return tmin <= tmax;
+}
+
+#endif
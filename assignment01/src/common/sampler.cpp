@@ -0,0 +1,174 @@
+#include "sampler.h"
+#include <random>
+#include <algorithm>
+#include <cmath>
+
+// patterns precomputed for the stratified and blue noise samplers
+#define sampler_ntables 64
+
+SamplerType sampler_type(const string& name) {
+    if(name == "regular") return sampler_regular;
+    if(name == "stratified") return sampler_stratified;
+    if(name == "sobol") return sampler_sobol;
+    if(name == "halton") return sampler_halton;
+    if(name == "bluenoise") return sampler_bluenoise;
+    error("unknown sampler %s\n", name.c_str());
+    return sampler_regular;
+}
+
+// integer hash (lowbias32)
+static inline uint32_t _hash(uint32_t x) {
+    x ^= x >> 16; x *= 0x7feb352du;
+    x ^= x >> 15; x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+// hash of a pixel and a dimension
+static inline uint32_t _hash(int i, int j, uint32_t dim, uint32_t seed) {
+    return _hash((uint32_t)i ^ _hash((uint32_t)j ^ _hash(dim ^ _hash(seed))));
+}
+
+// [0,1) float from the 24 high bits
+static inline float _to_float(uint32_t x) { return (x >> 8) * (1.0f / 16777216.0f); }
+
+static inline uint32_t _reverse_bits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+// owen scrambling of a base 2 fraction (hash-based nested uniform scramble, burley 2020):
+// flipping bit k depends only on the bits above it
+static inline uint32_t _owen_scramble(uint32_t x, uint32_t seed) {
+    x = _reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return _reverse_bits(x);
+}
+
+// sobol dimensions 0 (van der corput) and 1 as 32 bit fractions
+static inline uint32_t _sobol0(uint32_t i) { return _reverse_bits(i); }
+static inline uint32_t _sobol1(uint32_t i) {
+    auto r = 0u;
+    for(auto v = 1u << 31; i; i >>= 1, v ^= v >> 1) if(i & 1) r ^= v;
+    return r;
+}
+
+// owen scrambled radical inverse in base 3: each digit is permuted by one of the
+// 6 permutations of {0,1,2}, picked by hashing the digits before it
+static inline float _halton3_scrambled(uint32_t index, uint32_t seed) {
+    static const int perms[6][3] = { {0,1,2}, {0,2,1}, {1,0,2}, {1,2,0}, {2,0,1}, {2,1,0} };
+    auto r = 0.0, f = 1.0 / 3;
+    auto prefix = seed;
+    // 21 digits cover the float precision (3^21 > 2^32), trailing zeros are scrambled too
+    for(auto k = 0; k < 21; k ++) {
+        auto digit = index % 3;
+        index /= 3;
+        r += perms[_hash(prefix) % 6][digit] * f;
+        f /= 3;
+        prefix = _hash(prefix ^ (digit + 1) * 0x9e3779b9u);
+    }
+    return (float)std::min(r, 1.0 - 1e-7);
+}
+
+// grid of nx x ny cells holding n samples (nx*ny >= n)
+static void _grid_size(int n, int& nx, int& ny) {
+    nx = max(1, (int)std::ceil(std::sqrt((double)n)));
+    ny = (n + nx - 1) / nx;
+}
+
+// squared distance on the unit torus
+static inline float _torus_dist2(const vec2f& a, const vec2f& b) {
+    auto dx = std::abs(a.x - b.x), dy = std::abs(a.y - b.y);
+    dx = min(dx, 1 - dx); dy = min(dy, 1 - dy);
+    return dx*dx + dy*dy;
+}
+
+PixelSampler make_pixel_sampler(SamplerType type, int nsamples, uint32_t seed) {
+    auto sampler = PixelSampler();
+    sampler.type = type;
+    sampler.nsamples = max(1, nsamples);
+    sampler.seed = seed;
+    auto n = sampler.nsamples;
+    auto rng = std::mt19937(seed);
+    auto next = [&rng](){ return _to_float((uint32_t)rng()); };
+    int nx, ny;
+    _grid_size(n, nx, ny);
+    switch(type) {
+        case sampler_regular: {
+            // cells filled by columns, as the original nested loops
+            sampler.ntables = 1;
+            for(auto s : range(n)) sampler.tables.push_back(vec2f((s / ny + 0.5f) / nx, (s % ny + 0.5f) / ny));
+        } break;
+        case sampler_stratified: {
+            // when the grid has more cells than samples, each pattern uses a random subset
+            sampler.ntables = sampler_ntables;
+            auto cells = vector<int>(nx*ny);
+            for(auto t = 0; t < sampler.ntables; t ++) {
+                for(auto c : range(nx*ny)) cells[c] = c;
+                for(auto c = nx*ny - 1; c > 0; c --) std::swap(cells[c], cells[rng() % (c+1)]);
+                for(auto s : range(n)) {
+                    auto c = cells[s];
+                    sampler.tables.push_back(vec2f((c % nx + next()) / nx, (c / nx + next()) / ny));
+                }
+            }
+        } break;
+        case sampler_sobol: {
+            sampler.ntables = 0;
+            for(auto s : range(n)) { sampler.sobol.push_back(_sobol0(s)); sampler.sobol.push_back(_sobol1(s)); }
+        } break;
+        case sampler_halton: {
+            sampler.ntables = 0;
+        } break;
+        case sampler_bluenoise: {
+            // mitchell's best candidate on the torus, so that patterns tile without seams
+            sampler.ntables = sampler_ntables;
+            for(auto t = 0; t < sampler.ntables; t ++) {
+                auto start = (int)sampler.tables.size();
+                for(auto s : range(n)) {
+                    auto best = vec2f(next(), next());
+                    auto best_dist = 0.0f;
+                    auto ncandidates = min(8 * s + 1, 256);
+                    for(auto c = (s) ? ncandidates : 0; c > 0; c --) {
+                        auto candidate = vec2f(next(), next());
+                        auto dist = 2.0f;
+                        for(auto k : range(s)) dist = min(dist, _torus_dist2(candidate, sampler.tables[start+k]));
+                        if(dist > best_dist) { best = candidate; best_dist = dist; }
+                    }
+                    sampler.tables.push_back(best);
+                }
+            }
+        } break;
+    }
+    return sampler;
+}
+
+void PixelSampler::pixel_samples(int i, int j, vec2f* samples) const {
+    switch(type) {
+        case sampler_regular:
+        case sampler_stratified:
+        case sampler_bluenoise: {
+            auto t = (ntables > 1) ? _hash(i, j, 0, seed) % ntables : 0;
+            for(auto s : range(nsamples)) samples[s] = tables[t*nsamples + s];
+        } break;
+        case sampler_sobol: {
+            auto seed_x = _hash(i, j, 1, seed), seed_y = _hash(i, j, 2, seed);
+            for(auto s : range(nsamples))
+                samples[s] = vec2f(_to_float(_owen_scramble(sobol[2*s+0], seed_x)),
+                                   _to_float(_owen_scramble(sobol[2*s+1], seed_y)));
+        } break;
+        case sampler_halton: {
+            auto seed_x = _hash(i, j, 1, seed), seed_y = _hash(i, j, 2, seed);
+            for(auto s : range(nsamples))
+                samples[s] = vec2f(_to_float(_owen_scramble(_reverse_bits(s), seed_x)),
+                                   _halton3_scrambled(s, seed_y));
+        } break;
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef _SAMPLER_H_
+#define _SAMPLER_H_
+
+#include "common.h"
+#include "vmath.h"
+#include <cstdint>
+
+// sub-pixel sample patterns for anti-aliasing
+enum SamplerType {
+    sampler_regular,        // regular grid at the cell centers
+    sampler_stratified,     // one jittered sample per grid cell
+    sampler_sobol,          // sobol (0,2)-sequence, owen scrambled per pixel
+    sampler_halton,         // halton (bases 2,3), owen scrambled per pixel
+    sampler_bluenoise,      // tiles of best-candidate (blue noise) point sets
+};
+
+// sampler type from its name (regular, stratified, sobol, halton, bluenoise)
+SamplerType sampler_type(const string& name);
+
+// pixel sample generator. patterns that do not depend on the pixel are precomputed
+// into tables once per image and shared read-only by all threads; sobol and halton
+// points are scrambled per pixel on the fly. any number of samples is supported.
+struct PixelSampler {
+    SamplerType         type = sampler_regular;     // pattern
+    int                 nsamples = 1;               // samples per pixel
+    int                 ntables = 0;                // precomputed patterns
+    vector<vec2f>       tables;                     // ntables patterns of nsamples offsets
+    vector<uint32_t>    sobol;                      // unscrambled sobol points (2 per sample)
+    uint32_t            seed = 0;                   // scrambling seed
+
+    // writes the nsamples sub-pixel offsets (in [0,1)^2) of pixel (i,j) into samples
+    void pixel_samples(int i, int j, vec2f* samples) const;
+};
+
+// precomputes the tables of a sampler of nsamples per pixel
+PixelSampler make_pixel_sampler(SamplerType type, int nsamples, uint32_t seed = 0);
+
+#endif
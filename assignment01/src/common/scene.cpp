@@ -1,14 +1,49 @@
 #include "scene.h"
+#include "trace.h"
+#include "bvh.h"
+#include "grid.h"
+#include "outofcore.h"
+#include <cstring>
+
+// surfaces are freed with the arena blocks, without registering destructors
+static_assert(std::is_trivially_destructible<Surface>::value, "surfaces must be trivially destructible");
+
+
+Camera lookat_camera(vec3f eye, vec3f center, vec3f up, float width, float height, float dist) {
+    auto camera = Camera();
+    camera.frame = lookat_frame(eye, center, up, true);
+    camera.width = width;
+    camera.height = height;
+    camera.dist = dist;
+    camera.focus = length(eye-center);
+    return camera;
+}
 
+size_t MaterialTable::_Hash::operator()(const Material& material) const {
+    // fnv-1a over the bytes of the coefficients
+    auto bytes = (const unsigned char*)&material;
+    auto hash = (uint64_t)14695981039346656037ull;
+    for(auto i : range(sizeof(Material))) hash = (hash ^ bytes[i]) * 1099511628211ull;
+    return (size_t)hash;
+}
 
-Camera* lookat_camera(vec3f eye, vec3f center, vec3f up, float width, float height, float dist) {
-    auto camera = new Camera();
-    camera->frame = lookat_frame(eye, center, up, true);
-    camera->width = width;
-    camera->height = height;
-    camera->dist = dist;
-    camera->focus = length(eye-center);
-    return camera;
+bool MaterialTable::_Equal::operator()(const Material& a, const Material& b) const {
+    return memcmp(&a, &b, sizeof(Material)) == 0;
+}
+
+uint32_t MaterialTable::intern(const Material& material) {
+    auto it = _ids.find(material);
+    if(it != _ids.end()) return it->second;
+    auto id = (uint32_t)materials.size();
+    materials.push_back(material);
+    _ids[material] = id;
+    return id;
+}
+
+Scene::~Scene() {
+    delete bvh;
+    delete grid;
+    delete ooc;
 }
 
 void set_view_turntable(Camera* camera, float rotate_phi, float rotate_theta, float dolly, float pan_x, float pan_y) {
@@ -29,6 +64,36 @@ void set_view_turntable(Camera* camera, float rotate_phi, float rotate_theta, fl
     camera->frame.o += camera->frame.x * pan_x + camera->frame.y * pan_y;
 }
 
+void update_surface(Surface* surface) {
+    auto& f = surface->frame;
+    const auto eps = 1e-5f;
+    surface->radius2 = surface->radius * surface->radius;
+    // rotations (and reflections) map a sphere at the origin to the same sphere at f.o
+    surface->worldsphere = abs(dot(f.x,f.x)-1) < eps and abs(dot(f.y,f.y)-1) < eps and abs(dot(f.z,f.z)-1) < eps and
+                           abs(dot(f.x,f.y)) < eps and abs(dot(f.y,f.z)) < eps and abs(dot(f.z,f.x)) < eps;
+}
+
+void animate_scene(Scene* scene, float time) {
+    TRACE_SCOPE("animate_scene", "scene");
+    for(auto& animation : scene->animations) {
+        auto surface = scene->surfaces[animation.surface];
+        auto& times = animation.times;
+        auto& frames = animation.frames;
+        // hold the first and last keyframes outside of the animation range
+        if(time <= times.front()) { surface->frame = frames.front(); update_surface(surface); continue; }
+        if(time >= times.back()) { surface->frame = frames.back(); update_surface(surface); continue; }
+        auto k = 0;
+        while(time >= times[k+1]) k ++;
+        auto t = (time - times[k]) / (times[k+1] - times[k]);
+        auto frame = frame3f(frames[k].o*(1-t)+frames[k+1].o*t,
+                             frames[k].x*(1-t)+frames[k+1].x*t,
+                             frames[k].y*(1-t)+frames[k+1].y*t,
+                             frames[k].z*(1-t)+frames[k+1].z*t);
+        surface->frame = orthonormalize_zyx(frame);
+        update_surface(surface);
+    }
+}
+
 
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -99,17 +164,17 @@ void json_set_optvalue(const jsonvalue& json, T& value, const string& name) {
 
 
 
-Camera* json_parse_camera(const jsonvalue& json) {
-    auto camera = new Camera();
-    json_set_optvalue(json, camera->frame, "frame");
-    json_set_optvalue(json, camera->width, "width");
-    json_set_optvalue(json, camera->height, "height");
-    json_set_optvalue(json, camera->focus, "focus");
-    json_set_optvalue(json, camera->dist, "dist");
+Camera json_parse_camera(const jsonvalue& json) {
+    auto camera = Camera();
+    json_set_optvalue(json, camera.frame, "frame");
+    json_set_optvalue(json, camera.width, "width");
+    json_set_optvalue(json, camera.height, "height");
+    json_set_optvalue(json, camera.focus, "focus");
+    json_set_optvalue(json, camera.dist, "dist");
     return camera;
 }
 
-Camera* json_parse_lookatcamera(const jsonvalue& json) {
+Camera json_parse_lookatcamera(const jsonvalue& json) {
     auto from = z3f, to = zero3f, up = y3f;
     auto width = 1.0f, height = 1.0f, dist = 1.0f;
     json_set_optvalue(json, from, "from");
@@ -122,46 +187,64 @@ Camera* json_parse_lookatcamera(const jsonvalue& json) {
 }
 
 
-Material* json_parse_material(const jsonvalue& json) {
-    auto material = new Material();
-    json_set_optvalue(json, material->kd, "kd");
-    json_set_optvalue(json, material->ks, "ks");
-    json_set_optvalue(json, material->kr, "kr");
-    json_set_optvalue(json, material->n, "n");
+Material json_parse_material(const jsonvalue& json) {
+    auto material = Material();
+    json_set_optvalue(json, material.kd, "kd");
+    json_set_optvalue(json, material.ks, "ks");
+    json_set_optvalue(json, material.kr, "kr");
+    json_set_optvalue(json, material.n, "n");
     return material;
 }
 
 
-Surface* json_parse_surface(const jsonvalue& json) {
-    auto surface = new Surface();
+// parses a surface, and its keyframes into animation
+Surface* json_parse_surface(const jsonvalue& json, Arena& arena, MaterialTable& materials, SurfaceAnimation& animation) {
+    auto surface = arena.make<Surface>();
     json_set_optvalue(json, surface->frame, "frame");
     json_set_optvalue(json, surface->radius,"radius");
     json_set_optvalue(json, surface->isquad,"isquad");
-    if(json.object_contains("material")) surface->mat = json_parse_material(json.object_element("material"));
+    json_set_optvalue(json, surface->iscyl,"iscyl");
+    surface->material = materials.intern((json.object_contains("material")) ?
+                                         json_parse_material(json.object_element("material")) : Material());
+    if(json.object_contains("keyframes")) {
+        for(auto& value : json.object_element("keyframes").as_array_ref()) {
+            auto time = 0.0f; auto frame = surface->frame;
+            json_set_optvalue(value, time, "time");
+            json_set_optvalue(value, frame, "frame");
+            error_if_not(animation.times.empty() or time > animation.times.back(), "keyframe times must be increasing");
+            animation.times.push_back(time);
+            animation.frames.push_back(frame);
+        }
+    }
+    update_surface(surface);
     return surface;
 }
 
-vector<Surface*> json_parse_surfaces(const jsonvalue& json) {
+vector<Surface*> json_parse_surfaces(const jsonvalue& json, Arena& arena, MaterialTable& materials, vector<SurfaceAnimation>& animations) {
     auto surfaces = vector<Surface*>();
-    for(auto value : json.as_array_ref())
-        surfaces.push_back( json_parse_surface(value) );
+    for(auto& value : json.as_array_ref()) {
+        auto animation = SurfaceAnimation();
+        animation.surface = (int)surfaces.size();
+        surfaces.push_back( json_parse_surface(value, arena, materials, animation) );
+        if(not animation.times.empty()) animations.push_back(std::move(animation));
+    }
     return surfaces;
 }
 
 
 
 
-Light* json_parse_light(const jsonvalue& json) {
-    auto light = new Light();
+Light* json_parse_light(const jsonvalue& json, Arena& arena) {
+    auto light = arena.make<Light>();
     json_set_optvalue(json, light->frame, "frame");
     json_set_optvalue(json, light->intensity, "intensity");
     return light;
 }
 
-vector<Light*> json_parse_lights(const jsonvalue& json) {
+vector<Light*> json_parse_lights(const jsonvalue& json, Arena& arena) {
     auto lights = vector<Light*>();
     for(auto& value : json.as_array_ref())
-        lights.push_back( json_parse_light(value) );
+        lights.push_back( json_parse_light(value, arena) );
     return lights;
 }
 
@@ -170,46 +253,322 @@ Scene* json_parse_scene(const jsonvalue& json) {
     // prepare scene
     auto scene = new Scene();
     // camera
-    if (json.object_contains("camera")) scene->camera = json_parse_camera(json.object_element("camera"));
-    if (json.object_contains("lookat_camera")) scene->camera = json_parse_lookatcamera(json.object_element("lookat_camera"));
+    if (json.object_contains("camera")) *scene->camera = json_parse_camera(json.object_element("camera"));
+    if (json.object_contains("lookat_camera"))
+        *scene->camera = json_parse_lookatcamera(json.object_element("lookat_camera"));
     // surfaces
-    if(json.object_contains("surfaces")) scene->surfaces = json_parse_surfaces(json.object_element("surfaces"));
+    if(json.object_contains("surfaces")) scene->surfaces = json_parse_surfaces(json.object_element("surfaces"), scene->arena, scene->materials, scene->animations);
     // lights
-    if(json.object_contains("lights")) scene->lights = json_parse_lights(json.object_element("lights"));
+    if(json.object_contains("lights")) scene->lights = json_parse_lights(json.object_element("lights"), scene->arena);
     // rendering parameters
     json_set_optvalue(json, scene->image_width, "image_width");
     json_set_optvalue(json, scene->image_height, "image_height");
     json_set_optvalue(json, scene->image_samples, "image_samples");
+    if(json.object_contains("sampler")) scene->sampler = json.object_element("sampler").as_string();
+    json_set_optvalue(json, scene->pixel_samples, "pixel_samples");
+    if(json.object_contains("filter")) scene->filter = json.object_element("filter").as_string();
+    json_set_optvalue(json, scene->filter_radius, "filter_radius");
+    json_set_optvalue(json, scene->stream_rays, "stream_rays");
+    json_set_optvalue(json, scene->cull_tiles, "cull_tiles");
+    if(json.object_contains("accelerator")) scene->accelerator = json.object_element("accelerator").as_string();
+    json_set_optvalue(json, scene->lbvh_refine, "lbvh_refine");
+    json_set_optvalue(json, scene->oversized_fraction, "oversized_fraction");
     json_set_optvalue(json, scene->background, "background");
     json_set_optvalue(json, scene->ambient, "ambient");
+    // animation
+    json_set_optvalue(json, scene->animation_frames, "animation_frames");
     // done
     return scene;
 }
 
 Scene* load_json_scene(const string& filename) {
+    TRACE_SCOPE("load_json_scene", "scene");
     auto scene = json_parse_scene(load_json(filename));
     return scene;
 }
 
+// json output, surfaces one per line
+static void _json_write(FILE* f, const vec3f& v) { fprintf(f, "[%.9g,%.9g,%.9g]", v.x, v.y, v.z); }
+static void _json_write(FILE* f, const frame3f& frame) {
+    fprintf(f, "{ \"o\": "); _json_write(f, frame.o);
+    fprintf(f, ", \"x\": "); _json_write(f, frame.x);
+    fprintf(f, ", \"y\": "); _json_write(f, frame.y);
+    fprintf(f, ", \"z\": "); _json_write(f, frame.z);
+    fprintf(f, " }");
+}
+
+// index in scene->animations of the keyframes of each surface (-1 if not animated)
+static vector<int> _surface_animations(Scene* scene) {
+    auto ids = vector<int>(scene->surfaces.size(), -1);
+    for(auto a : range(scene->animations.size())) ids[scene->animations[a].surface] = a;
+    return ids;
+}
+
+void save_json_scene(const string& filename, Scene* scene) {
+    TRACE_SCOPE("save_json_scene", "scene");
+    auto f = fopen(filename.c_str(), "w");
+    error_if_not(f, "cannot open file: %s\n", filename.c_str());
+    fprintf(f, "{\n    \"camera\": { \"frame\": "); _json_write(f, scene->camera->frame);
+    fprintf(f, ", \"width\": %.9g, \"height\": %.9g, \"dist\": %.9g, \"focus\": %.9g },\n",
+            scene->camera->width, scene->camera->height, scene->camera->dist, scene->camera->focus);
+    fprintf(f, "    \"image_width\": %d, \"image_height\": %d, \"image_samples\": %d,\n",
+            scene->image_width, scene->image_height, scene->image_samples);
+    if(scene->stream_rays) fprintf(f, "    \"stream_rays\": true,\n");
+    if(scene->cull_tiles) fprintf(f, "    \"cull_tiles\": true,\n");
+    if(scene->accelerator != "bvh") fprintf(f, "    \"accelerator\": \"%s\",\n", scene->accelerator.c_str());
+    if(scene->lbvh_refine) fprintf(f, "    \"lbvh_refine\": %d,\n", scene->lbvh_refine);
+    if(scene->oversized_fraction != 0.5f) fprintf(f, "    \"oversized_fraction\": %.9g,\n", scene->oversized_fraction);
+    if(scene->sampler != "regular") fprintf(f, "    \"sampler\": \"%s\",\n", scene->sampler.c_str());
+    if(scene->pixel_samples) fprintf(f, "    \"pixel_samples\": %d,\n", scene->pixel_samples);
+    if(scene->filter != "none") fprintf(f, "    \"filter\": \"%s\",\n", scene->filter.c_str());
+    if(scene->filter_radius) fprintf(f, "    \"filter_radius\": %.9g,\n", scene->filter_radius);
+    if(scene->animation_frames) fprintf(f, "    \"animation_frames\": %d,\n", scene->animation_frames);
+    fprintf(f, "    \"background\": "); _json_write(f, scene->background);
+    fprintf(f, ",\n    \"ambient\": "); _json_write(f, scene->ambient);
+    fprintf(f, ",\n    \"surfaces\": [\n");
+    auto animation_ids = _surface_animations(scene);
+    for(auto i : range(scene->surfaces.size())) {
+        auto surface = scene->surfaces[i];
+        fprintf(f, "        { \"frame\": "); _json_write(f, surface->frame);
+        fprintf(f, ", \"radius\": %.9g", surface->radius);
+        if(surface->isquad) fprintf(f, ", \"isquad\": true");
+        if(surface->iscyl) fprintf(f, ", \"iscyl\": true");
+        auto& material = scene->materials[surface->material];
+        fprintf(f, ", \"material\": { \"kd\": "); _json_write(f, material.kd);
+        fprintf(f, ", \"ks\": "); _json_write(f, material.ks);
+        fprintf(f, ", \"kr\": "); _json_write(f, material.kr);
+        fprintf(f, ", \"n\": %.9g }", material.n);
+        if(animation_ids[i] >= 0) {
+            auto& animation = scene->animations[animation_ids[i]];
+            fprintf(f, ", \"keyframes\": [");
+            for(auto k : range(animation.times.size())) {
+                fprintf(f, "%s{ \"time\": %.9g, \"frame\": ", (k) ? ", " : "", animation.times[k]);
+                _json_write(f, animation.frames[k]);
+                fprintf(f, " }");
+            }
+            fprintf(f, "]");
+        }
+        fprintf(f, " }%s\n", (i+1 < (int)scene->surfaces.size()) ? "," : "");
+    }
+    fprintf(f, "    ],\n    \"lights\": [\n");
+    for(auto i : range(scene->lights.size())) {
+        fprintf(f, "        { \"frame\": "); _json_write(f, scene->lights[i]->frame);
+        fprintf(f, ", \"intensity\": "); _json_write(f, scene->lights[i]->intensity);
+        fprintf(f, " }%s\n", (i+1 < (int)scene->lights.size()) ? "," : "");
+    }
+    fprintf(f, "    ]\n}\n");
+    fclose(f);
+}
+
+// binary scenes store the same data as json scenes in native layout and endianness:
+// magic, camera, rendering parameters, the table of the (shared) materials, lights,
+// and the surfaces with their material index and keyframes. version 1 files (without
+// the sampler, filter and accelerator settings) are still read.
+#define scene_bin_magic "RTSCENE2"
+#define scene_bin_magic_v1 "RTSCENE1"
+
+// surface record of binary scenes
+struct _BinSurface {
+    frame3f     frame;          // frame
+    float       radius = 1;     // radius
+    int         material = 0;   // index in the material table
+    int         flags = 0;      // 1 for quads, 2 for cylinders
+    int         nkeys = 0;      // keyframes (stored after the record)
+};
+
+template<typename T>
+static void _bin_write(FILE* f, const T* values, size_t n = 1) {
+    error_if_not(fwrite(values, sizeof(T), n, f) == n, "cannot write binary scene\n");
+}
+template<typename T>
+static void _bin_read(FILE* f, T* values, size_t n = 1) {
+    error_if_not(fread(values, sizeof(T), n, f) == n, "truncated binary scene\n");
+}
+// strings are stored as their length followed by their characters
+static void _bin_write(FILE* f, const string& str) {
+    auto n = (int)str.size();
+    _bin_write(f, &n); _bin_write(f, str.data(), n);
+}
+static void _bin_read(FILE* f, string& str) {
+    auto n = 0;
+    _bin_read(f, &n);
+    error_if_not(n >= 0 and n < 4096, "corrupt binary scene\n");
+    str.resize(n);
+    if(n) _bin_read(f, &str[0], n);
+}
+// checks that count records of record_size bytes fit in the rest of the file
+static void _bin_check_count(FILE* f, long long size, long long count, size_t record_size) {
+    error_if_not(count >= 0 and count <= (size - ftell(f)) / (long long)record_size, "corrupt binary scene\n");
+}
+
+void save_bin_scene(const string& filename, Scene* scene) {
+    TRACE_SCOPE("save_bin_scene", "scene");
+    auto f = fopen(filename.c_str(), "wb");
+    error_if_not(f, "cannot open file: %s\n", filename.c_str());
+    _bin_write(f, scene_bin_magic, 8);
+    _bin_write(f, &scene->camera->frame);
+    float camera_params[4] = { scene->camera->width, scene->camera->height, scene->camera->dist, scene->camera->focus };
+    _bin_write(f, camera_params, 4);
+    int params[5] = { scene->image_width, scene->image_height, scene->image_samples, scene->stream_rays, scene->animation_frames };
+    _bin_write(f, params, 5);
+    _bin_write(f, &scene->background);
+    _bin_write(f, &scene->ambient);
+    // sampling and acceleration settings
+    int settings[3] = { scene->pixel_samples, scene->cull_tiles, scene->lbvh_refine };
+    _bin_write(f, settings, 3);
+    float fsettings[2] = { scene->filter_radius, scene->oversized_fraction };
+    _bin_write(f, fsettings, 2);
+    _bin_write(f, scene->sampler); _bin_write(f, scene->filter); _bin_write(f, scene->accelerator);
+    // the material table, indexed by the surfaces
+    auto nmaterials = scene->materials.size();
+    _bin_write(f, &nmaterials);
+    for(auto& material : scene->materials.materials) {
+        _bin_write(f, &material.kd); _bin_write(f, &material.ks);
+        _bin_write(f, &material.kr); _bin_write(f, &material.n);
+    }
+    auto nlights = (int)scene->lights.size();
+    _bin_write(f, &nlights);
+    for(auto light : scene->lights) { _bin_write(f, &light->frame); _bin_write(f, &light->intensity); }
+    auto nsurfaces = (long long)scene->surfaces.size();
+    _bin_write(f, &nsurfaces);
+    auto animation_ids = _surface_animations(scene);
+    for(auto i : range(scene->surfaces.size())) {
+        auto surface = scene->surfaces[i];
+        auto animation = (animation_ids[i] >= 0) ? &scene->animations[animation_ids[i]] : nullptr;
+        auto record = _BinSurface();
+        record.frame = surface->frame;
+        record.radius = surface->radius;
+        record.material = surface->material;
+        record.flags = ((surface->isquad) ? 1 : 0) | ((surface->iscyl) ? 2 : 0);
+        record.nkeys = (animation) ? (int)animation->times.size() : 0;
+        _bin_write(f, &record);
+        if(record.nkeys) { _bin_write(f, animation->times.data(), record.nkeys); _bin_write(f, animation->frames.data(), record.nkeys); }
+    }
+    error_if_not(fclose(f) == 0, "cannot write file: %s\n", filename.c_str());
+}
+
+Scene* load_bin_scene(const string& filename, bool load_surfaces) {
+    TRACE_SCOPE("load_bin_scene", "scene");
+    auto f = fopen(filename.c_str(), "rb");
+    error_if_not(f, "cannot open file: %s\n", filename.c_str());
+    fseek(f, 0, SEEK_END);
+    auto size = (long long)ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char magic[8];
+    _bin_read(f, magic, 8);
+    auto version = (string(magic,8) == scene_bin_magic) ? 2 : (string(magic,8) == scene_bin_magic_v1) ? 1 : 0;
+    error_if_not(version, "not a binary scene: %s\n", filename.c_str());
+    auto scene = new Scene();
+    // frames are orthonormalized as in json scenes, so both formats render the same
+    _bin_read(f, &scene->camera->frame);
+    scene->camera->frame = orthonormalize_zyx(scene->camera->frame);
+    float camera_params[4];
+    _bin_read(f, camera_params, 4);
+    scene->camera->width = camera_params[0]; scene->camera->height = camera_params[1];
+    scene->camera->dist = camera_params[2]; scene->camera->focus = camera_params[3];
+    int params[5];
+    _bin_read(f, params, 5);
+    scene->image_width = params[0]; scene->image_height = params[1]; scene->image_samples = params[2];
+    scene->stream_rays = params[3]; scene->animation_frames = params[4];
+    _bin_read(f, &scene->background);
+    _bin_read(f, &scene->ambient);
+    if(version >= 2) {
+        int settings[3];
+        _bin_read(f, settings, 3);
+        scene->pixel_samples = settings[0]; scene->cull_tiles = settings[1]; scene->lbvh_refine = settings[2];
+        float fsettings[2];
+        _bin_read(f, fsettings, 2);
+        scene->filter_radius = fsettings[0]; scene->oversized_fraction = fsettings[1];
+        _bin_read(f, scene->sampler); _bin_read(f, scene->filter); _bin_read(f, scene->accelerator);
+    }
+    auto nmaterials = 0;
+    _bin_read(f, &nmaterials);
+    _bin_check_count(f, size, nmaterials, sizeof(vec3f)*3+sizeof(float));
+    // ids in the file are remapped, since files written by other tools may repeat materials
+    auto materials = vector<uint32_t>(nmaterials);
+    for(auto& id : materials) {
+        auto material = Material();
+        _bin_read(f, &material.kd); _bin_read(f, &material.ks);
+        _bin_read(f, &material.kr); _bin_read(f, &material.n);
+        id = scene->materials.intern(material);
+    }
+    auto nlights = 0;
+    _bin_read(f, &nlights);
+    _bin_check_count(f, size, nlights, sizeof(frame3f)+sizeof(vec3f));
+    for(auto n = 0; n < nlights; n ++) {
+        auto light = scene->arena.make<Light>();
+        _bin_read(f, &light->frame); _bin_read(f, &light->intensity);
+        light->frame = orthonormalize_zyx(light->frame);
+        scene->lights.push_back(light);
+    }
+    auto nsurfaces = 0ll;
+    _bin_read(f, &nsurfaces);
+    _bin_check_count(f, size, nsurfaces, sizeof(_BinSurface));
+    if(not load_surfaces) nsurfaces = 0;
+    scene->surfaces.reserve(nsurfaces);
+    for(auto i = 0ll; i < nsurfaces; i ++) {
+        auto record = _BinSurface();
+        _bin_read(f, &record);
+        error_if_not(record.material >= 0 and record.material < nmaterials, "bad material index in binary scene\n");
+        auto surface = scene->arena.make<Surface>();
+        surface->frame = orthonormalize_zyx(record.frame);
+        surface->radius = record.radius;
+        surface->material = materials[record.material];
+        surface->isquad = record.flags & 1;
+        surface->iscyl = record.flags & 2;
+        _bin_check_count(f, size, record.nkeys, sizeof(float)+sizeof(frame3f));
+        if(record.nkeys) {
+            auto animation = SurfaceAnimation();
+            animation.surface = (int)scene->surfaces.size();
+            animation.times.resize(record.nkeys); animation.frames.resize(record.nkeys);
+            _bin_read(f, animation.times.data(), record.nkeys); _bin_read(f, animation.frames.data(), record.nkeys);
+            for(auto& frame : animation.frames) frame = orthonormalize_zyx(frame);
+            scene->animations.push_back(std::move(animation));
+        }
+        update_surface(surface);
+        scene->surfaces.push_back(surface);
+    }
+    fclose(f);
+    return scene;
+}
+
+// whether filename ends with ext
+static bool _has_extension(const string& filename, const string& ext) {
+    return filename.size() >= ext.size() and filename.substr(filename.size()-ext.size()) == ext;
+}
+
+Scene* load_scene(const string& filename, bool load_surfaces) {
+    if(_has_extension(filename, ".bscene")) return load_bin_scene(filename, load_surfaces);
+    // json scenes are small enough to be parsed whole
+    auto scene = load_json_scene(filename);
+    if(not load_surfaces) scene->surfaces.clear();
+    return scene;
+}
+
+void save_scene(const string& filename, Scene* scene) {
+    if(_has_extension(filename, ".bscene")) save_bin_scene(filename, scene);
+    else save_json_scene(filename, scene);
+}
+
 Scene* create_test_scene_sphere() {
-    auto camera            = new Camera();
+    auto scene             = new Scene();
+    auto camera            = scene->camera;
     camera->frame          = frame3f(z3f*2.5,x3f,y3f,z3f);
     
-    auto light_point       = new Light();
+    auto light_point       = scene->arena.make<Light>();
     light_point->frame     = frame3f(z3f*5,x3f,y3f,z3f);
     light_point->intensity = one3f*10;
     
-    auto surf_sphere       = new Surface();
-    surf_sphere->mat       = new Material();
-    surf_sphere->mat->n    = 100;
+    auto surf_sphere       = scene->arena.make<Surface>();
+    auto surf_sphere_mat   = Material();
+    surf_sphere_mat.n      = 100;
+    surf_sphere->material  = scene->materials.intern(surf_sphere_mat);
     
-    auto scene             = new Scene();
     scene->background      = one3f*0.2;
     scene->ambient         = one3f*0.2;
     scene->image_width     = 512;
     scene->image_height    = 512;
     scene->image_samples   = 1;
-    scene->camera          = camera;
     scene->surfaces        = { surf_sphere };
     scene->lights          = { light_point };
     
@@ -218,40 +577,41 @@ Scene* create_test_scene_sphere() {
 
 Scene* create_test_scene_sphereplane() {
     // sphere, plane, and shadows
-    auto camera            = new Camera();
+    auto scene             = new Scene();
+    auto camera            = scene->camera;
     camera->frame          = frame3f(z3f*4,x3f,y3f,z3f);
     
-    auto light_point       = new Light();
+    auto light_point       = scene->arena.make<Light>();
     light_point->frame     = frame3f({6,12,6},x3f,y3f,z3f);
     light_point->intensity = one3f*100;
     
-    auto surf_plane        = new Surface();
+    auto surf_plane        = scene->arena.make<Surface>();
     surf_plane->frame      = frame3f(-y3f,x3f,-z3f,y3f);
     surf_plane->radius     = 100;
     surf_plane->isquad     = true;
-    surf_plane->mat        = new Material();
-    surf_plane->mat->kd    = one3f;
-    surf_plane->mat->ks    = zero3f;
-    surf_plane->mat->n     = 100;
-    surf_plane->mat->kr    = zero3f;
+    auto surf_plane_mat    = Material();
+    surf_plane_mat.kd      = one3f;
+    surf_plane_mat.ks      = zero3f;
+    surf_plane_mat.n       = 100;
+    surf_plane_mat.kr      = zero3f;
+    surf_plane->material   = scene->materials.intern(surf_plane_mat);
     
-    auto surf_sphere       = new Surface();
+    auto surf_sphere       = scene->arena.make<Surface>();
     surf_sphere->frame     = identity_frame3f;
     surf_sphere->radius    = 1;
     surf_sphere->isquad    = false;
-    surf_sphere->mat       = new Material();
-    surf_sphere->mat->kd   = {1,0.75,0.75};
-    surf_sphere->mat->ks   = zero3f;
-    surf_sphere->mat->n    = 100;
-    surf_sphere->mat->kr   = zero3f;
+    auto surf_sphere_mat   = Material();
+    surf_sphere_mat.kd     = {1,0.75,0.75};
+    surf_sphere_mat.ks     = zero3f;
+    surf_sphere_mat.n      = 100;
+    surf_sphere_mat.kr     = zero3f;
+    surf_sphere->material  = scene->materials.intern(surf_sphere_mat);
     
-    auto scene             = new Scene();
     scene->background      = one3f*0.2;
     scene->ambient         = one3f*0.2;
     scene->image_width     = 512;
     scene->image_height    = 512;
     scene->image_samples   = 1;
-    scene->camera          = camera;
     scene->surfaces        = { surf_plane, surf_sphere };
     scene->lights          = { light_point };
     
@@ -260,22 +620,24 @@ Scene* create_test_scene_sphereplane() {
 
 Scene* create_test_scene_cyl() {
     // sphere, plane, and shadows
-    auto camera            = new Camera();
+    auto scene             = new Scene();
+    auto camera            = scene->camera;
     camera->frame          = frame3f(z3f*4,x3f,y3f,z3f);
 
-    auto light_point       = new Light();
+    auto light_point       = scene->arena.make<Light>();
     light_point->frame     = frame3f({6,12,6},x3f,y3f,z3f);
     light_point->intensity = one3f*100;
 
-    auto surf_plane        = new Surface();
+    auto surf_plane        = scene->arena.make<Surface>();
     surf_plane->frame      = frame3f(-y3f,x3f,-z3f,y3f);
     surf_plane->radius     = 100;
     surf_plane->isquad     = true;
-    surf_plane->mat        = new Material();
-    surf_plane->mat->kd    = one3f;
-    surf_plane->mat->ks    = zero3f;
-    surf_plane->mat->n     = 100;
-    surf_plane->mat->kr    = zero3f;
+    auto surf_plane_mat    = Material();
+    surf_plane_mat.kd      = one3f;
+    surf_plane_mat.ks      = zero3f;
+    surf_plane_mat.n       = 100;
+    surf_plane_mat.kr      = zero3f;
+    surf_plane->material   = scene->materials.intern(surf_plane_mat);
 
 //    auto surf_sphere       = new Surface();
 //    surf_sphere->frame     = identity_frame3f;
@@ -288,24 +650,23 @@ Scene* create_test_scene_cyl() {
 //    surf_sphere->mat->n    = 100;
 //    surf_sphere->mat->kr   = zero3f;
 
-    auto surf_cyl          = new Surface();
+    auto surf_cyl          = scene->arena.make<Surface>();
     surf_cyl->frame     = identity_frame3f;
     surf_cyl->radius    = 1;
     surf_cyl->isquad    = false;
     surf_cyl->iscyl     = true;
-    surf_cyl->mat       = new Material();
-    surf_cyl->mat->kd   = {1,0.75,0.75};
-    surf_cyl->mat->ks   = zero3f;
-    surf_cyl->mat->n    = 100;
-    surf_cyl->mat->kr   = zero3f;
+    auto surf_cyl_mat      = Material();
+    surf_cyl_mat.kd        = {1,0.75,0.75};
+    surf_cyl_mat.ks        = zero3f;
+    surf_cyl_mat.n         = 100;
+    surf_cyl_mat.kr        = zero3f;
+    surf_cyl->material     = scene->materials.intern(surf_cyl_mat);
 
-    auto scene             = new Scene();
     scene->background      = one3f*0.2;
     scene->ambient         = one3f*0.2;
     scene->image_width     = 512;
     scene->image_height    = 512;
     scene->image_samples   = 1;
-    scene->camera          = camera;
     scene->surfaces        = { surf_plane, surf_cyl };
     scene->lights          = { light_point };
 
@@ -313,12 +674,14 @@ Scene* create_test_scene_cyl() {
 }
 
 Scene* create_test_scene(int scene_type) {
+    Scene* scene = nullptr;
     switch(scene_type) {
-        case 0: return create_test_scene_sphere();
-        case 1: return create_test_scene_sphereplane();
-        case 2: return create_test_scene_cyl();
+        case 0: scene = create_test_scene_sphere(); break;
+        case 1: scene = create_test_scene_sphereplane(); break;
+        case 2: scene = create_test_scene_cyl(); break;
+        default: error("unknown test scene type %d\n", scene_type); return nullptr;
     }
-    error("unknown test scene type %d\n", scene_type);
-    return nullptr;
+    for(auto surface : scene->surfaces) update_surface(surface);
+    return scene;
 }
 
@@ -5,7 +5,12 @@
 #include "json.h"
 #include "vmath.h"
 #include "image.h"
+#include "arena.h"
+#include <unordered_map>
 
+struct BVH;
+struct Grid;
+struct OutOfCore;
 
 // blinn-phong material
 // textures are scaled by the respective coefficient and may be missing
@@ -17,18 +22,47 @@ struct Material {
     
 };
 
+// dense table of the distinct materials of a scene, indexed by the material ids of the
+// surfaces; materials with the same kd, ks, n and kr are stored once
+struct MaterialTable {
+    vector<Material>    materials;          // distinct materials
+
+    // id of material, adding it to the table if not already there
+    uint32_t intern(const Material& material);
+
+    Material& operator[](uint32_t id) { return materials[id]; }
+    const Material& operator[](uint32_t id) const { return materials[id]; }
+    int size() const { return (int)materials.size(); }
+
+private:
+    // materials are compared bitwise
+    struct _Hash { size_t operator()(const Material& material) const; };
+    struct _Equal { bool operator()(const Material& a, const Material& b) const; };
+    std::unordered_map<Material,uint32_t,_Hash,_Equal> _ids;
+};
+
 
 // surface made of either a sphere or a quad (as determined by
 // isquad. the sphere is centered frame.o with radius radius.
 // the quad is at frame.o with normal frame.z and axes frame.x, frame.y.
-// the quad side is 2*radius.
+// the quad side is 2*radius. surfaces are trivially destructible, so that the
+// scene arena frees them without running destructors; the keyframes of animated
+// surfaces are kept in the scene animations instead.
 struct Surface {
     frame3f     frame = identity_frame3f;   // frame
     float       radius = 1;                 // radius
     bool        isquad = false;             // whether it's a quad
-    Material*   mat = new Material();       // material
+    uint32_t    material = 0;               // material id in the scene material table
     bool        iscyl = false;
-    
+    float       radius2 = 1;                // radius squared (cached by update_surface)
+    bool        worldsphere = true;         // whether the frame is orthonormal (cached by update_surface)
+};
+
+// keyframes of an animated surface
+struct SurfaceAnimation {
+    int             surface = 0;            // index of the surface in the scene
+    vector<float>   times;                  // keyframe times in frames (increasing)
+    vector<frame3f> frames;                 // frames at the keyframe times
 };
 
 // point light at frame.o with intensity intensity
@@ -56,12 +90,23 @@ struct Camera {
 // if a ray misses) the ambient illumination, the
 // image resolution (image_width, image_height) and
 // the samples per pixel (image_samples).
+//
+// the camera, lights and surfaces are allocated in the scene arena and freed
+// with the scene; the surfaces refer to the materials by id. loaders fill the
+// default camera in place.
 struct Scene {
-    Camera*             camera = new Camera();  // camera
+    Arena               arena;                  // storage of the scene objects
+    Camera*             camera = arena.make<Camera>();  // camera
     
     int                 image_width = 512;      // image resolution in x
     int                 image_height = 512;     // image resolution in y
     int                 image_samples = 1;      // samples per pixels in each direction
+    string              sampler = "regular";    // sample pattern (regular, stratified, sobol, halton, bluenoise)
+    int                 pixel_samples = 0;      // samples per pixel with the sampler (0 for image_samples^2)
+    string              filter = "none";        // reconstruction filter (none, box, gaussian, mitchell, blackmanharris)
+    float               filter_radius = 0;      // filter radius in pixels (0 for the filter default)
+    bool                stream_rays = false;    // trace rays in sorted batches per tile (wavefront)
+    bool                cull_tiles = false;     // test the camera rays of a tile only against the surfaces projected onto it
     
     vector<Light*>      lights;                 // lights
     
@@ -69,20 +114,52 @@ struct Scene {
     vec3f               ambient = one3f*0.2;    // ambient illumination
     
     vector<Surface*>    surfaces;               // surfaces
+    MaterialTable       materials;              // materials of the surfaces
     
+    int                 animation_frames = 0;   // frames in the animation (0 for a still image)
+    vector<SurfaceAnimation> animations;        // keyframes of the animated surfaces, by surface index
     
-    
+    string              accelerator = "bvh";    // acceleration structure (bvh, bvh2, bvhq, lbvh, grid or none)
+    int                 lbvh_refine = 0;        // lbvh top levels refined by sah treelet restructuring (0 for none)
+    float               oversized_fraction = 0.5f; // surfaces larger than this fraction of the scene are kept out of the accelerator (0 for none)
+    vector<int>         oversized;              // surfaces tested by every ray instead of through the accelerator
+    BVH*                bvh = nullptr;          // bvh (if built)
+    Grid*               grid = nullptr;         // uniform grid (if built)
+    float               accelerator_build_time = 0; // seconds taken by the last accelerator build
+    OutOfCore*          ooc = nullptr;          // out-of-core geometry paged from disk (replaces surfaces and accelerator)
+
+    // frees the acceleration structures and the scene objects
+    ~Scene();
 };
 
 
 // create a Camera at eye, pointing towards center with up vector up, and with specified image plane params
-Camera* lookat_camera(vec3f eye, vec3f center, vec3f up, float width, float height, float dist);
+Camera lookat_camera(vec3f eye, vec3f center, vec3f up, float width, float height, float dist);
 
 // set camera view with a "turntable" modification
 void set_view_turntable(Camera* camera, float rotate_phi, float rotate_theta, float dolly, float pan_x, float pan_y);
 
+// update the values cached in a surface after changing its frame or radius
+void update_surface(Surface* surface);
+
+// set the frames of the animated surfaces by interpolating their keyframes at time (in frames)
+void animate_scene(Scene* scene, float time);
+
 // load a scene from a json file
 Scene* load_json_scene(const string& filename);
+// save a scene as a json file
+void save_json_scene(const string& filename, Scene* scene);
+
+// load a scene from a binary file (compact, for large scenes), skipping the surfaces
+// if not load_surfaces (for scenes whose geometry is out-of-core)
+Scene* load_bin_scene(const string& filename, bool load_surfaces = true);
+// save a scene as a binary file; materials shared by surfaces are stored once
+void save_bin_scene(const string& filename, Scene* scene);
+
+// load a scene from a .bscene binary file or a json file, with its surfaces if load_surfaces
+Scene* load_scene(const string& filename, bool load_surfaces = true);
+// save a scene as a .bscene binary file or a json file
+void save_scene(const string& filename, Scene* scene);
 
 // create test scenes that do not need to be loaded from a file
 Scene* create_test_scene(int scene_type);
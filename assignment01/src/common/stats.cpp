@@ -0,0 +1,107 @@
+#include "stats.h"
+
+#include <mutex>
+
+thread_local RayStats* _stats_thread = nullptr;
+
+static RayStats _stats_total;
+static std::mutex _stats_mutex;
+
+RayStats& operator+=(RayStats& a, const RayStats& b) {
+    a.camera_rays += b.camera_rays;
+    a.shadow_rays += b.shadow_rays;
+    a.reflection_rays += b.reflection_rays;
+    a.max_depth = (a.max_depth > b.max_depth) ? a.max_depth : b.max_depth;
+    a.sphere_tests += b.sphere_tests;
+    a.sphere_hits += b.sphere_hits;
+    a.quad_tests += b.quad_tests;
+    a.quad_hits += b.quad_hits;
+    a.cylinder_tests += b.cylinder_tests;
+    a.cylinder_hits += b.cylinder_hits;
+    a.node_visits += b.node_visits;
+    a.primitives = (a.primitives > b.primitives) ? a.primitives : b.primitives;
+    a.oversized = (a.oversized > b.oversized) ? a.oversized : b.oversized;
+    a.accel_bytes = (a.accel_bytes > b.accel_bytes) ? a.accel_bytes : b.accel_bytes;
+    a.accel_build_usec = (a.accel_build_usec > b.accel_build_usec) ? a.accel_build_usec : b.accel_build_usec;
+    a.page_lookups += b.page_lookups;
+    a.page_loads += b.page_loads;
+    a.page_bytes_read += b.page_bytes_read;
+    return a;
+}
+
+void stats_accumulate(const RayStats& stats) {
+    std::lock_guard<std::mutex> lock(_stats_mutex);
+    _stats_total += stats;
+}
+
+RayStats stats_total() {
+    std::lock_guard<std::mutex> lock(_stats_mutex);
+    return _stats_total;
+}
+
+// hit ratio in percent
+static double _hit_ratio(uint64_t hits, uint64_t tests) { return (tests) ? 100.0 * hits / tests : 0; }
+
+void print_stats(const RayStats& stats, double seconds) {
+    message("ray stats:\n");
+    message("    %-20s %16llu\n", "camera rays", (unsigned long long)stats.camera_rays);
+    message("    %-20s %16llu\n", "shadow rays", (unsigned long long)stats.shadow_rays);
+    message("    %-20s %16llu\n", "reflection rays", (unsigned long long)stats.reflection_rays);
+    message("    %-20s %16llu\n", "total rays", (unsigned long long)stats.rays());
+    message("    %-20s %16llu\n", "max depth", (unsigned long long)stats.max_depth);
+    message("    %-20s %16.3f\n", "avg depth", stats.avg_depth());
+    if(seconds > 0) message("    %-20s %16.0f\n", "rays/sec", stats.rays() / seconds);
+    message("    %-20s %16llu\n", "node visits", (unsigned long long)stats.node_visits);
+    message("    %-20s %16.3f\n", "node visits/ray", (stats.rays()) ? (double)stats.node_visits / stats.rays() : 0.0);
+    message("    %-20s %16llu\n", "primitives", (unsigned long long)stats.primitives);
+    message("    %-20s %16llu\n", "oversized prims", (unsigned long long)stats.oversized);
+    message("    %-20s %16llu\n", "accel bytes", (unsigned long long)stats.accel_bytes);
+    message("    %-20s %16.2f\n", "accel bytes/prim", stats.accel_bytes_per_primitive());
+    message("    %-20s %16.3f\n", "accel build ms", stats.accel_build_usec / 1e3);
+    message("    %-20s %16.3f\n", "build ms/Mprim", stats.accel_build_ms_per_mprim());
+    if(stats.page_lookups) {
+        message("    %-20s %16llu\n", "page lookups", (unsigned long long)stats.page_lookups);
+        message("    %-20s %16llu\n", "page loads", (unsigned long long)stats.page_loads);
+        message("    %-20s %16.2f\n", "page hit %", stats.page_hit_rate());
+        message("    %-20s %16llu\n", "page bytes read", (unsigned long long)stats.page_bytes_read);
+    }
+    message("    %-20s %16s %16s %8s\n", "primitive", "tests", "hits", "hit %");
+    message("    %-20s %16llu %16llu %8.2f\n", "sphere", (unsigned long long)stats.sphere_tests,
+            (unsigned long long)stats.sphere_hits, _hit_ratio(stats.sphere_hits, stats.sphere_tests));
+    message("    %-20s %16llu %16llu %8.2f\n", "quad", (unsigned long long)stats.quad_tests,
+            (unsigned long long)stats.quad_hits, _hit_ratio(stats.quad_hits, stats.quad_tests));
+    message("    %-20s %16llu %16llu %8.2f\n", "cylinder", (unsigned long long)stats.cylinder_tests,
+            (unsigned long long)stats.cylinder_hits, _hit_ratio(stats.cylinder_hits, stats.cylinder_tests));
+}
+
+void write_stats_json(const string& filename, const RayStats& stats, double seconds) {
+    auto f = fopen(filename.c_str(), "w");
+    error_if_not(f, "cannot open file: %s\n", filename.c_str());
+    fprintf(f, "{\n");
+    fprintf(f, "    \"camera_rays\": %llu,\n", (unsigned long long)stats.camera_rays);
+    fprintf(f, "    \"shadow_rays\": %llu,\n", (unsigned long long)stats.shadow_rays);
+    fprintf(f, "    \"reflection_rays\": %llu,\n", (unsigned long long)stats.reflection_rays);
+    fprintf(f, "    \"max_depth\": %llu,\n", (unsigned long long)stats.max_depth);
+    fprintf(f, "    \"avg_depth\": %f,\n", stats.avg_depth());
+    fprintf(f, "    \"sphere_tests\": %llu,\n", (unsigned long long)stats.sphere_tests);
+    fprintf(f, "    \"sphere_hits\": %llu,\n", (unsigned long long)stats.sphere_hits);
+    fprintf(f, "    \"quad_tests\": %llu,\n", (unsigned long long)stats.quad_tests);
+    fprintf(f, "    \"quad_hits\": %llu,\n", (unsigned long long)stats.quad_hits);
+    fprintf(f, "    \"cylinder_tests\": %llu,\n", (unsigned long long)stats.cylinder_tests);
+    fprintf(f, "    \"cylinder_hits\": %llu,\n", (unsigned long long)stats.cylinder_hits);
+    fprintf(f, "    \"node_visits\": %llu,\n", (unsigned long long)stats.node_visits);
+    fprintf(f, "    \"primitives\": %llu,\n", (unsigned long long)stats.primitives);
+    fprintf(f, "    \"oversized\": %llu,\n", (unsigned long long)stats.oversized);
+    fprintf(f, "    \"accel_bytes\": %llu,\n", (unsigned long long)stats.accel_bytes);
+    fprintf(f, "    \"accel_bytes_per_primitive\": %f,\n", stats.accel_bytes_per_primitive());
+    fprintf(f, "    \"accel_build_ms\": %f,\n", stats.accel_build_usec / 1e3);
+    fprintf(f, "    \"accel_build_ms_per_mprim\": %f,\n", stats.accel_build_ms_per_mprim());
+    fprintf(f, "    \"page_lookups\": %llu,\n", (unsigned long long)stats.page_lookups);
+    fprintf(f, "    \"page_loads\": %llu,\n", (unsigned long long)stats.page_loads);
+    fprintf(f, "    \"page_hit_rate\": %f,\n", stats.page_hit_rate());
+    fprintf(f, "    \"page_bytes_read\": %llu,\n", (unsigned long long)stats.page_bytes_read);
+    fprintf(f, "    \"seconds\": %f,\n", seconds);
+    fprintf(f, "    \"rays_per_sec\": %f\n", (seconds > 0) ? stats.rays() / seconds : 0.0);
+    fprintf(f, "}\n");
+    fclose(f);
+}
@@ -0,0 +1,72 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include "common.h"
+#include <cstdint>
+
+// ray tracing counters. each rendering thread increments its own record
+// (bound with stats_bind), and records are summed when rendering ends.
+struct RayStats {
+    uint64_t    camera_rays = 0;        // camera rays
+    uint64_t    shadow_rays = 0;        // shadow rays
+    uint64_t    reflection_rays = 0;    // reflection rays
+    uint64_t    max_depth = 0;          // max recursion depth reached
+    uint64_t    sphere_tests = 0;       // ray-sphere tests
+    uint64_t    sphere_hits = 0;        // ray-sphere hits
+    uint64_t    quad_tests = 0;         // ray-quad tests
+    uint64_t    quad_hits = 0;          // ray-quad hits
+    uint64_t    cylinder_tests = 0;     // ray-cylinder tests
+    uint64_t    cylinder_hits = 0;      // ray-cylinder hits
+    uint64_t    node_visits = 0;        // bvh nodes or grid cells visited
+    uint64_t    primitives = 0;         // surfaces in the scene
+    uint64_t    oversized = 0;          // surfaces kept out of the accelerator (see oversized_surfaces)
+    uint64_t    accel_bytes = 0;        // acceleration structure footprint (see accelerator_memory)
+    uint64_t    accel_build_usec = 0;   // acceleration structure build time in microseconds
+    uint64_t    page_lookups = 0;       // out-of-core cluster pages looked up (once per ray and cluster)
+    uint64_t    page_loads = 0;         // out-of-core cluster pages read from disk
+    uint64_t    page_bytes_read = 0;    // out-of-core bytes read from disk
+
+    // total number of rays
+    uint64_t rays() const { return camera_rays + shadow_rays + reflection_rays; }
+    // average recursion depth of the camera paths (each reflection adds one level)
+    double avg_depth() const { return (camera_rays) ? (double)reflection_rays / camera_rays : 0; }
+    // acceleration structure bytes per primitive
+    double accel_bytes_per_primitive() const { return (primitives) ? (double)accel_bytes / primitives : 0; }
+    // acceleration structure build milliseconds per million primitives
+    double accel_build_ms_per_mprim() const { return (primitives) ? accel_build_usec * 1e3 / primitives : 0; }
+    // percentage of the out-of-core page lookups served by resident pages
+    double page_hit_rate() const { return (page_lookups) ? 100.0 * (page_lookups - page_loads) / page_lookups : 0; }
+};
+
+// sums counters (max_depth and the scene sizes are maxed)
+RayStats& operator+=(RayStats& a, const RayStats& b);
+
+// counters of the current thread (nullptr if none are bound)
+extern thread_local RayStats* _stats_thread;
+
+// binds the counters incremented by the current thread (nullptr to stop counting)
+inline void stats_bind(RayStats* stats) { _stats_thread = stats; }
+
+// increment a counter of the current thread
+#ifndef RAYTRACE_NO_STATS
+#define STATS_INC(counter) do { if(_stats_thread) _stats_thread->counter ++; } while(false)
+#define STATS_MAX(counter, value) do { if(_stats_thread and _stats_thread->counter < (uint64_t)(value)) _stats_thread->counter = (value); } while(false)
+#define STATS_ADD(counter, value) do { if(_stats_thread) _stats_thread->counter += (value); } while(false)
+#else
+#define STATS_INC(counter) do { } while(false)
+#define STATS_MAX(counter, value) do { } while(false)
+#define STATS_ADD(counter, value) do { } while(false)
+#endif
+
+// adds counters to the totals of the process (thread safe)
+void stats_accumulate(const RayStats& stats);
+// totals of the process
+RayStats stats_total();
+
+// prints a summary table of the counters (rays/sec computed over seconds if positive, which
+// should only count the time spent tracing: the accelerator build is reported on its own)
+void print_stats(const RayStats& stats, double seconds = 0);
+// writes the counters as a json object
+void write_stats_json(const string& filename, const RayStats& stats, double seconds = 0);
+
+#endif
@@ -0,0 +1,91 @@
+#include "trace.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+
+// events kept per thread (older events are overwritten)
+#define trace_buffer_size 16384
+
+// recorded event
+struct _TraceEvent {
+    const char*     name;       // event name
+    const char*     cat;        // event category
+    uint64_t        start;      // start time (us)
+    uint64_t        end;        // end time (us)
+    int             arg;        // argument (-1 for none)
+};
+
+// ring buffer of a thread; only the owning thread writes it
+struct _TraceBuffer {
+    int                     tid = 0;        // thread index in the trace
+    string                  name;           // thread name
+    vector<_TraceEvent>     events;         // ring storage
+    std::atomic<uint64_t>   count;          // events written so far
+
+    _TraceBuffer(int tid, const string& name) : tid(tid), name(name), events(trace_buffer_size) { count = 0; }
+};
+
+static const auto _trace_origin = std::chrono::steady_clock::now();
+static std::atomic<bool> _trace_enabled(false);
+// buffers of all threads that recorded (kept alive after the threads exit)
+static vector<std::unique_ptr<_TraceBuffer>> _trace_buffers;
+static std::mutex _trace_buffers_mutex;
+// buffer and name of the current thread
+static thread_local _TraceBuffer* _trace_thread = nullptr;
+static thread_local string _trace_thread_name;
+
+uint64_t trace_now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _trace_origin).count();
+}
+
+void trace_enable(bool enabled) { _trace_enabled = enabled; }
+bool trace_enabled() { return _trace_enabled.load(std::memory_order_relaxed); }
+
+void trace_thread_name(const string& name) {
+    _trace_thread_name = name;
+    if(_trace_thread) {
+        std::lock_guard<std::mutex> lock(_trace_buffers_mutex);
+        _trace_thread->name = name;
+    }
+}
+
+void trace_record(const char* name, const char* cat, uint64_t start, uint64_t end, int arg) {
+    // register the buffer of the thread on its first event
+    if(not _trace_thread) {
+        std::lock_guard<std::mutex> lock(_trace_buffers_mutex);
+        auto tid = (int)_trace_buffers.size();
+        auto thread_name = (_trace_thread_name != "") ? _trace_thread_name : tostring("thread %d", tid);
+        _trace_buffers.push_back(std::unique_ptr<_TraceBuffer>(new _TraceBuffer(tid, thread_name)));
+        _trace_thread = _trace_buffers.back().get();
+    }
+    auto n = _trace_thread->count.load(std::memory_order_relaxed);
+    _trace_thread->events[n % trace_buffer_size] = _TraceEvent{name, cat, start, end, arg};
+    _trace_thread->count.store(n+1, std::memory_order_release);
+}
+
+void write_trace_json(const string& filename) {
+    auto f = fopen(filename.c_str(), "w");
+    error_if_not(f, "cannot open file: %s\n", filename.c_str());
+    std::lock_guard<std::mutex> lock(_trace_buffers_mutex);
+    fprintf(f, "{\"traceEvents\":[\n");
+    auto first = true;
+    for(auto& buffer : _trace_buffers) {
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                (first) ? "" : ",\n", buffer->tid, buffer->name.c_str());
+        first = false;
+        auto count = buffer->count.load(std::memory_order_acquire);
+        auto begin = (count > trace_buffer_size) ? count - trace_buffer_size : 0;
+        for(auto i = begin; i < count; i ++) {
+            auto& event = buffer->events[i % trace_buffer_size];
+            fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":1,\"tid\":%d",
+                    event.name, event.cat, (unsigned long long)event.start,
+                    (unsigned long long)(event.end - event.start), buffer->tid);
+            if(event.arg >= 0) fprintf(f, ",\"args\":{\"id\":%d}", event.arg);
+            fprintf(f, "}");
+        }
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+}
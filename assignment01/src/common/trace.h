@@ -0,0 +1,46 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include "common.h"
+#include <cstdint>
+
+// phase timers. scopes record complete events into a ring buffer owned by the
+// calling thread (no locks on the recording path); the events of all threads
+// are exported as a chrome trace_event json file (chrome://tracing, perfetto).
+
+// microseconds since the process started
+uint64_t trace_now();
+
+// starts/stops recording events (disabled by default)
+void trace_enable(bool enabled = true);
+// whether events are being recorded
+bool trace_enabled();
+
+// records an event [start,end) for the current thread. name and cat are not
+// copied, so they must be string literals. arg is exported if not negative
+void trace_record(const char* name, const char* cat, uint64_t start, uint64_t end, int arg = -1);
+// names the current thread in the exported trace
+void trace_thread_name(const string& name);
+
+// times the enclosing scope
+struct TraceScope {
+    const char*     name;       // event name
+    const char*     cat;        // event category
+    int             arg;        // event argument (e.g. tile or frame index)
+    bool            active;     // whether recording was enabled at construction
+    uint64_t        start;      // start time
+
+    TraceScope(const char* name, const char* cat, int arg = -1) :
+        name(name), cat(cat), arg(arg), active(trace_enabled()), start((active) ? trace_now() : 0) { }
+    ~TraceScope() { if(active) trace_record(name, cat, start, trace_now(), arg); }
+};
+
+#define _TRACE_CONCAT(a,b) a##b
+#define _TRACE_VARNAME(line) _TRACE_CONCAT(_trace_scope_,line)
+// times the enclosing scope as the event name in category cat (optional int argument)
+#define TRACE_SCOPE(...) TraceScope _TRACE_VARNAME(__LINE__)(__VA_ARGS__)
+
+// writes the recorded events of all threads as a chrome trace_event json file
+void write_trace_json(const string& filename);
+
+#endif
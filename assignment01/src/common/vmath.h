@@ -5,6 +5,17 @@
 #include <cstdlib>
 #include <array>
 
+// optional simd backend for the hot vec3f/frame3f operations (build with VMATH_SIMD).
+// vec3f keeps its 3-float layout, so images and arrays of vectors are unaffected, and
+// the operations round as the scalar ones do, so both backends render the same images.
+#if defined(VMATH_SIMD) && (defined(__SSE__) || defined(_M_X64))
+#include <xmmintrin.h>
+#define VMATH_SIMD_SSE
+#elif defined(VMATH_SIMD) && defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define VMATH_SIMD_NEON
+#endif
+
 #define PIf 3.14159265f
 #define PI 3.1415926535897932384626433832795
 
@@ -187,6 +198,49 @@ inline vec3f exp(const vec3f& a) { return vec3f(exp(a.x),exp(a.y),exp(a.z)); }
 
 inline vec3f abs(const vec3f& a) { return vec3f(fabs(a.x),fabs(a.y),fabs(a.z)); }
 
+#if defined(VMATH_SIMD_SSE) || defined(VMATH_SIMD_NEON)
+// 3d vector simd helpers ---------------------------
+// vec3f is loaded in the first three lanes, the last lane is zero
+#ifdef VMATH_SIMD_SSE
+typedef __m128 vec4s;
+inline vec4s simd_load(const vec3f& a) { return _mm_setr_ps(a.x, a.y, a.z, 0); }
+inline vec3f simd_store(vec4s a) { float v[4]; _mm_storeu_ps(v, a); return vec3f(v[0], v[1], v[2]); }
+inline vec4s simd_splat(float a) { return _mm_set1_ps(a); }
+inline vec4s simd_add(vec4s a, vec4s b) { return _mm_add_ps(a, b); }
+inline vec4s simd_sub(vec4s a, vec4s b) { return _mm_sub_ps(a, b); }
+inline vec4s simd_mul(vec4s a, vec4s b) { return _mm_mul_ps(a, b); }
+inline vec4s simd_div(vec4s a, vec4s b) { return _mm_div_ps(a, b); }
+inline vec4s simd_yzx(vec4s a) { return _mm_shuffle_ps(a, a, _MM_SHUFFLE(3,0,2,1)); }
+// sum of the first three lanes, as (x+y)+z like the scalar dot product
+inline float simd_hsum(vec4s a) { return _mm_cvtss_f32(_mm_add_ss(_mm_add_ss(a, _mm_shuffle_ps(a, a, 1)), _mm_movehl_ps(a, a))); }
+#else
+typedef float32x4_t vec4s;
+inline vec4s simd_load(const vec3f& a) { float v[4] = { a.x, a.y, a.z, 0 }; return vld1q_f32(v); }
+inline vec3f simd_store(vec4s a) { float v[4]; vst1q_f32(v, a); return vec3f(v[0], v[1], v[2]); }
+inline vec4s simd_splat(float a) { return vdupq_n_f32(a); }
+inline vec4s simd_add(vec4s a, vec4s b) { return vaddq_f32(a, b); }
+inline vec4s simd_sub(vec4s a, vec4s b) { return vsubq_f32(a, b); }
+inline vec4s simd_mul(vec4s a, vec4s b) { return vmulq_f32(a, b); }
+inline vec4s simd_div(vec4s a, vec4s b) { return vdivq_f32(a, b); }
+inline vec4s simd_yzx(vec4s a) { auto v = vextq_f32(a, a, 1); return vsetq_lane_f32(0, vsetq_lane_f32(vgetq_lane_f32(a, 0), v, 2), 3); }
+// sum of the first three lanes, as (x+y)+z like the scalar dot product
+inline float simd_hsum(vec4s a) { auto s = vget_low_f32(a); return vget_lane_f32(vpadd_f32(s, s), 0) + vgetq_lane_f32(a, 2); }
+#endif
+
+// 3d vector operations -----------------------------
+// dot product
+inline float dot(const vec3f& a, const vec3f& b) { return simd_hsum(simd_mul(simd_load(a), simd_load(b))); }
+// length and lengthSqr
+inline float length(const vec3f& a) { return sqrt(dot(a,a)); }
+inline float lengthSqr(const vec3f& a) { return dot(a,a); }
+// normnalization (zero vectors stay zero)
+inline vec3f normalize(const vec3f& a) { auto v = simd_load(a); auto l = sqrt(simd_hsum(simd_mul(v, v))); if (l==0) return zero3f; else return simd_store(simd_div(v, simd_splat(l))); }
+// distance and diatcne squared
+inline float dist(const vec3f& a, const vec3f& b) { return length(a-b); }
+inline float distSqr(const vec3f& a, const vec3f& b) { return lengthSqr(a-b); }
+// cross product
+inline vec3f cross(const vec3f& a, const vec3f& b) { auto va = simd_load(a), vb = simd_load(b); return simd_store(simd_yzx(simd_sub(simd_mul(va, simd_yzx(vb)), simd_mul(simd_yzx(va), vb)))); }
+#else
 // 3d vector operations -----------------------------
 // dot product
 inline float dot(const vec3f& a, const vec3f& b) { return a.x*b.x+a.y*b.y+a.z*b.z; }
@@ -200,6 +254,7 @@ inline float dist(const vec3f& a, const vec3f& b) { return length(a-b); }
 inline float distSqr(const vec3f& a, const vec3f& b) { return lengthSqr(a-b); }
 // cross product
 inline vec3f cross(const vec3f& a, const vec3f& b) { return vec3f(a.y*b.z-a.z*b.y,a.z*b.x-a.x*b.z,a.x*b.y-a.y*b.x); }
+#endif
 // orthonormalization in the given order
 inline void orthonormalize_zyx(vec3f& x, vec3f& y, vec3f& z) { z = normalize(z); x = normalize(cross(y,z)); y = normalize(cross(z,x)); }
 inline void orthonormalize_zxy(vec3f& x, vec3f& y, vec3f& z) { z = normalize(z); y = normalize(cross(z,x)); x = normalize(cross(y,z)); }
@@ -503,10 +558,17 @@ inline frame3f frame_from_z(const vec3f& z) { auto f = identity_frame3f; f.z = n
 inline frame3f lookat_frame(const vec3f& eye, const vec3f& center, const vec3f& up, bool flipped = false) { auto f = frame3f(); f.o = eye; f.z = normalize(center-eye); if(flipped) f.z = -f.z; f.y = up; f = orthonormalize_zyx(f); return f; }
 
 // frame-element transforms -------------------------
+#if defined(VMATH_SIMD_SSE) || defined(VMATH_SIMD_NEON)
+// transform a vector by a frame
+inline vec3f transform_vector(const frame3f& f, const vec3f& v) { return simd_store(simd_add(simd_add(simd_mul(simd_load(f.x), simd_splat(v.x)), simd_mul(simd_load(f.y), simd_splat(v.y))), simd_mul(simd_load(f.z), simd_splat(v.z)))); }
+// transform a point by a frame
+inline vec3f transform_point(const frame3f& f, const vec3f& v) { return simd_store(simd_add(simd_add(simd_add(simd_load(f.o), simd_mul(simd_load(f.x), simd_splat(v.x))), simd_mul(simd_load(f.y), simd_splat(v.y))), simd_mul(simd_load(f.z), simd_splat(v.z)))); }
+#else
 // transform a point by a frame
 inline vec3f transform_point(const frame3f& f, const vec3f& v) { return f.o + f.x * v.x + f.y * v.y + f.z * v.z; }
 // transform a vector by a frame
 inline vec3f transform_vector(const frame3f& f, const vec3f& v) { return f.x * v.x + f.y * v.y + f.z * v.z; }
+#endif
 // transform a vector by a direciton
 inline vec3f transform_direction(const frame3f& f, const vec3f& v) { return transform_vector(f,v); }
 // transform a normal by a frame
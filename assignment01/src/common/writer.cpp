@@ -0,0 +1,69 @@
+#include "writer.h"
+#include "trace.h"
+
+ImageWriter::ImageWriter(int nthreads, int max_queued) :
+    _max_queued(max(1,max_queued)), _max_pooled(max(1,max_queued)+max(1,nthreads)) {
+    for(auto n = max(1,nthreads); n > 0; n --) _threads.push_back(std::thread([this](){ _work(); }));
+}
+
+ImageWriter::~ImageWriter() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _quit = true;
+    }
+    _queued_cv.notify_all();
+    for(auto& thread : _threads) thread.join();
+}
+
+image3f ImageWriter::acquire(int w, int h) {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for(auto i : range(_pool.size())) {
+            if(_pool[i].width() != w or _pool[i].height() != h) continue;
+            auto img = std::move(_pool[i]);
+            _pool.erase(_pool.begin()+i);
+            return img;
+        }
+    }
+    return image3f(w,h);
+}
+
+void ImageWriter::write(const string& filename, image3f&& img, bool flipY) {
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _written_cv.wait(lock, [this](){ return (int)_queue.size() < _max_queued; });
+        _queue.push_back(_Job{filename, std::move(img), flipY});
+    }
+    _queued_cv.notify_one();
+}
+
+void ImageWriter::flush() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _written_cv.wait(lock, [this](){ return _queue.empty() and not _writing; });
+}
+
+void ImageWriter::_work() {
+    trace_thread_name("writer");
+    while(true) {
+        auto job = _Job();
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            // drain the queue before quitting
+            _queued_cv.wait(lock, [this](){ return _quit or not _queue.empty(); });
+            if(_queue.empty()) return;
+            job = std::move(_queue.front());
+            _queue.pop_front();
+            _writing ++;
+        }
+        _written_cv.notify_all();
+        auto ext = (job.filename.size() > 4) ? job.filename.substr(job.filename.size()-4) : "";
+        if(ext == ".pfm") write_pfm(job.filename, job.img, job.flipY);
+        else write_png(job.filename, job.img, job.flipY);
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _writing --;
+            if((int)_pool.size() < _max_pooled) _pool.push_back(std::move(job.img));
+        }
+        _written_cv.notify_all();
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef _WRITER_H_
+#define _WRITER_H_
+
+#include "image.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+// asynchronous image output stage: finished images are moved into a bounded
+// queue and encoded by dedicated writer threads, so that encoding overlaps
+// with rendering. written images are kept in a buffer pool for reuse.
+struct ImageWriter {
+    // start nthreads writer threads with a queue of at most max_queued images
+    ImageWriter(int nthreads = 1, int max_queued = 4);
+    // wait for the queued images to be written and stop the writer threads
+    ~ImageWriter();
+
+    // get an image of size (w,h) from the buffer pool (allocated if none is free).
+    // the pixel values are undefined
+    image3f acquire(int w, int h);
+    // queue an image for writing, taking ownership of its pixels (blocks while the
+    // queue is full). the format is picked from the extension (.pfm or .png)
+    void write(const string& filename, image3f&& img, bool flipY = false);
+    // wait until all queued images are written
+    void flush();
+
+private:
+    // queued write
+    struct _Job {
+        string      filename;   // output filename
+        image3f     img;        // image to write
+        bool        flipY;      // whether to flip the image
+    };
+
+    void _work();
+
+    vector<std::thread>         _threads;               // writer threads
+    std::deque<_Job>            _queue;                 // pending writes
+    vector<image3f>             _pool;                  // written images available for reuse
+    int                         _max_queued = 4;        // queue capacity
+    int                         _max_pooled = 8;        // pool capacity
+    int                         _writing = 0;           // writes in progress
+    bool                        _quit = false;          // tells the threads to exit
+    std::mutex                  _mutex;                 // guards the state above
+    std::condition_variable     _queued_cv;             // signals a job was queued (or quit)
+    std::condition_variable     _written_cv;            // signals a job was written
+};
+
+#endif